@@ -6,17 +6,108 @@
 #include <glm/gtx/hash.hpp>
 #include <map>
 #include <unordered_map>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cfloat>
+#include <climits>
+#include <cstring>
+#include <algorithm>
+#include <numeric>
+#include <functional>
+#include <tuple>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <chrono>
 #include <time.h>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE__)
+#include <xmmintrin.h>
+#define BVH_SSE
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 void processInput(GLFWwindow *window);
+bool key_pressed(GLFWwindow* window, int key);
 
 // settings
 const unsigned int SCR_WIDTH = 600;
 const unsigned int SCR_HEIGHT = 600;
+const char* const WINDOW_TITLE = "CS177 Final Project";
 const int NUM_OBJS = 10;
+const int NUM_RANDOM_OBJS = 0; // extra spheres scattered around the hand-placed ones, for stress testing
+const int NUM_EXTRA_LAMPS = 0; // static lamp gizmos besides the point light's, for stress testing the instanced lamp draw
+const bool USE_GPU_DRIVEN = true; // compute culling + multi-draw indirect, only if we got a 4.3+ context
+const float TESS_PIXELS = 8.f; // target edge length on screen for the tessellation path (4.0+)
+const int MAX_PROCEDURAL_LEVEL = 8; // subdivision range of the buffer-free path, [ and ] change it
+const float IMPOSTOR_DISTANCE = 5.f; // impostor path: spheres closer than this stay meshes
+const bool USE_DEPTH_PREPASS = false; // classic path: depth-only pass first, then shade with GL_EQUAL (P toggles)
+const bool SORT_FRONT_TO_BACK = true; // classic path: draw nearest objects first (O toggles)
+const bool USE_DYNAMIC_RESOLUTION = true; // scale the offscreen target to hold FRAME_BUDGET_MS of gpu time (R toggles)
+const float FRAME_BUDGET_MS = 16.6f;
+const float MIN_RENDER_SCALE = 0.5f; // of the window size, per axis
+const float MAX_RENDER_SCALE = 1.f;
+const float UPSCALE_SHARPNESS = 0.5f; // 0 = plain bilinear upscale (U toggles between the two)
+const bool USE_LIGHTING_LOD = true; // classic path: small spheres get lit per vertex (L toggles)
+const float VERTEX_LIGHTING_PIXELS = 24.f; // projected radius below which that happens, - and = halve / double it at runtime
+const GLuint TILE_CAPACITY = 16384; // spheres per scene tile at most, the unit of streaming
+const float SCENE_TILE_SIZE = 10.f; // edge of the grid cells scenes are tiled with
+const size_t STREAM_BUDGET_MB = 256; // gpu memory for resident tiles
+const int STREAM_MAX_IN_FLIGHT = 8; // tiles the loader thread may be working on
+const int STREAM_UPLOADS_PER_FRAME = 4;
+const float STREAM_MIN_TILE_PIXELS = 2.f; // tiles with a smaller projected radius aren't loaded
+const int MAX_MESH_LEVEL = 7; // classic path sphere mesh, N and M step through 0..this on the asset worker
+const bool USE_BVH_CULLING = true; // classic path: only submit objects the bvh finds in the frustum (B toggles)
+const float BVH_REBUILD_SECONDS = 2.f; // refitted bvhs get rebuilt in the background at most this often
+const int SELECT_RAY_SPACING = 8; // window pixels between the rays of a selection (K)
+const bool USE_HIZ_CULLING = true; // classic + gpu-driven paths: skip spheres hidden behind last frame's depth (H toggles)
+const int HIZ_READBACK_TEXELS = 128; // classic path tests on the cpu, against pyramid levels from this size down
+const bool USE_DISPLACEMENT = false; // classic + gpu-driven paths: animate the sphere surfaces in the vertex shaders (V toggles)
+const GLuint DISPLACE_ATTRIB = 4; // attribute location of the displace.glsl parameters in the classic path's shaders
+const bool USE_DISPLACE_CACHE = true; // classic path: displace each object once, every pass draws the captured mesh (C toggles)
+const size_t DISPLACE_CACHE_MB = 64; // captured meshes kept at most; T pauses the animation so they stay valid
+const bool USE_COMMAND_THREADS = true; // classic path: workers record the draws while the gl thread presents the last frame (X toggles)
+const size_t COMMAND_GRAIN = 256; // objects per recording chunk, at least
+const bool USE_GL_COUNTERS = false; // count gl calls per frame by entry point, in the stats and the window title (I toggles)
+const bool USE_PHYSICS = false; // spheres fall and collide, every path draws them where they are (F toggles)
+const float PHYSICS_STEP = 1.f / 120.f; // seconds per substep
+const int PHYSICS_MAX_SUBSTEPS = 4; // per frame, the simulation slows down past that
+const float PHYSICS_RESTITUTION = 0.5f; // 1 = elastic (E switches between the two)
+const float PHYSICS_RELAXATION = 0.5f; // fraction of an overlap a contact removes per substep, less jitter in piles
+const bool USE_GPU_PARTICLES = false; // spheres swarm around the point light, simulated on the gpu (J toggles, F and J exclude each other)
+const float PARTICLE_ATTRACTION = 4.f; // pull toward the light, m/s^2
+const float PARTICLE_DRAG = 0.05f; // per second
+const bool USE_NBODY = false; // spheres pull on each other, barnes-hut on the cpu (Y toggles, F, J and Y exclude each other)
+const float NBODY_G = 1.f; // gravitational constant, with mass = radius^3
+const float NBODY_SOFTENING = 0.5f; // keeps close passes from flinging spheres away
+const float NBODY_THETA = 0.5f; // opening angle, cells smaller than this (size / distance) count as one mass (, and . change it)
+const float NBODY_STEP = 1.f / 60.f; // seconds per step
+const int NBODY_MAX_STEPS = 2; // per frame
+const GLuint NBODY_LEAF_SIZE = 8; // bodies a leaf holds at most, unless the tree ran out of levels
+const GLuint NBODY_GROUP_SIZE = 32; // bodies that share one walk of the tree
+const int NBODY_DEPTH = 16; // octree levels below the root, the morton codes have 3 bits per level
+const float NEAR_PLANE = .1f;
+const float FAR_PLANE = 100.f;
+const int NUM_LODS = 4; // must match cull.csh
+const int LOD_LEVELS[NUM_LODS] = { 4, 3, 2, 1 }; // icosphere recursion level per lod
+const float LOD_PIXELS[NUM_LODS - 1] = { 48.f, 16.f, 6.f }; // min projected radius (pixels) for lods 0..2
 
 struct Vertex {
 	glm::vec3 position;
@@ -67,176 +158,5370 @@ struct SpotLight {
 	float outerCutOff;
 };
 
-// need to adjust it based on offset of 
-struct Icosphere {
-	// magic constants
-	// source: https://schneide.blog/2016/07/15/generating-an-icosphere-in-c/
-	const float X = (float)((1.0f + sqrt(5.0f)) / 2.0f); //.525731112119133606f;
-	const float Z = 1.f; //.850650808352039932f;
-	const float N = 0.f;
-	// sphere vertices
-	std::vector<Vertex> icosphere_vertices;
-	std::unordered_map<glm::vec3, int, std::hash<glm::vec3>> icosphere_vertices_lookup_table;
-	// sphere indexing
-	std::vector<GLuint> icosphere_triangle_elements;
-	std::map<long long, int> cache;
-	int index;
+// memory a sphere build had at one point: the most it held during a stage, and what was still live after it
+struct SubdivisionStage {
+	std::string name;
+	size_t peak_bytes;
+	size_t retained_bytes;
+};
+
+void print_subdivision_stages(std::ostream& out, const char* base, int level, const std::vector<SubdivisionStage>& stages) {
+	out << base << " level " << level << " memory, peak / retained KB:";
+	for (size_t i = 0; i < stages.size(); i++)
+		out << (i ? ", " : " ") << stages[i].name << " " << (stages[i].peak_bytes + 1023) / 1024 << " / " << (stages[i].retained_bytes + 1023) / 1024;
+	out << std::endl;
+}
+
+// what SubdivisionSphere::generate() hands back: only the mesh, none of the builder's scratch
+// move-only, so a copy of a big mesh can't sneak in between generating it and uploading it
+template <typename Layout>
+struct SubdivisionMesh {
+	std::vector<Layout> vertices;
+	std::vector<GLuint> elements;
+	int level;
+	std::vector<SubdivisionStage> stages;
+
+	SubdivisionMesh() : level(0) {}
+	SubdivisionMesh(SubdivisionMesh&&) = default;
+	SubdivisionMesh& operator=(SubdivisionMesh&&) = default;
+	SubdivisionMesh(const SubdivisionMesh&) = delete;
+	SubdivisionMesh& operator=(const SubdivisionMesh&) = delete;
+
+	size_t bytes() const {
+		return vertices.capacity() * sizeof(Layout) + elements.capacity() * sizeof(GLuint);
+	}
+
+	// the cpu copy isn't needed once it's in a buffer object
+	void release() {
+		std::vector<Layout>().swap(vertices);
+		std::vector<GLuint>().swap(elements);
+		stages.push_back({ "uploaded", 0, 0 });
+	}
+
+	// largest over smallest triangle area, 1 would be perfectly even
+	float area_ratio() const {
+		float lo = FLT_MAX, hi = 0.f;
+		for (size_t i = 0; i + 2 < elements.size(); i += 3) {
+			glm::vec3 a = vertices[elements[i]].position;
+			float area = glm::length(glm::cross(vertices[elements[i + 1]].position - a, vertices[elements[i + 2]].position - a));
+			lo = std::min(lo, area);
+			hi = std::max(hi, area);
+		}
+		return lo > 0.f ? hi / lo : 0.f;
+	}
+};
+
+// edge -> the vertex at its midpoint, open addressing on the (smaller, larger) index pair
+// a level only ever looks up its own edges, so the table is cleared between levels and sized for the one at hand
+struct EdgeMidpointCache {
+	static const unsigned long long EMPTY = ~0ull;
+	std::vector<unsigned long long> keys;
+	std::vector<GLuint> values;
+	int bits;
+
+	EdgeMidpointCache() : bits(0) {}
+
+	// room for this many edges at most half full, empty; grows only if the table was smaller
+	void reset(size_t edges) {
+		bits = 4;
+		while (((size_t)1 << bits) < edges * 2)
+			bits++;
+		size_t size = (size_t)1 << bits;
+		if (keys.size() < size) {
+			keys.resize(size);
+			values.resize(size);
+		}
+		std::fill(keys.begin(), keys.begin() + size, (unsigned long long)EMPTY);
+	}
+
+	// the value slot for edge (a, b); inserted tells whether it has to be filled in
+	GLuint& find(GLuint a, GLuint b, bool& inserted) {
+		unsigned long long key = a < b ? ((unsigned long long)a << 32) | b : ((unsigned long long)b << 32) | a;
+		size_t mask = ((size_t)1 << bits) - 1;
+		size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+		while (keys[slot] != key && keys[slot] != EMPTY)
+			slot = (slot + 1) & mask;
+		inserted = keys[slot] == EMPTY;
+		keys[slot] = key;
+		return values[slot];
+	}
+
+	size_t bytes() const {
+		return keys.capacity() * sizeof(unsigned long long) + values.capacity() * sizeof(GLuint);
+	}
+};
+
+// scratch for subdivision, kept by whoever builds spheres repeatedly so later builds don't allocate
+// two face lists that trade places every level, both with room for the last level's faces up front, and the edge cache
+struct SubdivisionArena {
+	std::vector<glm::uvec3> faces, next_faces;
+	EdgeMidpointCache edges;
+
+	void reserve(size_t face_count) {
+		faces.reserve(face_count);
+		next_faces.reserve(face_count);
+	}
+
+	size_t bytes() const {
+		return (faces.capacity() + next_faces.capacity()) * sizeof(glm::uvec3) + edges.bytes();
+	}
+
+	// hands the memory back once no more builds are coming
+	void release() {
+		std::vector<glm::uvec3>().swap(faces);
+		std::vector<glm::uvec3>().swap(next_faces);
+		edges = EdgeMidpointCache();
+	}
+};
+
+// base polyhedra for SubdivisionSphere: corners and faces (wound like the original icosahedron), where a
+// new vertex goes while subdividing (on_base) and how the finished points map onto the unit sphere (to_sphere)
+struct Icosahedron {
+	static const int CORNERS = 12;
+	static const int FACES = 20;
+	static const char* name() { return "icosahedron"; }
+	static glm::vec3 corner(int i) {
+		// magic constants
+		// source: https://schneide.blog/2016/07/15/generating-an-icosphere-in-c/
+		const float X = (float)((1.0f + sqrt(5.0f)) / 2.0f); //.525731112119133606f;
+		const float Z = 1.f; //.850650808352039932f;
+		const float N = 0.f;
+		const glm::vec3 corners[CORNERS] = {
+			glm::vec3(-X, N, Z), glm::vec3(X, N, Z), glm::vec3(-X, N, -Z), glm::vec3(X, N, -Z),
+			glm::vec3(N, Z, X), glm::vec3(N, Z, -X), glm::vec3(N, -Z, X), glm::vec3(N, -Z, -X),
+			glm::vec3(Z, X, N), glm::vec3(-Z, X, N), glm::vec3(Z, -X, N), glm::vec3(-Z, -X, N)
+		};
+		return corners[i];
+	}
+	static glm::uvec3 face(int i) {
+		static const GLuint faces[FACES][3] = {
+			{ 0, 4, 1 }, { 0, 9, 4 }, { 9, 5, 4 }, { 4, 5, 8 }, { 4, 8, 1 },
+			{ 8, 10, 1 }, { 8, 3, 10 }, { 5, 3, 8 }, { 5, 2, 3 }, { 2, 7, 3 },
+			{ 7, 10, 3 }, { 7, 6, 10 }, { 7, 11, 6 }, { 11, 0, 6 }, { 0, 1, 6 },
+			{ 6, 1, 10 }, { 9, 0, 11 }, { 9, 11, 2 }, { 9, 2, 5 }, { 7, 2, 11 }
+		};
+		return glm::uvec3(faces[i][0], faces[i][1], faces[i][2]);
+	}
+	static glm::vec3 on_base(glm::vec3 p) { return glm::normalize(p); }
+	static glm::vec3 to_sphere(glm::vec3 p) { return p; }
+};
+
+// fewer, more uneven triangles than the icosahedron for the same level, but its edges follow the axes
+struct Octahedron {
+	static const int CORNERS = 6;
+	static const int FACES = 8;
+	static const char* name() { return "octahedron"; }
+	static glm::vec3 corner(int i) {
+		const glm::vec3 corners[CORNERS] = {
+			glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0),
+			glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1)
+		};
+		return corners[i];
+	}
+	static glm::uvec3 face(int i) {
+		static const GLuint faces[FACES][3] = {
+			{ 0, 4, 2 }, { 0, 2, 5 }, { 0, 3, 4 }, { 0, 5, 3 },
+			{ 1, 2, 4 }, { 1, 5, 2 }, { 1, 4, 3 }, { 1, 3, 5 }
+		};
+		return glm::uvec3(faces[i][0], faces[i][1], faces[i][2]);
+	}
+	static glm::vec3 on_base(glm::vec3 p) { return glm::normalize(p); }
+	static glm::vec3 to_sphere(glm::vec3 p) { return p; }
+};
+
+// subdivided flat on the cube's faces, then mapped with the area-preserving-ish "spherified cube" formula
+// instead of normalize(), which would bunch triangles up at the face centers
+struct CubeSphere {
+	static const int CORNERS = 8;
+	static const int FACES = 12;
+	static const char* name() { return "cube-sphere"; }
+	static glm::vec3 corner(int i) {
+		return glm::vec3(i & 1 ? 1.f : -1.f, i & 2 ? 1.f : -1.f, i & 4 ? 1.f : -1.f);
+	}
+	static glm::uvec3 face(int i) {
+		static const GLuint faces[FACES][3] = {
+			{ 0, 2, 6 }, { 0, 6, 4 }, { 1, 7, 3 }, { 1, 5, 7 }, { 0, 5, 1 }, { 0, 4, 5 },
+			{ 2, 3, 7 }, { 2, 7, 6 }, { 0, 1, 3 }, { 0, 3, 2 }, { 4, 7, 5 }, { 4, 6, 7 }
+		};
+		return glm::uvec3(faces[i][0], faces[i][1], faces[i][2]);
+	}
+	static glm::vec3 on_base(glm::vec3 p) { return p; }
+	static glm::vec3 to_sphere(glm::vec3 p) {
+		glm::vec3 s = p * p;
+		return glm::vec3(
+			p.x * sqrt(1.f - s.y / 2.f - s.z / 2.f + s.y * s.z / 3.f),
+			p.y * sqrt(1.f - s.z / 2.f - s.x / 2.f + s.z * s.x / 3.f),
+			p.z * sqrt(1.f - s.x / 2.f - s.y / 2.f + s.x * s.y / 3.f));
+	}
+};
+
+// subdivides a base polyhedron recursion_level times (every triangle into 4) and puts the result on the unit sphere
+// both the polyhedron and the vertex layout are template parameters, so each combination gets its own loop with
+// the projection inlined; a Layout needs a position member, set_position() and set_normal(a, b) like Vertex
+template <typename Polyhedron, typename Layout>
+struct SubdivisionSphere {
+	std::vector<Layout> vertices;
+	std::vector<GLuint> elements;
+	std::vector<SubdivisionStage> stages;
 	float scale;
 	int recursion_level;
 	glm::vec3 center;
 
-	Icosphere() : scale(1.f), recursion_level(0), center(glm::vec3(0,0,0)) {
-		index = 0;
+	SubdivisionSphere() : scale(1.f), recursion_level(0), center(glm::vec3(0,0,0)) {}
+	SubdivisionSphere(float _scale, int _recursion_level, glm::vec3 _center) : scale(_scale), recursion_level(_recursion_level), center(_center) {}
+
+	// generates and hands the mesh over; the builder is spent afterwards
+	// the arena's buffers stay with the caller for the next build, so they still count as retained
+	SubdivisionMesh<Layout> generate(SubdivisionArena& arena) {
+		subdivide(arena);
+		SubdivisionMesh<Layout> mesh;
+		mesh.level = recursion_level;
+		mesh.vertices = std::move(vertices);
+		mesh.elements = std::move(elements);
+		stages.push_back({ "mesh out, arena kept", stages.back().retained_bytes, mesh.bytes() + arena.bytes() });
+		mesh.stages = std::move(stages);
+		return mesh;
+	}
+
+	// one-off build: the scratch goes as soon as the mesh is out
+	SubdivisionMesh<Layout> generate() {
+		SubdivisionArena arena;
+		SubdivisionMesh<Layout> mesh = generate(arena);
+		arena.release();
+		mesh.stages.push_back({ "scratch freed", mesh.stages.back().retained_bytes, mesh.bytes() });
+		return mesh;
+	}
+
+	size_t mesh_bytes() const {
+		return vertices.capacity() * sizeof(Layout) + elements.capacity() * sizeof(GLuint);
+	}
+
+	void subdivide(SubdivisionArena& arena) {
+		// Polyhedron::FACES * 4^n faces by the end, and (closed, all triangles) half as many vertices plus 2,
+		// so none of these has to grow
+		size_t face_count = (size_t)Polyhedron::FACES << (2 * recursion_level);
+		vertices.reserve(face_count / 2 + 2);
+		elements.reserve(face_count * 3);
+		arena.reserve(face_count);
+
+		for (int i = 0; i < Polyhedron::CORNERS; i++)
+			add_vertex(Polyhedron::on_base(Polyhedron::corner(i)));
+		std::vector<glm::uvec3>& faces = arena.faces;
+		std::vector<glm::uvec3>& next_faces = arena.next_faces;
+		faces.clear();
+		for (int i = 0; i < Polyhedron::FACES; i++)
+			faces.push_back(Polyhedron::face(i));
+		size_t live = mesh_bytes() + arena.bytes();
+		stages.push_back({ "base", live, live });
+
+		for (int i = 0; i < recursion_level; i++) {
+			// every edge is shared by two faces
+			arena.edges.reset(faces.size() * 3 / 2);
+			next_faces.clear();
+			for (const glm::uvec3& face : faces) {
+				GLuint a = midpoint(arena.edges, face.x, face.y);
+				GLuint b = midpoint(arena.edges, face.y, face.z);
+				GLuint c = midpoint(arena.edges, face.z, face.x);
+				next_faces.push_back(glm::uvec3(face.x, a, c));
+				next_faces.push_back(glm::uvec3(face.y, b, a));
+				next_faces.push_back(glm::uvec3(face.z, c, b));
+				next_faces.push_back(glm::uvec3(a, b, c));
+			}
+			// swaps the buffers, and with them their capacity: neither is ever reallocated
+			faces.swap(next_faces);
+			live = mesh_bytes() + arena.bytes();
+			stages.push_back({ "level " + std::to_string(i + 1), live, live });
+		}
+
+		for (Layout& v : vertices)
+			v.set_position(Polyhedron::to_sphere(v.position));
+		for (const glm::uvec3& face : faces) {
+			vertices[face.x].set_normal(vertices[face.y].position, vertices[face.z].position);
+			vertices[face.y].set_normal(vertices[face.z].position, vertices[face.x].position);
+			vertices[face.z].set_normal(vertices[face.x].position, vertices[face.y].position);
+			elements.push_back(face.x);
+			elements.push_back(face.y);
+			elements.push_back(face.z);
+		}
+		live = mesh_bytes() + arena.bytes();
+		stages.push_back({ "elements", live, live });
+	}
+
+	GLuint add_vertex(glm::vec3 p) {
+		Layout to_insert;
+		to_insert.set_position(p);
+		vertices.push_back(to_insert);
+		return (GLuint)vertices.size() - 1;
+	}
+
+	GLuint midpoint(EdgeMidpointCache& edges, GLuint i1, GLuint i2) {
+		bool inserted;
+		GLuint& slot = edges.find(i1, i2, inserted);
+		if (inserted) {
+			glm::vec3 p1 = vertices[i1].position;
+			glm::vec3 p2 = vertices[i2].position;
+			glm::vec3 mid = glm::vec3((p1.x + p2.x) / 2.0f, (p1.y + p2.y) / 2.0f, (p1.z + p2.z) / 2.0f);
+			slot = add_vertex(Polyhedron::on_base(mid));
+		}
+		return slot;
+	}
+};
+
+typedef SubdivisionSphere<Icosahedron, Vertex> Icosphere;
+typedef SubdivisionMesh<Vertex> IcosphereMesh;
+
+enum SphereBase { BASE_ICOSAHEDRON, BASE_OCTAHEDRON, BASE_CUBE_SPHERE, NUM_SPHERE_BASES };
+const char* const SPHERE_BASE_NAMES[NUM_SPHERE_BASES] = { Icosahedron::name(), Octahedron::name(), CubeSphere::name() };
+
+// the one place the base is picked at runtime, everything below it is compiled per polyhedron
+IcosphereMesh generate_sphere_mesh(SphereBase base, int level, SubdivisionArena& arena) {
+	switch (base) {
+	case BASE_OCTAHEDRON:
+		return SubdivisionSphere<Octahedron, Vertex>(1.f, level, glm::vec3(0, 0, 0)).generate(arena);
+	case BASE_CUBE_SPHERE:
+		return SubdivisionSphere<CubeSphere, Vertex>(1.f, level, glm::vec3(0, 0, 0)).generate(arena);
+	default:
+		return Icosphere(1.f, level, glm::vec3(0, 0, 0)).generate(arena);
+	}
+}
+
+// lsd radix sort of (key, item) pairs, 8 bits per pass, stable
+// only the low key_bits bits of the keys are looked at; the scratch arrays are kept between frames
+template <typename Key>
+struct RadixSorter {
+	std::vector<Key> tmp_keys;
+	std::vector<GLuint> tmp_items;
+
+	void sort(std::vector<Key>& keys, std::vector<GLuint>& items, int key_bits) {
+		size_t n = keys.size();
+		tmp_keys.resize(n);
+		tmp_items.resize(n);
+		for (int shift = 0; shift < key_bits; shift += 8) {
+			size_t offsets[256] = { 0 };
+			for (size_t i = 0; i < n; i++)
+				offsets[(keys[i] >> shift) & 0xff]++;
+			// every key has the same digit here, the pass wouldn't move anything
+			if (n == 0 || offsets[(keys[0] >> shift) & 0xff] == n)
+				continue;
+			size_t sum = 0;
+			for (int d = 0; d < 256; d++) {
+				size_t count = offsets[d];
+				offsets[d] = sum;
+				sum += count;
+			}
+			for (size_t i = 0; i < n; i++) {
+				size_t dst = offsets[(keys[i] >> shift) & 0xff]++;
+				tmp_keys[dst] = keys[i];
+				tmp_items[dst] = items[i];
+			}
+			keys.swap(tmp_keys);
+			items.swap(tmp_items);
+		}
+	}
+};
+
+// remembers what is bound / what every uniform holds, so calls that wouldn't change anything never reach the driver
+// everything in the render loop has to go through here (or call invalidate()) or the cache goes stale
+struct GLStateCache {
+	struct Counter {
+		int issued;
+		int elided;
+	};
+	struct Stats {
+		Counter programs, vaos, uniforms, attribs;
+		int draws;
+	};
+	static const int CACHED_ATTRIBS = 8;
+	Stats current, last_frame;
+	GLuint program, vao;
+	// constant values of attributes that have no array enabled; context state, not per program or vao
+	glm::vec4 attrib_values[CACHED_ATTRIBS];
+	bool attrib_known[CACHED_ATTRIBS];
+	// last bytes written per program, indexed by uniform location
+	std::map<GLuint, std::vector<std::vector<unsigned char>>> uniform_values;
+	std::vector<std::vector<unsigned char>>* program_uniforms;
+
+	GLStateCache() {
+		memset(&current, 0, sizeof(current));
+		memset(&last_frame, 0, sizeof(last_frame));
+		invalidate();
+	}
+
+	// forget everything, for after code that touched gl directly
+	void invalidate() {
+		program = vao = ~0u;
+		uniform_values.clear();
+		program_uniforms = NULL;
+		for (int i = 0; i < CACHED_ATTRIBS; i++)
+			attrib_known[i] = false;
+	}
+
+	void end_frame() {
+		last_frame = current;
+		memset(&current, 0, sizeof(current));
+	}
+
+	void use_program(GLuint p) {
+		if (p == program) {
+			current.programs.elided++;
+			return;
+		}
+		glUseProgram(p);
+		program = p;
+		program_uniforms = &uniform_values[p];
+		current.programs.issued++;
+	}
+
+	void bind_vertex_array(GLuint v) {
+		if (v == vao) {
+			current.vaos.elided++;
+			return;
+		}
+		glBindVertexArray(v);
+		vao = v;
+		current.vaos.issued++;
+	}
+
+	// true if the uniform of the current program has to be written, and remembers the new value
+	bool uniform_changed(GLint loc, const void* data, size_t bytes) {
+		if (loc < 0 || program_uniforms == NULL)
+			return loc >= 0;
+		if (program_uniforms->size() <= (size_t)loc)
+			program_uniforms->resize(loc + 1);
+		std::vector<unsigned char>& value = (*program_uniforms)[loc];
+		if (value.size() == bytes && memcmp(value.data(), data, bytes) == 0) {
+			current.uniforms.elided++;
+			return false;
+		}
+		value.assign((const unsigned char*)data, (const unsigned char*)data + bytes);
+		current.uniforms.issued++;
+		return true;
+	}
+
+	void uniform1i(GLint loc, GLint x) {
+		if (uniform_changed(loc, &x, sizeof(x)))
+			glUniform1i(loc, x);
+	}
+	void uniform1ui(GLint loc, GLuint x) {
+		if (uniform_changed(loc, &x, sizeof(x)))
+			glUniform1ui(loc, x);
+	}
+	void uniform1f(GLint loc, GLfloat x) {
+		if (uniform_changed(loc, &x, sizeof(x)))
+			glUniform1f(loc, x);
+	}
+	void uniform1fv(GLint loc, GLsizei count, const GLfloat* x) {
+		if (uniform_changed(loc, x, sizeof(GLfloat) * count))
+			glUniform1fv(loc, count, x);
+	}
+	void uniform2fv(GLint loc, const glm::vec2& x) {
+		if (uniform_changed(loc, glm::value_ptr(x), sizeof(x)))
+			glUniform2fv(loc, 1, glm::value_ptr(x));
+	}
+	void uniform3fv(GLint loc, const glm::vec3& x) {
+		if (uniform_changed(loc, glm::value_ptr(x), sizeof(x)))
+			glUniform3fv(loc, 1, glm::value_ptr(x));
+	}
+	void uniform4fv(GLint loc, GLsizei count, const glm::vec4* x) {
+		if (uniform_changed(loc, glm::value_ptr(x[0]), sizeof(glm::vec4) * count))
+			glUniform4fv(loc, count, glm::value_ptr(x[0]));
+	}
+	void uniform_matrix4fv(GLint loc, const glm::mat4& x) {
+		if (uniform_changed(loc, glm::value_ptr(x), sizeof(x)))
+			glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(x));
+	}
+
+	void vertex_attrib4fv(GLuint index, const glm::vec4& x) {
+		if (index < CACHED_ATTRIBS && attrib_known[index] && attrib_values[index] == x) {
+			current.attribs.elided++;
+			return;
+		}
+		glVertexAttrib4fv(index, glm::value_ptr(x));
+		if (index < CACHED_ATTRIBS) {
+			attrib_values[index] = x;
+			attrib_known[index] = true;
+		}
+		current.attribs.issued++;
+	}
+};
+
+GLStateCache gl_state;
+
+// one draw plus the per-draw uniforms (matrices) it needs
+struct DrawItem {
+	GLuint program;
+	GLuint vao;
+	GLenum mode;
+	GLsizei count;
+	bool indexed; // glDrawElements with GL_UNSIGNED_INT from offset 0, else glDrawArrays from 0
+	GLsizei instance_count; // more than 1 goes through the *Instanced draws
+	int num_matrices;
+	GLint matrix_locs[3];
+	glm::mat4 matrices[3];
+	bool displaced; // displacement goes to DISPLACE_ATTRIB as a constant attribute before the draw
+	glm::vec4 displacement;
+	GLint base_vertex; // added to every index of an indexed draw
+};
+
+// passes, in the order they run
+enum RenderPass {
+	PASS_DEPTH,
+	PASS_OPAQUE,
+	PASS_VERTEX_LIT, // opaque too, lit per vertex, its own pass so its fragments can be counted apart
+	PASS_LAMPS
+};
+
+// draws are submitted with a 64-bit sort key, radix sorted, then issued through gl_state
+// key layout: pass (4) | program (12) | vao (12) | depth (24) | unused (12)
+// so within a pass everything sharing a program and vao ends up together, nearest first
+struct RenderQueue {
+	std::vector<unsigned long long> keys;
+	std::vector<GLuint> order;
+	std::vector<DrawItem> items;
+	RadixSorter<unsigned long long> sorter;
+
+	static unsigned long long make_key(RenderPass pass, GLuint program, GLuint vao, GLuint depth) {
+		return ((unsigned long long)(pass & 0xf) << 60) | ((unsigned long long)(program & 0xfff) << 48)
+			| ((unsigned long long)(vao & 0xfff) << 36) | ((unsigned long long)(depth & 0xffffff) << 12);
+	}
+
+	void clear() {
+		keys.clear();
+		order.clear();
+		items.clear();
+	}
+
+	void submit(unsigned long long key, const DrawItem& item) {
+		keys.push_back(key);
+		order.push_back((GLuint)items.size());
+		items.push_back(item);
+	}
+
+	// room for count draws, filled in later through keys[first + i] and items[first + i], by any thread
+	size_t reserve(size_t count) {
+		size_t first = items.size();
+		keys.resize(first + count);
+		items.resize(first + count);
+		order.resize(first + count);
+		for (size_t i = first; i < first + count; i++)
+			order[i] = (GLuint)i;
+		return first;
+	}
+
+	// on_pass(from, to) runs whenever the pass changes (-1 before the first and after the last one)
+	template <typename PassCallback>
+	void execute(GLStateCache& gl, PassCallback on_pass) {
+		sorter.sort(keys, order, 64);
+		int pass = -1;
+		for (size_t i = 0; i < order.size(); i++) {
+			int item_pass = (int)(keys[i] >> 60);
+			if (item_pass != pass) {
+				on_pass(pass, item_pass);
+				pass = item_pass;
+			}
+			const DrawItem& item = items[order[i]];
+			gl.use_program(item.program);
+			gl.bind_vertex_array(item.vao);
+			for (int u = 0; u < item.num_matrices; u++)
+				gl.uniform_matrix4fv(item.matrix_locs[u], item.matrices[u]);
+			if (item.displaced)
+				gl.vertex_attrib4fv(DISPLACE_ATTRIB, item.displacement);
+			if (item.instance_count > 1) {
+				if (item.indexed)
+					glDrawElementsInstancedBaseVertex(item.mode, item.count, GL_UNSIGNED_INT, 0, item.instance_count, item.base_vertex);
+				else
+					glDrawArraysInstanced(item.mode, 0, item.count, item.instance_count);
+			}
+			else if (item.indexed && item.base_vertex != 0)
+				glDrawElementsBaseVertex(item.mode, item.count, GL_UNSIGNED_INT, 0, item.base_vertex);
+			else if (item.indexed)
+				glDrawElements(item.mode, item.count, GL_UNSIGNED_INT, 0);
+			else
+				glDrawArrays(item.mode, 0, item.count);
+			gl.current.draws++;
+		}
+		if (pass != -1)
+			on_pass(pass, -1);
+	}
+};
+
+// color + depth textures behind an fbo, sized to the window; the scene goes into its lower left corner
+// at whatever resolution the scaler picked, so changing the scale never reallocates anything
+struct RenderTarget {
+	GLuint fbo, color, depth;
+	int width, height;
+
+	RenderTarget() : fbo(0), color(0), depth(0), width(0), height(0) {}
+
+	void resize(int w, int h) {
+		w = std::max(w, 1);
+		h = std::max(h, 1);
+		if (w == width && h == height)
+			return;
+		release();
+		width = w;
+		height = h;
+
+		glGenTextures(1, &color);
+		glBindTexture(GL_TEXTURE_2D, color);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		glGenTextures(1, &depth);
+		glBindTexture(GL_TEXTURE_2D, depth);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, w, h, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			std::cout << "render target " << w << "x" << h << " is incomplete" << std::endl;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	void release() {
+		if (fbo == 0)
+			return;
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteTextures(1, &color);
+		glDeleteTextures(1, &depth);
+		fbo = color = depth = 0;
+		width = height = 0;
+	}
+};
+
+// GL_TIME_ELAPSED queries in a small ring, read back a few frames late so we never wait on the gpu
+struct GpuTimer {
+	static const int LATENCY = 3;
+	GLuint queries[LATENCY];
+	bool pending[LATENCY];
+	int next;
+	bool active;
+	bool first; // the first result also covers driver warm-up, it's thrown away
+
+	void init() {
+		glGenQueries(LATENCY, queries);
+		for (int i = 0; i < LATENCY; i++)
+			pending[i] = false;
+		next = 0;
+		active = false;
+		first = true;
+	}
+
+	void release() {
+		glDeleteQueries(LATENCY, queries);
+	}
+
+	// skips the frame if the gpu is so far behind that the slot is still in flight
+	void begin() {
+		active = !pending[next];
+		if (active)
+			glBeginQuery(GL_TIME_ELAPSED, queries[next]);
+	}
+
+	void end() {
+		if (!active)
+			return;
+		glEndQuery(GL_TIME_ELAPSED);
+		pending[next] = true;
+		next = (next + 1) % LATENCY;
+		active = false;
+	}
+
+	// newest finished result in ms, false if nothing finished since the last call
+	bool poll(double& ms) {
+		bool got = false;
+		for (int i = 0; i < LATENCY; i++) {
+			int q = (next + i) % LATENCY; // oldest first
+			if (!pending[q])
+				continue;
+			GLuint available = 0;
+			glGetQueryObjectuiv(queries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+				break;
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(queries[q], GL_QUERY_RESULT, &ns);
+			pending[q] = false;
+			if (first) {
+				first = false;
+				continue;
+			}
+			ms = ns / 1.0e6;
+			got = true;
+		}
+		return got;
+	}
+};
+
+// picks the render scale from measured gpu frame times
+// there's a dead band between 85% and 100% of the budget, and outside of it the trend has to hold for a while
+// before the scale moves: a few samples to go down (we're dropping frames), a lot more to go back up
+struct ResolutionScaler {
+	float scale;
+	float budget_ms;
+	int over_frames, under_frames;
+
+	ResolutionScaler(float budget) : scale(MAX_RENDER_SCALE), budget_ms(budget), over_frames(0), under_frames(0) {}
+
+	void update(double gpu_ms) {
+		if (gpu_ms > budget_ms) {
+			over_frames++;
+			under_frames = 0;
+		}
+		else if (gpu_ms < budget_ms * 0.85) {
+			under_frames++;
+			over_frames = 0;
+		}
+		else
+			over_frames = under_frames = 0;
+
+		if (over_frames < 3 && under_frames < 30)
+			return;
+		// cost goes with the pixel count, so with scale^2: aim for the middle of the dead band,
+		// and never grow by more than 10% at once
+		float target = scale * (float)sqrt(budget_ms * 0.92 / std::max(gpu_ms, 0.01));
+		if (under_frames > 0)
+			target = std::min(target, scale * 1.1f);
+		// in 1/64 steps, so tiny changes don't make the image swim
+		scale = glm::clamp(floor(target * 64.f + 0.5f) / 64.f, MIN_RENDER_SCALE, MAX_RENDER_SCALE);
+		over_frames = under_frames = 0;
+	}
+};
+
+// buffers the gpu copies into and the cpu reads a few frames later, once their fence has signalled,
+// so reading never waits on the gpu. a frame whose slot is still in flight just doesn't get a copy
+struct AsyncReadback {
+	static const int LATENCY = 3;
+	GLuint buffers[LATENCY];
+	GLsync fences[LATENCY]; // 0 = slot free
+	GLsizeiptr size;
+	int next;
+
+	void init() {
+		glGenBuffers(LATENCY, buffers);
+		for (int i = 0; i < LATENCY; i++)
+			fences[i] = 0;
+		size = 0;
+		next = 0;
+	}
+
+	void release() {
+		for (int i = 0; i < LATENCY; i++)
+			if (fences[i])
+				glDeleteSync(fences[i]);
+		glDeleteBuffers(LATENCY, buffers);
+	}
+
+	// slot the next copy goes into (with room for bytes), -1 if it's still holding an unread one
+	int acquire(GLsizeiptr bytes) {
+		if (fences[next])
+			return -1;
+		if (bytes > size) {
+			for (int i = 0; i < LATENCY; i++) {
+				glBindBuffer(GL_COPY_WRITE_BUFFER, buffers[i]);
+				glBufferData(GL_COPY_WRITE_BUFFER, bytes, NULL, GL_STREAM_READ);
+			}
+			glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+			size = bytes;
+		}
+		return next;
+	}
+
+	// after the copy into buffers[slot] is issued
+	void submit(int slot) {
+		fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		next = (slot + 1) % LATENCY;
+	}
+
+	// oldest slot whose copy has landed, -1 if none; read() it to free it
+	int poll() {
+		for (int i = 0; i < LATENCY; i++) {
+			int slot = (next + i) % LATENCY;
+			if (!fences[slot])
+				continue;
+			GLenum status = glClientWaitSync(fences[slot], 0, 0);
+			return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED ? slot : -1;
+		}
+		return -1;
+	}
+
+	void read(int slot, void* out, GLsizeiptr bytes) {
+		glBindBuffer(GL_COPY_READ_BUFFER, buffers[slot]);
+		glGetBufferSubData(GL_COPY_READ_BUFFER, 0, bytes, out);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glDeleteSync(fences[slot]);
+		fences[slot] = 0;
+	}
+};
+
+// gl call capture (--capture trace.bin [frames]) and replay (--replay trace.bin [loops]), to see what the driver
+// costs apart from our own cpu work. capture swaps glad's pointer of every entry point this file calls for a hook
+// that appends the call to a binary trace and calls through; replay issues the trace again with vsync off and
+// times every frame on the cpu (submit) and on the gpu
+// trace: TRACE_MAGIC and the number of calls below, then one record per call, a GLushort TraceCall and the
+// arguments as they are in memory. pointers gl only reads through are NULL or offsets into a bound buffer, so
+// they're written as offsets; data that gets uploaded is a GLuint byte count plus the bytes; outputs are left
+// out, replay hands out scratch memory for them. a GLushort TRACE_CONTEXT and a GLubyte id come before the calls
+// of another context than the one before: 0 is the main thread's, 1 the asset worker's, which replay gets its own
+// shared context for so the worker's binds don't land in between the main thread's
+// kinds, one char per argument, say what replay has to do with it: - as is, b buffer, t texture, v vertex array,
+// f framebuffer, q query, p program or shader (their names are whatever replay gets from gl, so they're mapped),
+// l uniform location of the program in use, T query target and Q query (GL_TIME_ELAPSED ones are dropped,
+// replay times the frames itself), a digit is a float array with that many per element
+#define GL_TRACE_CALLS(X) \
+	X(glActiveTexture, TracePlain, "-") \
+	X(glAttachShader, TracePlain, "pp") \
+	X(glBeginQuery, TraceBeginQuery, "Tq") \
+	X(glBeginTransformFeedback, TracePlain, "-") \
+	X(glBindBuffer, TracePlain, "-b") \
+	X(glBindBufferBase, TracePlain, "--b") \
+	X(glBindBufferRange, TracePlain, "--b--") \
+	X(glBindFramebuffer, TracePlain, "-f") \
+	X(glBindTexture, TracePlain, "-t") \
+	X(glBindVertexArray, TracePlain, "v") \
+	X(glBufferData, TraceBufferData, "----") \
+	X(glBufferSubData, TraceBufferSubData, "----") \
+	X(glCheckFramebufferStatus, TracePlain, "-") \
+	X(glClear, TracePlain, "-") \
+	X(glClearColor, TracePlain, "----") \
+	X(glClientWaitSync, TraceClientWaitSync, "---") \
+	X(glColorMask, TracePlain, "----") \
+	X(glCompileShader, TracePlain, "p") \
+	X(glCopyBufferSubData, TracePlain, "-----") \
+	X(glCreateProgram, TraceCreate, "") \
+	X(glCreateShader, TraceCreate, "-") \
+	X(glDeleteBuffers, TraceDelete, "-b") \
+	X(glDeleteFramebuffers, TraceDelete, "-f") \
+	X(glDeleteProgram, TracePlain, "p") \
+	X(glDeleteQueries, TraceDelete, "-q") \
+	X(glDeleteShader, TracePlain, "p") \
+	X(glDeleteSync, TraceDeleteSync, "-") \
+	X(glDeleteTextures, TraceDelete, "-t") \
+	X(glDeleteVertexArrays, TraceDelete, "-v") \
+	X(glDepthFunc, TracePlain, "-") \
+	X(glDepthMask, TracePlain, "-") \
+	X(glDisable, TracePlain, "-") \
+	X(glDispatchCompute, TracePlain, "---") \
+	X(glDrawArrays, TracePlain, "---") \
+	X(glDrawArraysInstanced, TracePlain, "----") \
+	X(glDrawElements, TracePlain, "----") \
+	X(glDrawElementsBaseVertex, TracePlain, "-----") \
+	X(glDrawElementsInstanced, TracePlain, "-----") \
+	X(glDrawElementsInstancedBaseVertex, TracePlain, "------") \
+	X(glEnable, TracePlain, "-") \
+	X(glEnableVertexAttribArray, TracePlain, "-") \
+	X(glEndQuery, TracePlain, "T") \
+	X(glEndTransformFeedback, TracePlain, "") \
+	X(glFenceSync, TraceFenceSync, "--") \
+	X(glFinish, TracePlain, "") \
+	X(glFlush, TracePlain, "") \
+	X(glFramebufferTexture2D, TracePlain, "---t-") \
+	X(glGenBuffers, TraceGen, "-b") \
+	X(glGenFramebuffers, TraceGen, "-f") \
+	X(glGenQueries, TraceGen, "-q") \
+	X(glGenTextures, TraceGen, "-t") \
+	X(glGenVertexArrays, TraceGen, "-v") \
+	X(glGetBufferSubData, TraceGetBufferSubData, "----") \
+	X(glGetError, TracePlain, "") \
+	X(glGetIntegeri_v, TracePlain, "---") \
+	X(glGetProgramInfoLog, TracePlain, "p---") \
+	X(glGetProgramiv, TracePlain, "p--") \
+	X(glGetQueryObjectui64v, TracePlain, "Q--") \
+	X(glGetQueryObjectuiv, TracePlain, "Q--") \
+	X(glGetShaderInfoLog, TracePlain, "p---") \
+	X(glGetShaderiv, TracePlain, "p--") \
+	X(glGetTexImage, TraceGetTexImage, "-----") \
+	X(glGetUniformLocation, TraceGetUniformLocation, "p-") \
+	X(glLinkProgram, TracePlain, "p") \
+	X(glMapBufferRange, TraceMapBufferRange, "----") \
+	X(glMemoryBarrier, TracePlain, "-") \
+	X(glMultiDrawElementsIndirect, TracePlain, "-----") \
+	X(glPatchParameteri, TracePlain, "--") \
+	X(glPixelStorei, TracePlain, "--") \
+	X(glPolygonMode, TracePlain, "--") \
+	X(glReadPixels, TraceReadPixels, "-------") \
+	X(glShaderSource, TraceShaderSource, "p---") \
+	X(glTexBuffer, TracePlain, "--b") \
+	X(glTexImage2D, TracePlain, "---------") \
+	X(glTexParameteri, TracePlain, "---") \
+	X(glTransformFeedbackVaryings, TraceTransformFeedbackVaryings, "p---") \
+	X(glUniform1f, TracePlain, "l-") \
+	X(glUniform1fv, TraceUniformv, "l-1") \
+	X(glUniform1i, TracePlain, "l-") \
+	X(glUniform1ui, TracePlain, "l-") \
+	X(glUniform2fv, TraceUniformv, "l-2") \
+	X(glUniform3fv, TraceUniformv, "l-3") \
+	X(glUniform4fv, TraceUniformv, "l-4") \
+	X(glUniformMatrix4fv, TraceUniformMatrix, "l---") \
+	X(glUnmapBuffer, TraceUnmapBuffer, "-") \
+	X(glUseProgram, TraceUseProgram, "p") \
+	X(glVertexAttrib4fv, TraceAttribv, "-4") \
+	X(glVertexAttribDivisor, TracePlain, "--") \
+	X(glVertexAttribIPointer, TracePlain, "-----") \
+	X(glVertexAttribPointer, TracePlain, "------") \
+	X(glViewport, TracePlain, "----")
+
+enum TraceCall {
+#define GL_TRACE_ENUM(name, Trace, kinds) TRACE_##name,
+	GL_TRACE_CALLS(GL_TRACE_ENUM)
+#undef GL_TRACE_ENUM
+	TRACE_CALLS,
+	TRACE_FRAME = TRACE_CALLS, // end of a frame, after its last draw; replay swaps there
+	TRACE_CONTEXT // the calls after it are on another context
+};
+
+// contexts in a trace; any thread other than the one that started the capture is the asset worker's
+enum TraceContext {
+	TRACE_MAIN_CONTEXT,
+	TRACE_WORKER_CONTEXT,
+	TRACE_CONTEXTS
+};
+
+const char* const TRACE_KINDS[TRACE_CALLS] = {
+#define GL_TRACE_KINDS(name, Trace, kinds) kinds,
+	GL_TRACE_CALLS(GL_TRACE_KINDS)
+#undef GL_TRACE_KINDS
+};
+
+const char TRACE_MAGIC[8] = "GLTRACE";
+const size_t TRACE_SCRATCH_BYTES = 1 << 16; // outputs of plain calls: parameters, info logs
+
+typedef void (APIENTRYP TraceProc)();
+
+// glad's pointers, the hooks go in there
+TraceProc* const TRACE_SLOTS[TRACE_CALLS] = {
+#define GL_TRACE_SLOT(name, Trace, kinds) (TraceProc*)&glad_##name,
+	GL_TRACE_CALLS(GL_TRACE_SLOT)
+#undef GL_TRACE_SLOT
+};
+
+// one set of hooks on glad's pointers, hooks[i] calling through next[i]. layers stack in the order they go on
+// (the counters can go on while a capture runs) and any of them can come off in any order: every change relinks
+// the whole chain from the driver's pointers up, so nothing keeps calling into a layer that's gone
+struct GLHookLayer {
+	const TraceProc* hooks; // one per TraceCall
+	TraceProc next[TRACE_CALLS];
+
+	GLHookLayer() : hooks(NULL) {
+		std::fill(next, next + TRACE_CALLS, (TraceProc)NULL);
+	}
+};
+
+TraceProc gl_driver_procs[TRACE_CALLS]; // what glad loaded, kept while any layer is on
+std::vector<GLHookLayer*> gl_hook_layers; // bottom first
+
+// calls glad didn't find stay NULL, there's nothing to hook
+void relink_gl_hooks() {
+	for (int i = 0; i < TRACE_CALLS; i++) {
+		TraceProc p = gl_driver_procs[i];
+		for (GLHookLayer* layer : gl_hook_layers) {
+			layer->next[i] = p;
+			if (p != NULL)
+				p = layer->hooks[i];
+		}
+		*TRACE_SLOTS[i] = p;
+	}
+}
+
+// main thread only, like every other change to glad's pointers
+void install_gl_hooks(GLHookLayer& layer, const TraceProc* hooks) {
+	if (std::find(gl_hook_layers.begin(), gl_hook_layers.end(), &layer) != gl_hook_layers.end())
+		return;
+	if (gl_hook_layers.empty()) {
+		for (int i = 0; i < TRACE_CALLS; i++)
+			gl_driver_procs[i] = *TRACE_SLOTS[i];
+	}
+	layer.hooks = hooks;
+	gl_hook_layers.push_back(&layer);
+	relink_gl_hooks();
+}
+
+void remove_gl_hooks(GLHookLayer& layer) {
+	auto found = std::find(gl_hook_layers.begin(), gl_hook_layers.end(), &layer);
+	if (found == gl_hook_layers.end())
+		return;
+	gl_hook_layers.erase(found);
+	relink_gl_hooks();
+}
+
+// a --capture in progress. hooks call through layer.next[]
+struct GLTrace {
+	struct Mapping {
+		void* pointer; // the real one, NULL while unmapped
+		GLsizeiptr length;
+		GLbitfield access;
+		std::vector<unsigned char> shadow; // what the app got instead, kept for the next mapping of the target
+	};
+
+	GLHookLayer layer;
+	std::mutex mutex; // the asset worker's context calls gl too
+	std::ofstream out;
+	bool capturing;
+	std::thread::id main_thread;
+	GLubyte context; // of the last call written
+	int frames, frames_left;
+	unsigned long long calls, bytes;
+	std::unordered_map<GLenum, Mapping> mappings; // by target, writable ones only
+
+	GLTrace() : capturing(false), context(TRACE_MAIN_CONTEXT), frames(0), frames_left(0), calls(0), bytes(0) {}
+
+	// trace_hooks has one per TraceCall
+	bool start(const char* path, int frame_count, const TraceProc* trace_hooks) {
+		out.open(path, std::ios::binary);
+		if (!out) {
+			std::cout << "can't write " << path << std::endl;
+			return false;
+		}
+		GLuint calls_in_build = TRACE_CALLS;
+		out.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+		out.write((const char*)&calls_in_build, sizeof(calls_in_build));
+		frames = frames_left = std::max(frame_count, 1);
+		calls = 0;
+		bytes = sizeof(TRACE_MAGIC) + sizeof(calls_in_build);
+		capturing = true;
+		main_thread = std::this_thread::get_id();
+		context = TRACE_MAIN_CONTEXT;
+		install_gl_hooks(layer, trace_hooks);
+		std::cout << "capturing " << frames << " frames of gl calls to " << path << std::endl;
+		return true;
+	}
+
+	void write(const std::vector<unsigned char>& record) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!capturing)
+			return;
+		switch_context(std::this_thread::get_id() == main_thread ? TRACE_MAIN_CONTEXT : TRACE_WORKER_CONTEXT);
+		out.write((const char*)record.data(), record.size());
+		calls++;
+		bytes += record.size();
+	}
+
+	// with the lock held
+	void switch_context(GLubyte to) {
+		if (to == context)
+			return;
+		GLushort id = TRACE_CONTEXT;
+		out.write((const char*)&id, sizeof(id));
+		out.write((const char*)&to, sizeof(to));
+		bytes += sizeof(id) + sizeof(to);
+		context = to;
+	}
+
+	// after the frame's last call, not at its swap, which may be deferred into the next one; stops after the last frame
+	void end_frame() {
+		if (!capturing)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			switch_context(TRACE_MAIN_CONTEXT);
+			GLushort id = TRACE_FRAME;
+			out.write((const char*)&id, sizeof(id));
+			bytes += sizeof(id);
+		}
+		if (--frames_left == 0)
+			stop();
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!capturing)
+				return;
+			capturing = false;
+			remove_gl_hooks(layer);
+			out.close();
+			mappings.clear(); // frames end with nothing mapped
+		}
+		std::cout << "captured " << frames - frames_left << " frames, " << calls << " gl calls, " << bytes / 1048576.0 << " MB" << std::endl;
+	}
+};
+
+GLTrace gl_trace;
+
+// one call on its way into the trace, put together per thread and written in one go
+struct TraceRecord {
+	std::vector<unsigned char>& bytes;
+
+	explicit TraceRecord(int id) : bytes(buffer()) {
+		bytes.clear();
+		put((GLushort)id);
+	}
+
+	static std::vector<unsigned char>& buffer() {
+		static thread_local std::vector<unsigned char> b;
+		return b;
+	}
+
+	template <class T>
+	typename std::enable_if<std::is_arithmetic<T>::value>::type put(T x) {
+		const unsigned char* p = (const unsigned char*)&x;
+		bytes.insert(bytes.end(), p, p + sizeof(T));
+	}
+	void put(const void* offset) {
+		put((GLuint64)(size_t)offset);
+	}
+	template <class T>
+	void put(T*) {
+		static_assert(!std::is_const<T>::value, "data gl reads from memory needs a hook that knows its size");
+	}
+
+	void blob(const void* data, size_t size) {
+		put((GLuint)size);
+		bytes.insert(bytes.end(), (const unsigned char*)data, (const unsigned char*)data + size);
+	}
+
+	void commit() {
+		gl_trace.write(bytes);
+	}
+};
+
+// a --replay in progress: where we are in the trace, and what its names are called on this context
+struct TraceReplay {
+	std::vector<unsigned char> trace;
+	size_t at;
+	std::unordered_map<GLuint, GLuint> names[6]; // by TRACE_NAME_KINDS
+	std::unordered_map<GLuint64, GLint> locations; // by captured program << 32 | captured location
+	std::unordered_map<GLuint64, GLsync> syncs;
+	std::unordered_map<GLenum, void*> mapped; // by target
+	std::unordered_map<GLuint, bool> timer_queries;
+	GLuint program; // captured name of the one in use
+	std::vector<unsigned char> scratch;
+	size_t calls;
+	bool frame_ended;
+	GLFWwindow* contexts[TRACE_CONTEXTS]; // the worker's is made when the trace first switches to it
+	int context;
+
+	TraceReplay() : at(0), program(0), scratch(TRACE_SCRATCH_BYTES), calls(0), frame_ended(false), context(TRACE_MAIN_CONTEXT) {
+		std::fill(contexts, contexts + TRACE_CONTEXTS, (GLFWwindow*)NULL);
+	}
+
+	// main thread only, like AssetWorker::start; false if there's no such context
+	bool use_context(int id) {
+		if (id < 0 || id >= TRACE_CONTEXTS)
+			return false;
+		if (id == context)
+			return true;
+		if (contexts[id] == NULL) {
+			glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+			contexts[id] = glfwCreateWindow(1, 1, "replay", NULL, contexts[TRACE_MAIN_CONTEXT]);
+			glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+			if (contexts[id] == NULL)
+				return false;
+		}
+		// the worker's uploads are done before the main context goes on, which stands in for the fence the
+		// main thread polled during capture
+		if (context == TRACE_WORKER_CONTEXT)
+			glFinish();
+		glfwMakeContextCurrent(contexts[id]);
+		context = id;
+		return true;
+	}
+
+	// back on the main context, without the others
+	void release_contexts() {
+		use_context(TRACE_MAIN_CONTEXT);
+		for (int i = TRACE_MAIN_CONTEXT + 1; i < TRACE_CONTEXTS; i++) {
+			if (contexts[i] != NULL)
+				glfwDestroyWindow(contexts[i]);
+			contexts[i] = NULL;
+		}
+	}
+
+	bool load(const char* path) {
+		std::ifstream in(path, std::ios::binary);
+		char magic[sizeof(TRACE_MAGIC)] = {};
+		GLuint calls_in_build = 0;
+		in.read(magic, sizeof(magic));
+		in.read((char*)&calls_in_build, sizeof(calls_in_build));
+		if (!in || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 || calls_in_build != TRACE_CALLS) {
+			std::cout << path << " isn't a trace from this build" << std::endl;
+			return false;
+		}
+		trace.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		return true;
+	}
+
+	template <class T>
+	T get() {
+		T x = T();
+		if (at + sizeof(T) > trace.size()) {
+			at = trace.size();
+			return x;
+		}
+		memcpy(&x, &trace[at], sizeof(T));
+		at += sizeof(T);
+		return x;
+	}
+
+	const unsigned char* blob(GLuint& size) {
+		size = get<GLuint>();
+		size = (GLuint)std::min((size_t)size, trace.size() - at);
+		const unsigned char* data = trace.data() + at;
+		at += size;
+		return data;
+	}
+
+	void* output(size_t bytes) {
+		if (scratch.size() < bytes)
+			scratch.resize(bytes);
+		return scratch.data();
+	}
+
+	static int name_kind(char kind) {
+		static const char TRACE_NAME_KINDS[] = "btvfqp";
+		const char* k = kind != 0 ? strchr(TRACE_NAME_KINDS, kind) : NULL;
+		return k != NULL ? (int)(k - TRACE_NAME_KINDS) : -1;
+	}
+
+	// names never made here stay as they are
+	GLuint name(GLuint captured, char kind) {
+		int k = name_kind(kind);
+		if (captured == 0 || k < 0)
+			return captured;
+		auto found = names[k].find(captured);
+		return found != names[k].end() ? found->second : captured;
+	}
+
+	static GLuint64 location_key(GLuint program, GLint location) {
+		return (GLuint64)program << 32 | (GLuint)location;
+	}
+
+	// false drops the call
+	template <class T>
+	bool rename(T&, char) {
+		return true;
+	}
+	bool rename(GLuint& x, char kind) {
+		if (kind == 'T')
+			return x != GL_TIME_ELAPSED;
+		if (kind == 'Q') {
+			if (timer_queries.count(x))
+				return false;
+			kind = 'q';
+		}
+		x = name(x, kind);
+		return true;
+	}
+	bool rename(GLint& x, char kind) {
+		if (kind != 'l' || x < 0)
+			return true;
+		auto found = locations.find(location_key(program, x));
+		if (found != locations.end())
+			x = found->second;
+		return true;
+	}
+};
+
+// reads an argument of a plain call back
+template <class T, class Enable = void>
+struct TraceArg {
+	static T get(TraceReplay& r) {
+		return r.get<T>();
+	}
+};
+template <>
+struct TraceArg<const void*> {
+	static const void* get(TraceReplay& r) {
+		return (const void*)(size_t)r.get<GLuint64>();
+	}
+};
+template <class T>
+struct TraceArg<T*, typename std::enable_if<!std::is_const<T>::value>::type> {
+	static T* get(TraceReplay& r) {
+		return (T*)r.output(TRACE_SCRATCH_BYTES);
+	}
+};
+
+// each hook below has glad's signature for its call, and replay() reads the record back and makes the call
+
+// values, offsets and small outputs, written before the call
+template <int ID, class F>
+struct TracePlain;
+template <int ID, class R, class... A>
+struct TracePlain<ID, R (APIENTRYP)(A...)> {
+	typedef R (APIENTRYP F)(A...);
+
+	static R APIENTRY hook(A... args) {
+		TraceRecord record(ID);
+		int unused[] = { 0, (record.put(args), 0)... };
+		(void)unused;
+		record.commit();
+		return ((F)gl_trace.layer.next[ID])(args...);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		replay(r, real, std::index_sequence_for<A...>());
+	}
+
+	template <size_t... I>
+	static void replay(TraceReplay& r, F real, std::index_sequence<I...>) {
+		std::tuple<A...> args;
+		bool keep = true;
+		// array elements are initialized in order, so the arguments are read in order
+		int unused[] = { 0, (std::get<I>(args) = TraceArg<A>::get(r), keep &= r.rename(std::get<I>(args), TRACE_KINDS[ID][I]), 0)... };
+		(void)unused;
+		if (keep)
+			real(std::get<I>(args)...);
+	}
+};
+
+// glGen*: the names come out of the call, so the record goes after it
+template <int ID, class F>
+struct TraceGen {
+	static void APIENTRY hook(GLsizei n, GLuint* names) {
+		((F)gl_trace.layer.next[ID])(n, names);
+		TraceRecord record(ID);
+		record.blob(names, sizeof(GLuint) * n);
+		record.commit();
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLuint size;
+		const unsigned char* captured = r.blob(size);
+		std::vector<GLuint> made(size / sizeof(GLuint));
+		real((GLsizei)made.size(), made.data());
+		std::unordered_map<GLuint, GLuint>& names = r.names[TraceReplay::name_kind(TRACE_KINDS[ID][1])];
+		for (size_t i = 0; i < made.size(); i++) {
+			GLuint name;
+			memcpy(&name, captured + sizeof(GLuint) * i, sizeof(name));
+			names[name] = made[i];
+		}
+	}
+};
+
+// glDelete*: names never made here (an earlier loop deleted them) aren't passed on
+template <int ID, class F>
+struct TraceDelete {
+	static void APIENTRY hook(GLsizei n, const GLuint* names) {
+		TraceRecord record(ID);
+		record.blob(names, sizeof(GLuint) * n);
+		record.commit();
+		((F)gl_trace.layer.next[ID])(n, names);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLuint size;
+		const unsigned char* captured = r.blob(size);
+		std::vector<GLuint> here(size / sizeof(GLuint));
+		std::unordered_map<GLuint, GLuint>& names = r.names[TraceReplay::name_kind(TRACE_KINDS[ID][1])];
+		for (size_t i = 0; i < here.size(); i++) {
+			GLuint name;
+			memcpy(&name, captured + sizeof(GLuint) * i, sizeof(name));
+			auto found = names.find(name);
+			here[i] = found != names.end() ? found->second : 0;
+			if (found != names.end())
+				names.erase(found);
+		}
+		real((GLsizei)here.size(), here.data());
+	}
+};
+
+// glCreateProgram, glCreateShader
+template <int ID, class F>
+struct TraceCreate;
+template <int ID>
+struct TraceCreate<ID, GLuint (APIENTRYP)()> {
+	typedef GLuint (APIENTRYP F)();
+
+	static GLuint APIENTRY hook() {
+		GLuint name = ((F)gl_trace.layer.next[ID])();
+		TraceRecord record(ID);
+		record.put(name);
+		record.commit();
+		return name;
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLuint captured = r.get<GLuint>();
+		r.names[TraceReplay::name_kind('p')][captured] = real();
+	}
+};
+template <int ID>
+struct TraceCreate<ID, GLuint (APIENTRYP)(GLenum)> {
+	typedef GLuint (APIENTRYP F)(GLenum);
+
+	static GLuint APIENTRY hook(GLenum type) {
+		GLuint name = ((F)gl_trace.layer.next[ID])(type);
+		TraceRecord record(ID);
+		record.put(type);
+		record.put(name);
+		record.commit();
+		return name;
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLenum type = r.get<GLenum>();
+		GLuint captured = r.get<GLuint>();
+		r.names[TraceReplay::name_kind('p')][captured] = real(type);
+	}
+};
+
+// uniform locations belong to the program in use
+template <int ID, class F>
+struct TraceUseProgram {
+	static void APIENTRY hook(GLuint program) {
+		TraceRecord record(ID);
+		record.put(program);
+		record.commit();
+		((F)gl_trace.layer.next[ID])(program);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		r.program = r.get<GLuint>();
+		real(r.name(r.program, 'p'));
+	}
+};
+
+template <int ID, class F>
+struct TraceGetUniformLocation {
+	static GLint APIENTRY hook(GLuint program, const GLchar* name) {
+		GLint location = ((F)gl_trace.layer.next[ID])(program, name);
+		TraceRecord record(ID);
+		record.put(program);
+		record.blob(name, strlen(name) + 1);
+		record.put(location);
+		record.commit();
+		return location;
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLuint program = r.get<GLuint>();
+		GLuint size;
+		const GLchar* name = (const GLchar*)r.blob(size);
+		GLint captured = r.get<GLint>();
+		GLint location = real(r.name(program, 'p'), name);
+		if (captured >= 0)
+			r.locations[TraceReplay::location_key(program, captured)] = location;
+	}
+};
+
+// the strings go in as one
+template <int ID, class F>
+struct TraceShaderSource {
+	static void APIENTRY hook(GLuint shader, GLsizei count, const GLchar* const* strings, const GLint* lengths) {
+		std::string source;
+		for (GLsizei i = 0; i < count; i++)
+			source.append(strings[i], lengths != NULL && lengths[i] >= 0 ? (size_t)lengths[i] : strlen(strings[i]));
+		TraceRecord record(ID);
+		record.put(shader);
+		record.blob(source.data(), source.size());
+		record.commit();
+		((F)gl_trace.layer.next[ID])(shader, count, strings, lengths);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLuint shader = r.get<GLuint>();
+		GLuint size;
+		const GLchar* source = (const GLchar*)r.blob(size);
+		GLint length = (GLint)size;
+		real(r.name(shader, 'p'), 1, &source, &length);
+	}
+};
+
+template <int ID, class F>
+struct TraceTransformFeedbackVaryings {
+	static void APIENTRY hook(GLuint program, GLsizei count, const GLchar* const* varyings, GLenum mode) {
+		TraceRecord record(ID);
+		record.put(program);
+		record.put(count);
+		for (GLsizei i = 0; i < count; i++)
+			record.blob(varyings[i], strlen(varyings[i]) + 1);
+		record.put(mode);
+		record.commit();
+		((F)gl_trace.layer.next[ID])(program, count, varyings, mode);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLuint program = r.get<GLuint>();
+		std::vector<const GLchar*> varyings(std::max(r.get<GLsizei>(), 0));
+		for (const GLchar*& varying : varyings) {
+			GLuint size;
+			varying = (const GLchar*)r.blob(size);
+		}
+		GLenum mode = r.get<GLenum>();
+		real(r.name(program, 'p'), (GLsizei)varyings.size(), varyings.data(), mode);
+	}
+};
+
+// uploads: the data goes into the trace, and replay hands gl the trace's copy
+template <int ID, class F>
+struct TraceBufferData {
+	static void APIENTRY hook(GLenum target, GLsizeiptr size, const void* data, GLenum usage) {
+		TraceRecord record(ID);
+		record.put(target);
+		record.put(size);
+		record.blob(data, data != NULL ? size : 0);
+		record.put(usage);
+		record.commit();
+		((F)gl_trace.layer.next[ID])(target, size, data, usage);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLenum target = r.get<GLenum>();
+		GLsizeiptr size = r.get<GLsizeiptr>();
+		GLuint bytes;
+		const unsigned char* data = r.blob(bytes);
+		GLenum usage = r.get<GLenum>();
+		real(target, size, bytes > 0 ? data : NULL, usage);
+	}
+};
+
+template <int ID, class F>
+struct TraceBufferSubData {
+	static void APIENTRY hook(GLenum target, GLintptr offset, GLsizeiptr size, const void* data) {
+		TraceRecord record(ID);
+		record.put(target);
+		record.put(offset);
+		record.blob(data, size);
+		record.commit();
+		((F)gl_trace.layer.next[ID])(target, offset, size, data);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLenum target = r.get<GLenum>();
+		GLintptr offset = r.get<GLintptr>();
+		GLuint size;
+		const unsigned char* data = r.blob(size);
+		real(target, offset, size, data);
+	}
+};
+
+// glUniform*fv, the kind of the array says how many floats an element has
+template <int ID, class F>
+struct TraceUniformv {
+	static void APIENTRY hook(GLint location, GLsizei count, const GLfloat* value) {
+		TraceRecord record(ID);
+		record.put(location);
+		record.blob(value, sizeof(GLfloat) * count * (TRACE_KINDS[ID][2] - '0'));
+		record.commit();
+		((F)gl_trace.layer.next[ID])(location, count, value);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLint location = r.get<GLint>();
+		GLuint size;
+		const GLfloat* value = (const GLfloat*)r.blob(size);
+		r.rename(location, 'l');
+		real(location, (GLsizei)(size / (sizeof(GLfloat) * (TRACE_KINDS[ID][2] - '0'))), value);
+	}
+};
+
+template <int ID, class F>
+struct TraceUniformMatrix {
+	static void APIENTRY hook(GLint location, GLsizei count, GLboolean transpose, const GLfloat* value) {
+		TraceRecord record(ID);
+		record.put(location);
+		record.put(transpose);
+		record.blob(value, sizeof(GLfloat) * 16 * count);
+		record.commit();
+		((F)gl_trace.layer.next[ID])(location, count, transpose, value);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLint location = r.get<GLint>();
+		GLboolean transpose = r.get<GLboolean>();
+		GLuint size;
+		const GLfloat* value = (const GLfloat*)r.blob(size);
+		r.rename(location, 'l');
+		real(location, (GLsizei)(size / (sizeof(GLfloat) * 16)), transpose, value);
+	}
+};
+
+template <int ID, class F>
+struct TraceAttribv {
+	static void APIENTRY hook(GLuint index, const GLfloat* value) {
+		TraceRecord record(ID);
+		record.put(index);
+		record.blob(value, sizeof(GLfloat) * (TRACE_KINDS[ID][1] - '0'));
+		record.commit();
+		((F)gl_trace.layer.next[ID])(index, value);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLuint index = r.get<GLuint>();
+		GLuint size;
+		const GLfloat* value = (const GLfloat*)r.blob(size);
+		real(index, value);
+	}
+};
+
+// what's written into a mapping goes into the trace when it's unmapped (main thread only, like every mapping).
+// a write-only mapping can't be read back, so while capturing the app writes into a shadow copy instead, which
+// goes into the trace and then into the real mapping in one pass at the unmap
+template <int ID, class F>
+struct TraceMapBufferRange {
+	static void* APIENTRY hook(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access) {
+		TraceRecord record(ID);
+		record.put(target);
+		record.put(offset);
+		record.put(length);
+		record.put(access);
+		record.commit();
+		void* pointer = ((F)gl_trace.layer.next[ID])(target, offset, length, access);
+		if (pointer == NULL || !(access & GL_MAP_WRITE_BIT))
+			return pointer;
+		GLTrace::Mapping& mapping = gl_trace.mappings[target];
+		mapping.pointer = pointer;
+		mapping.length = length;
+		mapping.access = access;
+		mapping.shadow.resize(length);
+		if (access & GL_MAP_READ_BIT)
+			memcpy(mapping.shadow.data(), pointer, length);
+		return mapping.shadow.data();
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLenum target = r.get<GLenum>();
+		GLintptr offset = r.get<GLintptr>();
+		GLsizeiptr length = r.get<GLsizeiptr>();
+		GLbitfield access = r.get<GLbitfield>();
+		r.mapped[target] = real(target, offset, length, access);
+	}
+};
+
+template <int ID, class F>
+struct TraceUnmapBuffer {
+	static GLboolean APIENTRY hook(GLenum target) {
+		auto found = gl_trace.mappings.find(target);
+		TraceRecord record(ID);
+		record.put(target);
+		if (found != gl_trace.mappings.end() && found->second.pointer != NULL) {
+			GLTrace::Mapping& mapping = found->second;
+			record.blob(mapping.shadow.data(), mapping.length);
+			memcpy(mapping.pointer, mapping.shadow.data(), mapping.length);
+			mapping.pointer = NULL;
+		} else {
+			record.blob(NULL, 0);
+		}
+		record.commit();
+		return ((F)gl_trace.layer.next[ID])(target);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLenum target = r.get<GLenum>();
+		GLuint size;
+		const unsigned char* data = r.blob(size);
+		auto found = r.mapped.find(target);
+		if (found == r.mapped.end())
+			return;
+		if (found->second != NULL)
+			memcpy(found->second, data, size);
+		r.mapped.erase(found);
+		real(target);
+	}
+};
+
+// syncs are pointers, the trace has the captured ones as ids
+template <int ID, class F>
+struct TraceFenceSync {
+	static GLsync APIENTRY hook(GLenum condition, GLbitfield flags) {
+		GLsync sync = ((F)gl_trace.layer.next[ID])(condition, flags);
+		TraceRecord record(ID);
+		record.put(condition);
+		record.put(flags);
+		record.put((GLuint64)(size_t)sync);
+		record.commit();
+		return sync;
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLenum condition = r.get<GLenum>();
+		GLbitfield flags = r.get<GLbitfield>();
+		GLuint64 captured = r.get<GLuint64>();
+		r.syncs[captured] = real(condition, flags);
+	}
+};
+
+template <int ID, class F>
+struct TraceClientWaitSync {
+	static GLenum APIENTRY hook(GLsync sync, GLbitfield flags, GLuint64 timeout) {
+		TraceRecord record(ID);
+		record.put((GLuint64)(size_t)sync);
+		record.put(flags);
+		record.put(timeout);
+		record.commit();
+		return ((F)gl_trace.layer.next[ID])(sync, flags, timeout);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLuint64 captured = r.get<GLuint64>();
+		GLbitfield flags = r.get<GLbitfield>();
+		GLuint64 timeout = r.get<GLuint64>();
+		auto found = r.syncs.find(captured);
+		if (found != r.syncs.end())
+			real(found->second, flags, timeout);
+	}
+};
+
+template <int ID, class F>
+struct TraceDeleteSync {
+	static void APIENTRY hook(GLsync sync) {
+		TraceRecord record(ID);
+		record.put((GLuint64)(size_t)sync);
+		record.commit();
+		((F)gl_trace.layer.next[ID])(sync);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		auto found = r.syncs.find(r.get<GLuint64>());
+		if (found == r.syncs.end())
+			return;
+		real(found->second);
+		r.syncs.erase(found);
+	}
+};
+
+// replay remembers which queries were timers, to drop everything else done with them
+template <int ID, class F>
+struct TraceBeginQuery {
+	static void APIENTRY hook(GLenum target, GLuint query) {
+		TraceRecord record(ID);
+		record.put(target);
+		record.put(query);
+		record.commit();
+		((F)gl_trace.layer.next[ID])(target, query);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLenum target = r.get<GLenum>();
+		GLuint query = r.get<GLuint>();
+		if (target == GL_TIME_ELAPSED)
+			r.timer_queries[query] = true;
+		else
+			real(target, r.name(query, 'q'));
+	}
+};
+
+// readbacks: outputs big enough for what they ask for, or the offset when a pixel pack buffer takes it
+template <int ID, class F>
+struct TraceGetBufferSubData {
+	static void APIENTRY hook(GLenum target, GLintptr offset, GLsizeiptr size, void* data) {
+		TraceRecord record(ID);
+		record.put(target);
+		record.put(offset);
+		record.put(size);
+		record.commit();
+		((F)gl_trace.layer.next[ID])(target, offset, size, data);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLenum target = r.get<GLenum>();
+		GLintptr offset = r.get<GLintptr>();
+		GLsizeiptr size = r.get<GLsizeiptr>();
+		real(target, offset, size, r.output(size));
+	}
+};
+
+inline void* trace_pack_output(TraceReplay& r, GLuint64 offset, size_t bytes) {
+	GLint pack_buffer = 0;
+	glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &pack_buffer);
+	return pack_buffer != 0 ? (void*)(size_t)offset : r.output(bytes);
+}
+
+template <int ID, class F>
+struct TraceReadPixels {
+	static void APIENTRY hook(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, void* pixels) {
+		TraceRecord record(ID);
+		record.put(x);
+		record.put(y);
+		record.put(width);
+		record.put(height);
+		record.put(format);
+		record.put(type);
+		record.put((const void*)pixels);
+		record.commit();
+		((F)gl_trace.layer.next[ID])(x, y, width, height, format, type, pixels);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLint x = r.get<GLint>(), y = r.get<GLint>();
+		GLsizei width = r.get<GLsizei>(), height = r.get<GLsizei>();
+		GLenum format = r.get<GLenum>(), type = r.get<GLenum>();
+		GLuint64 offset = r.get<GLuint64>();
+		// 16 bytes is the widest pixel there is
+		real(x, y, width, height, format, type, trace_pack_output(r, offset, (size_t)width * height * 16));
+	}
+};
+
+template <int ID, class F>
+struct TraceGetTexImage {
+	static void APIENTRY hook(GLenum target, GLint level, GLenum format, GLenum type, void* pixels) {
+		TraceRecord record(ID);
+		record.put(target);
+		record.put(level);
+		record.put(format);
+		record.put(type);
+		record.put((const void*)pixels);
+		record.commit();
+		((F)gl_trace.layer.next[ID])(target, level, format, type, pixels);
+	}
+
+	static void replay(TraceReplay& r, F real) {
+		GLenum target = r.get<GLenum>();
+		GLint level = r.get<GLint>();
+		GLenum format = r.get<GLenum>(), type = r.get<GLenum>();
+		GLuint64 offset = r.get<GLuint64>();
+		GLint width = 0, height = 0;
+		glGetTexLevelParameteriv(target, level, GL_TEXTURE_WIDTH, &width);
+		glGetTexLevelParameteriv(target, level, GL_TEXTURE_HEIGHT, &height);
+		real(target, level, format, type, trace_pack_output(r, offset, (size_t)width * height * 16));
+	}
+};
+
+#define GL_TRACE_CHECK(name, Trace, kinds) \
+	static_assert(std::is_same<decltype(&Trace<TRACE_##name, decltype(glad_##name)>::hook), decltype(glad_##name)>::value, "hook for " #name " doesn't have its signature");
+GL_TRACE_CALLS(GL_TRACE_CHECK)
+#undef GL_TRACE_CHECK
+
+// what --capture puts in glad's pointers, in TraceCall order
+const TraceProc TRACE_HOOKS[TRACE_CALLS] = {
+#define GL_TRACE_HOOK(name, Trace, kinds) (TraceProc)&Trace<TRACE_##name, decltype(glad_##name)>::hook,
+	GL_TRACE_CALLS(GL_TRACE_HOOK)
+#undef GL_TRACE_HOOK
+};
+
+// the next call of the trace; false at the end of a frame or of the trace
+bool replay_call(TraceReplay& r) {
+	r.frame_ended = false;
+	if (r.at >= r.trace.size()) {
+		r.use_context(TRACE_MAIN_CONTEXT);
+		return false;
+	}
+	switch (r.get<GLushort>()) {
+#define GL_TRACE_REPLAY(name, Trace, kinds) \
+	case TRACE_##name: \
+		if (glad_##name == NULL) { \
+			std::cout << "replay: this context has no " #name << std::endl; \
+			r.at = r.trace.size(); \
+			return false; \
+		} \
+		Trace<TRACE_##name, decltype(glad_##name)>::replay(r, glad_##name); \
+		break;
+	GL_TRACE_CALLS(GL_TRACE_REPLAY)
+#undef GL_TRACE_REPLAY
+	case TRACE_FRAME:
+		// replay swaps and times the main context's frame
+		r.use_context(TRACE_MAIN_CONTEXT);
+		r.frame_ended = true;
+		return false;
+	case TRACE_CONTEXT:
+		if (!r.use_context(r.get<GLubyte>())) {
+			std::cout << "replay: can't make a shared context for the asset worker's calls" << std::endl;
+			r.at = r.trace.size();
+			return false;
+		}
+		return true;
+	default:
+		r.at = r.trace.size();
+		return false;
+	}
+	r.calls++;
+	return true;
+}
+
+// --replay: the first frame, with all the loading in it, once, then the other frames loops times as fast as they
+// go. cpu is the time it takes to submit a frame's calls, gpu is a GL_TIME_ELAPSED query around them
+void replay_trace(GLFWwindow* window, const char* path, int loops) {
+	TraceReplay r;
+	if (!r.load(path))
+		return;
+	r.contexts[TRACE_MAIN_CONTEXT] = window;
+	glfwSwapInterval(0);
+	while (replay_call(r))
+		;
+	if (!r.frame_ended) {
+		std::cout << path << " has no whole frames" << std::endl;
+		r.release_contexts();
+		return;
+	}
+	size_t first_frame = r.at;
+
+	std::vector<GLuint> queries;
+	std::vector<double> cpu_ms, gpu_ms;
+	std::vector<size_t> calls;
+	int loops_done = 0;
+	for (; loops_done < std::max(loops, 1) && !glfwWindowShouldClose(window); loops_done++) {
+		r.at = first_frame;
+		size_t frame = 0;
+		for (;; frame++) {
+			if (frame == queries.size()) {
+				GLuint query;
+				glGenQueries(1, &query);
+				queries.push_back(query);
+				cpu_ms.push_back(0.0);
+				gpu_ms.push_back(0.0);
+				calls.push_back(0);
+			}
+			r.calls = 0;
+			glBeginQuery(GL_TIME_ELAPSED, queries[frame]);
+			double start = glfwGetTime();
+			while (replay_call(r))
+				;
+			double submit = glfwGetTime() - start;
+			glEndQuery(GL_TIME_ELAPSED);
+			if (!r.frame_ended)
+				break;
+			cpu_ms[frame] += submit * 1000.0;
+			calls[frame] = r.calls;
+			glfwSwapBuffers(window);
+			glfwPollEvents();
+		}
+		// waits for the last frames, that's outside of what's timed
+		for (size_t i = 0; i < frame; i++) {
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &ns);
+			gpu_ms[i] += ns / 1.0e6;
+		}
+	}
+	r.release_contexts();
+	glDeleteQueries((GLsizei)queries.size(), queries.data());
+
+	size_t frames = queries.size() - 1; // the last one is the partial frame after the final marker
+	double total_cpu = 0, total_gpu = 0, total_calls = 0;
+	std::cout << "replayed " << path << ": " << frames << " frames, " << loops_done << " loops" << std::endl;
+	for (size_t i = 0; i < frames; i++) {
+		std::cout << "  frame " << i << ": " << calls[i] << " calls, cpu " << cpu_ms[i] / loops_done << " ms, gpu " << gpu_ms[i] / loops_done << " ms" << std::endl;
+		total_cpu += cpu_ms[i] / loops_done;
+		total_gpu += gpu_ms[i] / loops_done;
+		total_calls += calls[i];
+	}
+	if (frames > 0)
+		std::cout << "  mean: " << total_calls / frames << " calls, cpu " << total_cpu / frames << " ms (" << total_cpu * 1.0e6 / std::max(total_calls, 1.0)
+			<< " ns per call), gpu " << total_gpu / frames << " ms per frame" << std::endl;
+}
+
+// per-frame gl call counters (I toggles): hooks on glad's pointers count every call by entry point, and what the
+// draws submit and the uploads send. while they're off the hooks aren't there at all, gl calls go straight to
+// the driver like before
+const char* const TRACE_NAMES[TRACE_CALLS] = {
+#define GL_TRACE_NAME(name, Trace, kinds) #name,
+	GL_TRACE_CALLS(GL_TRACE_NAME)
+#undef GL_TRACE_NAME
+};
+
+struct GLCallCounts {
+	unsigned long long calls[TRACE_CALLS];
+	unsigned long long triangles; // instances included; multi-draw indirect ones aren't, their counts stay on the gpu
+	unsigned long long upload_bytes; // glBufferData, glBufferSubData, and mappings opened for writing
+
+	unsigned long long sum(std::initializer_list<TraceCall> ids) const {
+		unsigned long long n = 0;
+		for (TraceCall id : ids)
+			n += calls[id];
+		return n;
+	}
+	unsigned long long total() const {
+		return std::accumulate(calls, calls + TRACE_CALLS, 0ull);
+	}
+	unsigned long long draws() const {
+		return sum({ TRACE_glDrawArrays, TRACE_glDrawArraysInstanced, TRACE_glDrawElements, TRACE_glDrawElementsBaseVertex,
+			TRACE_glDrawElementsInstanced, TRACE_glDrawElementsInstancedBaseVertex, TRACE_glMultiDrawElementsIndirect });
+	}
+	unsigned long long programs() const {
+		return sum({ TRACE_glUseProgram });
+	}
+	unsigned long long binds() const {
+		return sum({ TRACE_glBindBuffer, TRACE_glBindBufferBase, TRACE_glBindBufferRange, TRACE_glBindFramebuffer,
+			TRACE_glBindTexture, TRACE_glBindVertexArray });
+	}
+	unsigned long long uniforms() const {
+		return sum({ TRACE_glUniform1f, TRACE_glUniform1fv, TRACE_glUniform1i, TRACE_glUniform1ui, TRACE_glUniform2fv,
+			TRACE_glUniform3fv, TRACE_glUniform4fv, TRACE_glUniformMatrix4fv });
+	}
+};
+
+struct GLCounters {
+	GLHookLayer layer;
+	bool enabled;
+	// this frame so far, the asset worker's context counts too
+	std::atomic<unsigned long long> calls[TRACE_CALLS];
+	std::atomic<unsigned long long> triangles, upload_bytes;
+	GLCallCounts last_frame;
+
+	GLCounters() : enabled(false) {}
+
+	// count_hooks has one per TraceCall
+	void enable(bool on, const TraceProc* count_hooks) {
+		if (on == enabled)
+			return;
+		if (on)
+			install_gl_hooks(layer, count_hooks);
+		else
+			remove_gl_hooks(layer);
+		enabled = on;
+		for (int i = 0; i < TRACE_CALLS; i++)
+			calls[i] = 0;
+		triangles = upload_bytes = 0;
+		last_frame = GLCallCounts();
+	}
+
+	// after the frame's last call, like the trace's marker
+	void end_frame() {
+		if (!enabled)
+			return;
+		for (int i = 0; i < TRACE_CALLS; i++)
+			last_frame.calls[i] = calls[i].exchange(0, std::memory_order_relaxed);
+		last_frame.triangles = triangles.exchange(0, std::memory_order_relaxed);
+		last_frame.upload_bytes = upload_bytes.exchange(0, std::memory_order_relaxed);
+	}
+
+	void add_triangles(GLenum mode, GLsizei count, GLsizei instances) {
+		unsigned long long n = 0;
+		if (mode == GL_TRIANGLES || mode == GL_PATCHES) // the tessellation path's patches are triangles
+			n = count / 3;
+		else if (mode == GL_TRIANGLE_STRIP || mode == GL_TRIANGLE_FAN)
+			n = std::max(count - 2, 0);
+		triangles.fetch_add(n * std::max(instances, 0), std::memory_order_relaxed);
+	}
+
+	void add_upload(GLsizeiptr bytes) {
+		upload_bytes.fetch_add(bytes, std::memory_order_relaxed);
+	}
+};
+
+GLCounters gl_counters;
+
+// what a call adds besides itself; nothing, unless it's one of these
+template <int ID, class... A>
+void count_args(std::integral_constant<int, ID>, A...) {}
+inline void count_args(std::integral_constant<int, TRACE_glDrawArrays>, GLenum mode, GLint, GLsizei count) {
+	gl_counters.add_triangles(mode, count, 1);
+}
+inline void count_args(std::integral_constant<int, TRACE_glDrawArraysInstanced>, GLenum mode, GLint, GLsizei count, GLsizei instances) {
+	gl_counters.add_triangles(mode, count, instances);
+}
+inline void count_args(std::integral_constant<int, TRACE_glDrawElements>, GLenum mode, GLsizei count, GLenum, const void*) {
+	gl_counters.add_triangles(mode, count, 1);
+}
+inline void count_args(std::integral_constant<int, TRACE_glDrawElementsBaseVertex>, GLenum mode, GLsizei count, GLenum, const void*, GLint) {
+	gl_counters.add_triangles(mode, count, 1);
+}
+inline void count_args(std::integral_constant<int, TRACE_glDrawElementsInstanced>, GLenum mode, GLsizei count, GLenum, const void*, GLsizei instances) {
+	gl_counters.add_triangles(mode, count, instances);
+}
+inline void count_args(std::integral_constant<int, TRACE_glDrawElementsInstancedBaseVertex>, GLenum mode, GLsizei count, GLenum, const void*,
+	GLsizei instances, GLint) {
+	gl_counters.add_triangles(mode, count, instances);
+}
+inline void count_args(std::integral_constant<int, TRACE_glBufferData>, GLenum, GLsizeiptr size, const void* data, GLenum) {
+	if (data != NULL)
+		gl_counters.add_upload(size);
+}
+inline void count_args(std::integral_constant<int, TRACE_glBufferSubData>, GLenum, GLintptr, GLsizeiptr size, const void*) {
+	gl_counters.add_upload(size);
+}
+inline void count_args(std::integral_constant<int, TRACE_glMapBufferRange>, GLenum, GLintptr, GLsizeiptr length, GLbitfield access) {
+	if (access & GL_MAP_WRITE_BIT)
+		gl_counters.add_upload(length);
+}
+
+template <int ID, class F>
+struct CountCall;
+template <int ID, class R, class... A>
+struct CountCall<ID, R (APIENTRYP)(A...)> {
+	typedef R (APIENTRYP F)(A...);
+
+	static R APIENTRY hook(A... args) {
+		gl_counters.calls[ID].fetch_add(1, std::memory_order_relaxed);
+		count_args(std::integral_constant<int, ID>(), args...);
+		return ((F)gl_counters.layer.next[ID])(args...);
+	}
+};
+
+const TraceProc COUNT_HOOKS[TRACE_CALLS] = {
+#define GL_COUNT_HOOK(name, Trace, kinds) (TraceProc)&CountCall<TRACE_##name, decltype(glad_##name)>::hook,
+	GL_TRACE_CALLS(GL_COUNT_HOOK)
+#undef GL_COUNT_HOOK
+};
+
+// one line: the totals, and the entry points called most
+void print_gl_counts(std::ostream& out, const GLCallCounts& counts) {
+	out << counts.total() << " calls: " << counts.draws() << " draws (" << counts.triangles << " triangles), "
+		<< counts.programs() << " program switches, " << counts.binds() << " binds, " << counts.uniforms() << " uniforms, "
+		<< counts.upload_bytes / 1024.0 << " KB uploaded; most called";
+	std::vector<int> ids(TRACE_CALLS);
+	std::iota(ids.begin(), ids.end(), 0);
+	std::partial_sort(ids.begin(), ids.begin() + 4, ids.end(), [&](int a, int b) { return counts.calls[a] > counts.calls[b]; });
+	for (int i = 0; i < 4 && counts.calls[ids[i]] > 0; i++)
+		out << (i > 0 ? ", " : " ") << TRACE_NAMES[ids[i]] << " " << counts.calls[ids[i]];
+}
+
+// --check-gl-hooks: the trace's and the counters' layers on and off in both orders. after every step each of glad's
+// pointers has to lead through the layers still on, top first, to the driver, and a call has to be counted exactly
+// when the counters are on. the trace's layer isn't capturing here, its hooks just call through
+bool check_gl_hooks() {
+	struct Step {
+		const char* name;
+		GLHookLayer* layer;
+		const TraceProc* hooks;
+		bool on;
+	};
+	const Step TRACE_ON = { "trace on", &gl_trace.layer, TRACE_HOOKS, true };
+	const Step TRACE_OFF = { "trace off", &gl_trace.layer, TRACE_HOOKS, false };
+	const Step COUNTERS_ON = { "counters on", &gl_counters.layer, COUNT_HOOKS, true };
+	const Step COUNTERS_OFF = { "counters off", &gl_counters.layer, COUNT_HOOKS, false };
+	const Step ORDERS[2][4] = {
+		{ TRACE_ON, COUNTERS_ON, TRACE_OFF, COUNTERS_OFF }, // a capture ending while the counters are on
+		{ TRACE_ON, COUNTERS_ON, COUNTERS_OFF, TRACE_OFF },
+	};
+	TraceProc driver[TRACE_CALLS];
+	for (int i = 0; i < TRACE_CALLS; i++)
+		driver[i] = *TRACE_SLOTS[i];
+
+	bool all_ok = true;
+	for (const auto& order : ORDERS) {
+		std::vector<const Step*> on; // bottom first
+		std::cout << "gl hooks:";
+		for (const Step& step : order) {
+			if (step.layer == &gl_counters.layer) {
+				gl_counters.enable(step.on, step.hooks);
+			} else if (step.on) {
+				install_gl_hooks(*step.layer, step.hooks);
+			} else {
+				remove_gl_hooks(*step.layer);
+			}
+			if (step.on)
+				on.push_back(&step);
+			else
+				on.erase(std::find_if(on.begin(), on.end(), [&](const Step* s) { return s->layer == step.layer; }));
+
+			int broken = 0;
+			for (int i = 0; i < TRACE_CALLS; i++) {
+				TraceProc p = *TRACE_SLOTS[i];
+				for (auto s = on.rbegin(); s != on.rend() && driver[i] != NULL; ++s) {
+					if (p != (*s)->hooks[i])
+						break;
+					p = (*s)->layer->next[i];
+				}
+				if (p != driver[i])
+					broken++;
+			}
+			unsigned long long before = gl_counters.calls[TRACE_glGetError];
+			glGetError();
+			unsigned long long counted = gl_counters.calls[TRACE_glGetError] - before;
+			bool ok = broken == 0 && counted == (gl_counters.enabled ? 1u : 0u);
+			std::cout << (&step == order ? " " : ", ") << step.name << " " << (ok ? "ok" : "FAILED");
+			if (broken > 0)
+				std::cout << " (" << broken << " pointers off the chain)";
+			all_ok = all_ok && ok;
+		}
+		std::cout << std::endl;
+	}
+	return all_ok;
+}
+
+// screen rect (pixels of viewport) and nearest window depth of a sphere's bounding box under pv;
+// false when the box reaches behind the near plane, those are never called occluded. cull.csh has the same
+bool hiz_bounds(const glm::mat4& pv, glm::vec2 viewport, const glm::vec4& s, glm::vec2& lo, glm::vec2& hi, float& nearest) {
+	glm::vec3 ndc_min(FLT_MAX), ndc_max(-FLT_MAX);
+	for (int i = 0; i < 8; i++) {
+		glm::vec3 corner = glm::vec3(s) + glm::vec3(i & 1 ? s.w : -s.w, i & 2 ? s.w : -s.w, i & 4 ? s.w : -s.w);
+		glm::vec4 clip = pv * glm::vec4(corner, 1.f);
+		if (clip.w <= NEAR_PLANE)
+			return false;
+		glm::vec3 ndc = glm::vec3(clip) / clip.w;
+		ndc_min = glm::min(ndc_min, ndc);
+		ndc_max = glm::max(ndc_max, ndc);
+	}
+	lo = glm::min(glm::max((glm::vec2(ndc_min.x, ndc_min.y) * 0.5f + 0.5f) * viewport, glm::vec2(0.f)), viewport);
+	hi = glm::min(glm::max((glm::vec2(ndc_max.x, ndc_max.y) * 0.5f + 0.5f) * viewport, glm::vec2(0.f)), viewport);
+	nearest = ndc_min.z * 0.5f + 0.5f;
+	return true;
+}
+
+// hierarchical z: the finished frame's depth buffer halved down to 1x1, every texel the farthest depth under
+// it. a sphere whose nearest point lies behind the farthest depth of the (at most 2x2) texels covering it
+// at the right level is hidden. the next frame tests against it, with the pv and viewport it was drawn with
+struct HiZPyramid {
+	GLuint texture, fbo;
+	int width, height; // of the depth buffer it's built from
+	std::vector<glm::ivec2> sizes; // per level, level 0 is half the depth buffer
+	glm::mat4 pv;
+	glm::vec2 viewport;
+	bool valid;
+
+	HiZPyramid() : texture(0), fbo(0), width(0), height(0), valid(false) {}
+
+	void resize(int w, int h) {
+		if (w == width && h == height)
+			return;
+		release();
+		width = w;
+		height = h;
+		glm::ivec2 size(std::max(w / 2, 1), std::max(h / 2, 1));
+		for (;;) {
+			sizes.push_back(size);
+			if (size.x == 1 && size.y == 1)
+				break;
+			size = glm::max(size / 2, glm::ivec2(1));
+		}
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		for (size_t l = 0; l < sizes.size(); l++)
+			glTexImage2D(GL_TEXTURE_2D, (GLint)l, GL_R32F, sizes[l].x, sizes[l].y, 0, GL_RED, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)sizes.size() - 1);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glGenFramebuffers(1, &fbo);
+	}
+
+	void release() {
+		if (texture == 0)
+			return;
+		glDeleteTextures(1, &texture);
+		glDeleteFramebuffers(1, &fbo);
+		texture = fbo = 0;
+		width = height = 0;
+		sizes.clear();
+		valid = false;
+	}
+
+	// one pass of hiz.fsh per level; leaves the depth test off and texture unit 0 bound to the pyramid
+	void build(const RenderTarget& target, const glm::mat4& frame_pv, glm::vec2 frame_viewport, GLuint program, GLint loc_source, GLuint vao) {
+		resize(target.width, target.height);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glDisable(GL_DEPTH_TEST);
+		gl_state.use_program(program);
+		gl_state.uniform1i(loc_source, 0);
+		gl_state.bind_vertex_array(vao);
+		glActiveTexture(GL_TEXTURE0);
+		for (size_t l = 0; l < sizes.size(); l++) {
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, (GLint)l);
+			glViewport(0, 0, sizes[l].x, sizes[l].y);
+			if (l == 0) {
+				glBindTexture(GL_TEXTURE_2D, target.depth);
+			}
+			else {
+				// only the level we read is in range, otherwise writing the next one would be a feedback loop
+				glBindTexture(GL_TEXTURE_2D, texture);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, (GLint)l - 1);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)l - 1);
+			}
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+			gl_state.current.draws++;
+		}
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)sizes.size() - 1);
+		glEnable(GL_DEPTH_TEST);
+		pv = frame_pv;
+		viewport = frame_viewport;
+		valid = true;
+	}
+};
+
+// the coarse end of a pyramid on the cpu, for the classic path: the first level no bigger than max_texels
+// a side comes back through an AsyncReadback a few frames late, the levels below it are reduced here
+struct HiZCopy {
+	AsyncReadback readback;
+	// what each readback slot holds
+	int slot_level[AsyncReadback::LATENCY];
+	glm::ivec2 slot_size[AsyncReadback::LATENCY];
+	glm::mat4 slot_pv[AsyncReadback::LATENCY];
+	glm::vec2 slot_viewport[AsyncReadback::LATENCY];
+
+	int base_level; // pyramid level of levels[0]
+	std::vector<glm::ivec2> sizes;
+	std::vector<std::vector<float>> levels;
+	glm::mat4 pv;
+	glm::vec2 viewport;
+	bool valid;
+
+	void init() {
+		readback.init();
+		valid = false;
+	}
+
+	void release() {
+		readback.release();
+	}
+
+	void request(const HiZPyramid& hiz, int max_texels) {
+		if (!hiz.valid)
+			return;
+		int level = 0;
+		while (level + 1 < (int)hiz.sizes.size() && (hiz.sizes[level].x > max_texels || hiz.sizes[level].y > max_texels))
+			level++;
+		glm::ivec2 size = hiz.sizes[level];
+		int slot = readback.acquire(sizeof(float) * size.x * size.y);
+		if (slot < 0)
+			return;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffers[slot]);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glBindTexture(GL_TEXTURE_2D, hiz.texture);
+		glGetTexImage(GL_TEXTURE_2D, level, GL_RED, GL_FLOAT, 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		readback.submit(slot);
+		slot_level[slot] = level;
+		slot_size[slot] = size;
+		slot_pv[slot] = hiz.pv;
+		slot_viewport[slot] = hiz.viewport;
+	}
+
+	// takes the newest copy that has arrived, if any
+	void poll() {
+		int slot, newest = -1;
+		while ((slot = readback.poll()) >= 0) {
+			newest = slot;
+			glm::ivec2 size = slot_size[slot];
+			sizes.assign(1, size);
+			levels.resize(1);
+			levels[0].resize(size.x * size.y);
+			readback.read(slot, levels[0].data(), sizeof(float) * size.x * size.y);
+		}
+		if (newest < 0)
+			return;
+		base_level = slot_level[newest];
+		pv = slot_pv[newest];
+		viewport = slot_viewport[newest];
+		// same reduction as hiz.fsh
+		while (sizes.back().x > 1 || sizes.back().y > 1) {
+			glm::ivec2 src = sizes.back();
+			glm::ivec2 dst = glm::max(src / 2, glm::ivec2(1));
+			std::vector<float> next(dst.x * dst.y);
+			const std::vector<float>& above = levels.back();
+			for (int y = 0; y < dst.y; y++) {
+				for (int x = 0; x < dst.x; x++) {
+					int x1 = std::min(x * 2 + (x * 2 + 3 == src.x ? 2 : 1), src.x - 1);
+					int y1 = std::min(y * 2 + (y * 2 + 3 == src.y ? 2 : 1), src.y - 1);
+					float d = 0.f;
+					for (int sy = y * 2; sy <= y1; sy++)
+						for (int sx = x * 2; sx <= x1; sx++)
+							d = std::max(d, above[sy * src.x + sx]);
+					next[y * dst.x + x] = d;
+				}
+			}
+			sizes.push_back(dst);
+			levels.push_back(std::move(next));
+		}
+		valid = true;
+	}
+
+	bool occluded(const glm::vec4& s) const {
+		glm::vec2 lo, hi;
+		float nearest;
+		if (!valid || !hiz_bounds(pv, viewport, s, lo, hi, nearest))
+			return false;
+		// into texels of levels[0], 2^(base_level + 1) pixels wide, then the level where the rect spans <= 1 texel
+		float texel = (float)(2 << base_level);
+		lo /= texel;
+		hi /= texel;
+		float extent = std::max(hi.x - lo.x, hi.y - lo.y);
+		int level = std::min((int)std::ceil(std::log2(std::max(extent, 1.f))), (int)levels.size() - 1);
+		float scale = 1.f / (1 << level);
+		glm::ivec2 size = sizes[level];
+		int x0 = std::min((int)(lo.x * scale), size.x - 1), x1 = std::min((int)(hi.x * scale), size.x - 1);
+		int y0 = std::min((int)(lo.y * scale), size.y - 1), y1 = std::min((int)(hi.y * scale), size.y - 1);
+		const std::vector<float>& l = levels[level];
+		float farthest = std::max(std::max(l[y0 * size.x + x0], l[y0 * size.x + x1]), std::max(l[y1 * size.x + x0], l[y1 * size.x + x1]));
+		return nearest > farthest;
+	}
+};
+
+// read-only view of a whole file, mapped so only the pages that get touched are ever read from disk
+struct MappedFile {
+	const unsigned char* data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file, mapping;
+#endif
+
+	MappedFile() : data(NULL), size(0) {}
+
+	bool open(const char* path) {
+#ifdef _WIN32
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(file, &file_size);
+		size = (size_t)file_size.QuadPart;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL) {
+			CloseHandle(file);
+			return false;
+		}
+		data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (data == NULL) {
+			CloseHandle(mapping);
+			CloseHandle(file);
+			return false;
+		}
+#else
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		fstat(fd, &st);
+		size = (size_t)st.st_size;
+		void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED)
+			return false;
+		madvise(p, size, MADV_RANDOM);
+		data = (const unsigned char*)p;
+#endif
+		return true;
+	}
+
+	void close() {
+		if (data == NULL)
+			return;
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+		CloseHandle(mapping);
+		CloseHandle(file);
+#else
+		munmap((void*)data, size);
+#endif
+		data = NULL;
+		size = 0;
+	}
+};
+
+// scene files: header, tile directory, then one chunk per tile, page aligned
+// a chunk is count vec4s (xyz = center, w = radius) followed by count rgba8 colors
+// tiles are spatially coherent groups of at most TILE_CAPACITY spheres, which is also the unit of streaming
+struct SceneHeader {
+	char magic[4]; // "SPHS"
+	GLuint version;
+	GLuint tile_count;
+	GLuint tile_capacity;
+	unsigned long long sphere_count;
+};
+
+struct SceneTile {
+	glm::vec4 bounds; // bounding sphere of everything in the tile
+	unsigned long long offset; // of the chunk, from the start of the file
+	GLuint count;
+	GLuint pad;
+};
+
+const GLuint SCENE_VERSION = 1;
+const size_t SCENE_CHUNK_ALIGN = 4096;
+
+// writes a scene tile by tile, so a generated scene never has to fit in memory
+// the directory goes right after the header, so the tile count has to be known up front
+struct SceneWriter {
+	std::ostream& out;
+	std::vector<SceneTile> tiles;
+	GLuint tile_count;
+	unsigned long long sphere_count;
+	unsigned long long offset;
+
+	SceneWriter(std::ostream& stream, GLuint num_tiles) : out(stream), tile_count(num_tiles), sphere_count(0) {
+		// header and directory get written over this in finish(); zeros rather than a seek, string streams can't seek past the end
+		offset = align(sizeof(SceneHeader) + sizeof(SceneTile) * num_tiles);
+		for (unsigned long long i = 0; i < offset; i++)
+			out.put(0);
+	}
+
+	static unsigned long long align(unsigned long long x) {
+		return (x + SCENE_CHUNK_ALIGN - 1) / SCENE_CHUNK_ALIGN * SCENE_CHUNK_ALIGN;
+	}
+
+	void add_tile(const glm::vec4* spheres, const GLuint* colors, GLuint count) {
+		// bounding sphere around the box of the centers, grown to hold every radius
+		glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+		for (GLuint i = 0; i < count; i++) {
+			lo = glm::min(lo, glm::vec3(spheres[i]));
+			hi = glm::max(hi, glm::vec3(spheres[i]));
+		}
+		glm::vec3 center = (lo + hi) * 0.5f;
+		float radius = 0.f;
+		for (GLuint i = 0; i < count; i++)
+			radius = std::max(radius, glm::length(glm::vec3(spheres[i]) - center) + spheres[i].w);
+
+		SceneTile tile;
+		tile.bounds = glm::vec4(center, radius);
+		tile.offset = offset;
+		tile.count = count;
+		tile.pad = 0;
+		tiles.push_back(tile);
+
+		out.write((const char*)spheres, sizeof(glm::vec4) * count);
+		out.write((const char*)colors, sizeof(GLuint) * count);
+		unsigned long long end = align(offset + (sizeof(glm::vec4) + sizeof(GLuint)) * count);
+		for (unsigned long long i = offset + (sizeof(glm::vec4) + sizeof(GLuint)) * count; i < end; i++)
+			out.put(0);
+		offset = end;
+		sphere_count += count;
+	}
+
+	bool finish() {
+		if (tiles.size() != tile_count)
+			return false;
+		SceneHeader header;
+		memcpy(header.magic, "SPHS", 4);
+		header.version = SCENE_VERSION;
+		header.tile_count = tile_count;
+		header.tile_capacity = TILE_CAPACITY;
+		header.sphere_count = sphere_count;
+		out.seekp(0);
+		out.write((const char*)&header, sizeof(header));
+		out.write((const char*)tiles.data(), sizeof(SceneTile) * tiles.size());
+		out.flush();
+		return (bool)out;
+	}
+};
+
+// bins spheres into SCENE_TILE_SIZE cells and cuts every cell into tiles of at most TILE_CAPACITY
+void write_scene(std::ostream& out, const std::vector<glm::vec4>& spheres, const std::vector<GLuint>& colors) {
+	std::map<std::tuple<int, int, int>, std::vector<GLuint>> cells;
+	for (GLuint i = 0; i < spheres.size(); i++) {
+		glm::vec3 c = glm::floor(glm::vec3(spheres[i]) / SCENE_TILE_SIZE);
+		cells[std::make_tuple((int)c.x, (int)c.y, (int)c.z)].push_back(i);
+	}
+	GLuint num_tiles = 0;
+	for (auto& cell : cells)
+		num_tiles += ((GLuint)cell.second.size() + TILE_CAPACITY - 1) / TILE_CAPACITY;
+
+	SceneWriter writer(out, num_tiles);
+	std::vector<glm::vec4> tile_spheres;
+	std::vector<GLuint> tile_colors;
+	for (auto& cell : cells) {
+		for (size_t first = 0; first < cell.second.size(); first += TILE_CAPACITY) {
+			size_t last = std::min(first + TILE_CAPACITY, cell.second.size());
+			tile_spheres.clear();
+			tile_colors.clear();
+			for (size_t i = first; i < last; i++) {
+				tile_spheres.push_back(spheres[cell.second[i]]);
+				tile_colors.push_back(colors[cell.second[i]]);
+			}
+			writer.add_tile(tile_spheres.data(), tile_colors.data(), (GLuint)tile_spheres.size());
+		}
+	}
+	writer.finish();
+}
+
+// random test scene: a cube of tiles_per_axis^3 cells, each one a full tile of random spheres
+bool generate_scene_file(const char* path, int tiles_per_axis, int spheres_per_tile) {
+	std::ofstream out(path, std::ios::binary);
+	if (!out)
+		return false;
+	GLuint count = (GLuint)std::min(spheres_per_tile, (int)TILE_CAPACITY);
+	SceneWriter writer(out, (GLuint)(tiles_per_axis * tiles_per_axis * tiles_per_axis));
+	std::vector<glm::vec4> spheres(count);
+	std::vector<GLuint> colors(count);
+	glm::vec3 origin(-tiles_per_axis * SCENE_TILE_SIZE * 0.5f);
+	for (int z = 0; z < tiles_per_axis; z++) {
+		for (int y = 0; y < tiles_per_axis; y++) {
+			for (int x = 0; x < tiles_per_axis; x++) {
+				glm::vec3 cell = origin + glm::vec3(x, y, z) * SCENE_TILE_SIZE;
+				for (GLuint i = 0; i < count; i++) {
+					glm::vec3 c = cell + glm::vec3(rand() % 10000, rand() % 10000, rand() % 10000) * (SCENE_TILE_SIZE / 10000.f);
+					spheres[i] = glm::vec4(c, 0.02f + (rand() % 100) * 0.001f);
+					colors[i] = 0xff000000u | (GLuint)(64 + rand() % 192) << 16 | (GLuint)(64 + rand() % 192) << 8 | (GLuint)(64 + rand() % 192);
+				}
+				writer.add_tile(spheres.data(), colors.data(), count);
+			}
+		}
+		std::cout << "\r" << (z + 1) * 100 / tiles_per_axis << "%" << std::flush;
+	}
+	std::cout << std::endl;
+	return writer.finish();
+}
+
+// a scene in memory or in a mapped file, same layout either way
+struct SceneSource {
+	const unsigned char* data;
+	size_t size;
+	const SceneHeader* header;
+	const SceneTile* tiles;
+
+	SceneSource() : data(NULL), size(0), header(NULL), tiles(NULL) {}
+
+	bool open(const unsigned char* bytes, size_t length) {
+		if (length < sizeof(SceneHeader))
+			return false;
+		const SceneHeader* h = (const SceneHeader*)bytes;
+		if (memcmp(h->magic, "SPHS", 4) != 0 || h->version != SCENE_VERSION || h->tile_capacity > TILE_CAPACITY
+			|| length < sizeof(SceneHeader) + sizeof(SceneTile) * (size_t)h->tile_count)
+			return false;
+		const SceneTile* t = (const SceneTile*)(bytes + sizeof(SceneHeader));
+		for (GLuint i = 0; i < h->tile_count; i++) {
+			if (t[i].count > h->tile_capacity || t[i].offset + (sizeof(glm::vec4) + sizeof(GLuint)) * t[i].count > length)
+				return false;
+		}
+		data = bytes;
+		size = length;
+		header = h;
+		tiles = t;
+		return true;
+	}
+};
+
+// keeps the tiles that matter for the current view resident on the gpu, inside a fixed budget
+// - every frame the tile directory is culled against the frustum, and tiles too small on screen are skipped
+// - missing tiles go to a loader thread, which copies the chunk out of the mapping (so page faults hit
+//   that thread, not this one); at most STREAM_MAX_IN_FLIGHT at a time, biggest on screen first
+// - finished loads go through an orphaned staging buffer and glCopyBufferSubData into a free slot of the
+//   pool, or into the least recently used slot that isn't needed this frame
+// the pool is exposed as two buffer textures (objects, colors) for impostor.vsh
+struct SceneStreamer {
+	struct Load {
+		GLuint tile;
+		std::vector<unsigned char> data;
+	};
+	enum TileState : unsigned char { TILE_ABSENT, TILE_LOADING, TILE_RESIDENT };
+
+	SceneSource scene;
+	GLuint num_slots;
+	GLuint object_pool, color_pool, staging;
+	GLuint object_texture, color_texture;
+	std::vector<int> slot_tile; // -1 = free
+	std::vector<unsigned> slot_used; // frame the slot was last wanted
+	std::vector<int> tile_slot;
+	std::vector<TileState> tile_state;
+	std::vector<std::pair<float, GLuint>> wanted;
+	std::vector<GLuint> visible_slots; // resident and wanted this frame, what gets drawn
+	unsigned frame;
+	int in_flight;
+	// since the last reset_stats()
+	int loads, evictions, dropped;
+	size_t uploaded_bytes;
+
+	std::thread loader;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<GLuint> requests;
+	std::deque<Load> done;
+	bool quit;
+
+	SceneStreamer() : num_slots(0), object_pool(0), frame(0), in_flight(0), quit(false) {
+		reset_stats();
+	}
+
+	void start(const SceneSource& source, size_t budget_bytes) {
+		scene = source;
+		num_slots = (GLuint)std::max<size_t>(budget_bytes / (TILE_CAPACITY * (sizeof(glm::vec4) + sizeof(GLuint))), 1);
+		slot_tile.assign(num_slots, -1);
+		slot_used.assign(num_slots, 0);
+		tile_slot.assign(scene.header->tile_count, -1);
+		tile_state.assign(scene.header->tile_count, TILE_ABSENT);
+
+		glGenBuffers(1, &object_pool);
+		glBindBuffer(GL_TEXTURE_BUFFER, object_pool);
+		glBufferData(GL_TEXTURE_BUFFER, (GLsizeiptr)num_slots * TILE_CAPACITY * sizeof(glm::vec4), NULL, GL_STATIC_DRAW);
+		glGenBuffers(1, &color_pool);
+		glBindBuffer(GL_TEXTURE_BUFFER, color_pool);
+		glBufferData(GL_TEXTURE_BUFFER, (GLsizeiptr)num_slots * TILE_CAPACITY * sizeof(GLuint), NULL, GL_STATIC_DRAW);
+		glGenBuffers(1, &staging);
+
+		glGenTextures(1, &object_texture);
+		glBindTexture(GL_TEXTURE_BUFFER, object_texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, object_pool);
+		glGenTextures(1, &color_texture);
+		glBindTexture(GL_TEXTURE_BUFFER, color_texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA8, color_pool);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+		quit = false;
+		loader = std::thread(&SceneStreamer::load_tiles, this);
+	}
+
+	void stop() {
+		if (object_pool == 0)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		loader.join();
+		glDeleteBuffers(1, &object_pool);
+		glDeleteBuffers(1, &color_pool);
+		glDeleteBuffers(1, &staging);
+		glDeleteTextures(1, &object_texture);
+		glDeleteTextures(1, &color_texture);
+		object_pool = 0;
+	}
+
+	void reset_stats() {
+		loads = evictions = dropped = 0;
+		uploaded_bytes = 0;
+	}
+
+	// loader thread
+	void load_tiles() {
+		for (;;) {
+			GLuint tile;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this] { return quit || !requests.empty(); });
+				if (quit)
+					return;
+				tile = requests.front();
+				requests.pop_front();
+			}
+			Load load;
+			load.tile = tile;
+			const SceneTile& t = scene.tiles[tile];
+			const unsigned char* chunk = scene.data + t.offset;
+			load.data.assign(chunk, chunk + (sizeof(glm::vec4) + sizeof(GLuint)) * t.count);
+			std::lock_guard<std::mutex> lock(mutex);
+			done.push_back(std::move(load));
+		}
+	}
+
+	void update(const glm::vec4 frustum[6], glm::vec3 eye, float pixel_scale) {
+		frame++;
+
+		// what this view wants, by projected radius of the tile's bounding sphere
+		wanted.clear();
+		for (GLuint i = 0; i < scene.header->tile_count; i++) {
+			glm::vec4 b = scene.tiles[i].bounds;
+			bool inside = true;
+			for (int k = 0; k < 6 && inside; k++)
+				inside = glm::dot(glm::vec3(frustum[k]), glm::vec3(b)) + frustum[k].w > -b.w;
+			if (!inside)
+				continue;
+			float distance = std::max(glm::length(glm::vec3(b) - eye) - b.w, NEAR_PLANE);
+			float pixels = b.w * pixel_scale / distance;
+			if (pixels < STREAM_MIN_TILE_PIXELS)
+				continue;
+			if (tile_state[i] == TILE_RESIDENT)
+				slot_used[tile_slot[i]] = frame;
+			else if (tile_state[i] == TILE_ABSENT)
+				wanted.push_back(std::make_pair(pixels, i));
+		}
+
+		// biggest first, as many as the loader may have in flight and as there are slots to put them in;
+		// when every slot holds something on screen there's no point loading more, it would only be dropped
+		int spare_slots = 0;
+		for (GLuint s = 0; s < num_slots; s++)
+			spare_slots += slot_tile[s] < 0 || slot_used[s] != frame;
+		int free_requests = std::min(STREAM_MAX_IN_FLIGHT, spare_slots) - in_flight;
+		if (free_requests > 0 && !wanted.empty()) {
+			size_t n = std::min(wanted.size(), (size_t)free_requests);
+			std::partial_sort(wanted.begin(), wanted.begin() + n, wanted.end(), std::greater<std::pair<float, GLuint>>());
+			std::lock_guard<std::mutex> lock(mutex);
+			for (size_t i = 0; i < n; i++) {
+				tile_state[wanted[i].second] = TILE_LOADING;
+				requests.push_back(wanted[i].second);
+				in_flight++;
+			}
+		}
+		wake.notify_one();
+
+		// upload what the loader finished
+		for (int u = 0; u < STREAM_UPLOADS_PER_FRAME; u++) {
+			Load load;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (done.empty())
+					break;
+				load = std::move(done.front());
+				done.pop_front();
+			}
+			in_flight--;
+			int slot = find_slot();
+			if (slot < 0) {
+				// everything resident is on screen, the budget is full
+				tile_state[load.tile] = TILE_ABSENT;
+				dropped++;
+				continue;
+			}
+			upload(load, slot);
+		}
+
+		visible_slots.clear();
+		for (GLuint s = 0; s < num_slots; s++) {
+			if (slot_tile[s] >= 0 && slot_used[s] == frame)
+				visible_slots.push_back(s);
+		}
+	}
+
+	// a free slot, else the least recently wanted one that isn't wanted this frame
+	int find_slot() {
+		int lru = -1;
+		for (GLuint s = 0; s < num_slots; s++) {
+			if (slot_tile[s] < 0)
+				return s;
+			if (slot_used[s] != frame && (lru < 0 || slot_used[s] < slot_used[lru]))
+				lru = s;
+		}
+		if (lru >= 0) {
+			tile_state[slot_tile[lru]] = TILE_ABSENT;
+			tile_slot[slot_tile[lru]] = -1;
+			slot_tile[lru] = -1;
+			evictions++;
+		}
+		return lru;
+	}
+
+	void upload(const Load& load, int slot) {
+		GLuint count = scene.tiles[load.tile].count;
+		GLsizeiptr bytes = (GLsizeiptr)load.data.size();
+		// orphan, so the write never waits on a copy the gpu hasn't done yet
+		glBindBuffer(GL_COPY_READ_BUFFER, staging);
+		glBufferData(GL_COPY_READ_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_COPY_READ_BUFFER, 0, bytes, load.data.data());
+		glBindBuffer(GL_COPY_WRITE_BUFFER, object_pool);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, (GLintptr)slot * TILE_CAPACITY * sizeof(glm::vec4), count * sizeof(glm::vec4));
+		glBindBuffer(GL_COPY_WRITE_BUFFER, color_pool);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, count * sizeof(glm::vec4), (GLintptr)slot * TILE_CAPACITY * sizeof(GLuint), count * sizeof(GLuint));
+
+		slot_tile[slot] = load.tile;
+		slot_used[slot] = frame;
+		tile_slot[load.tile] = slot;
+		tile_state[load.tile] = TILE_RESIDENT;
+		loads++;
+		uploaded_bytes += bytes;
+	}
+
+	GLuint resident_tiles() const {
+		GLuint n = 0;
+		for (GLuint s = 0; s < num_slots; s++)
+			n += slot_tile[s] >= 0;
+		return n;
+	}
+
+	size_t resident_spheres() const {
+		size_t n = 0;
+		for (GLuint s = 0; s < num_slots; s++) {
+			if (slot_tile[s] >= 0)
+				n += scene.tiles[slot_tile[s]].count;
+		}
+		return n;
+	}
+};
+
+// the classic path's sphere, buffers + the vao that ties them together
+struct SphereMesh {
+	GLuint vao, vbo, ebo;
+	GLsizei index_count, vertex_count;
+	int level;
+	SphereBase base;
+};
+
+// vao for a sphere mesh's buffers; vaos aren't shared between contexts, so this always runs on the render thread
+GLuint make_sphere_vao(GLuint vbo, GLuint ebo) {
+	GLuint vao;
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 0);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+	glVertexAttribPointer(2, 4, GL_FLOAT, GL_TRUE, sizeof(Vertex), (void*)offsetof(Vertex, color));
+	glBindVertexArray(0);
+	return vao;
+}
+
+// displaced copies of the classic path's mesh, captured with transform feedback so the depth pre-pass, the
+// shading pass and whatever else draws an object use the same vertices without running displace.glsl again
+// one slot per object, each a whole mesh in Vertex layout; a slot stays valid for as long as its object's
+// parameters and the animation time don't change, so a paused animation does no displacement work at all
+struct DisplacementCache {
+	struct Slot {
+		GLint object; // -1 = free
+		glm::vec4 params;
+		float time;
+		int last_used; // frame
+	};
+	GLuint buffer, vao;
+	GLuint mesh_vao; // what captures read from
+	GLsizei vertex_count;
+	std::vector<Slot> slots;
+	std::vector<GLint> object_slot; // -1 = not cached
+	std::vector<int> pending; // slots to capture in flush()
+	int frame;
+	int hits, captures, misses; // this frame, misses found no slot and were displaced on the fly
+
+	DisplacementCache() : buffer(0), vao(0), mesh_vao(0), vertex_count(0), frame(0), hits(0), captures(0), misses(0) {}
+
+	// as many slots of this mesh as fit the budget (at least one); everything cached so far is dropped
+	void reset(const SphereMesh& mesh, size_t object_count, size_t budget_bytes) {
+		release();
+		mesh_vao = mesh.vao;
+		vertex_count = mesh.vertex_count;
+		size_t slot_bytes = sizeof(Vertex) * vertex_count;
+		slots.assign(std::max(budget_bytes / slot_bytes, (size_t)1), Slot{ -1, glm::vec4(0.f), 0.f, -1 });
+		object_slot.assign(object_count, -1);
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glBufferData(GL_ARRAY_BUFFER, slot_bytes * slots.size(), NULL, GL_DYNAMIC_COPY);
+		// the mesh's indices, offset into a slot with the draw's base vertex
+		vao = make_sphere_vao(buffer, mesh.ebo);
+	}
+
+	void release() {
+		glDeleteVertexArrays(1, &vao);
+		glDeleteBuffers(1, &buffer);
+		vao = buffer = 0;
+		slots.clear();
+		object_slot.clear();
+		pending.clear();
+	}
+
+	void begin_frame() {
+		frame++;
+		hits = captures = misses = 0;
+	}
+
+	// the slot holding object displaced by params at time, queued for capture if it isn't there yet;
+	// -1 if every slot is already in use this frame
+	int fetch(GLuint object, const glm::vec4& params, float time) {
+		int slot = object_slot[object];
+		if (slot >= 0 && slots[slot].params == params && slots[slot].time == time) {
+			slots[slot].last_used = frame;
+			hits++;
+			return slot;
+		}
+		if (slot < 0) {
+			// least recently used, as long as this frame isn't using it
+			for (int i = 0; i < (int)slots.size(); i++) {
+				if (slots[i].last_used < frame && (slot < 0 || slots[i].last_used < slots[slot].last_used))
+					slot = i;
+			}
+			if (slot < 0) {
+				misses++;
+				return -1;
+			}
+			if (slots[slot].object >= 0)
+				object_slot[slots[slot].object] = -1;
+			object_slot[object] = slot;
+		}
+		slots[slot] = Slot{ (GLint)object, params, time, frame };
+		pending.push_back(slot);
+		captures++;
+		return slot;
+	}
+
+	// runs the captures fetch() queued, before anything draws from them; the program has to be displace_capture.vsh
+	void flush(GLStateCache& gl, GLuint program, GLint loc_displace, GLint loc_time, float time) {
+		if (pending.empty())
+			return;
+		gl.use_program(program);
+		gl.uniform1i(loc_displace, 1);
+		gl.uniform1f(loc_time, time);
+		gl.bind_vertex_array(mesh_vao);
+		glEnable(GL_RASTERIZER_DISCARD);
+		size_t slot_bytes = sizeof(Vertex) * vertex_count;
+		for (int slot : pending) {
+			gl.vertex_attrib4fv(DISPLACE_ATTRIB, slots[slot].params);
+			glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0, buffer, slot_bytes * slot, slot_bytes);
+			glBeginTransformFeedback(GL_POINTS);
+			glDrawArrays(GL_POINTS, 0, vertex_count);
+			glEndTransformFeedback();
+			gl.current.draws++;
+		}
+		glDisable(GL_RASTERIZER_DISCARD);
+		glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+		pending.clear();
+	}
+};
+
+// builds icospheres off the render thread, on a hidden window whose context shares objects with the main one
+// the worker generates the mesh, uploads it and puts a fence behind the upload; the render thread picks the
+// buffers up only once that fence has signaled (and makes the vao itself), so it never waits on either
+struct AssetWorker {
+	struct Request {
+		int level;
+		SphereBase base;
+	};
+	struct Report {
+		double build_ms; // generate + upload on the worker
+		float area_ratio;
+		std::vector<SubdivisionStage> stages;
+	};
+	struct Result {
+		SphereMesh mesh;
+		GLsync fence;
+		Report report;
+	};
+
+	GLFWwindow* context;
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<Request> requests;
+	std::deque<Result> finished;
+	bool quit;
+	int pending; // requested, not picked up yet
+	SubdivisionArena arena; // worker thread only
+
+	AssetWorker() : context(NULL), quit(false), pending(0) {}
+
+	// main thread only, glfw windows can't be made anywhere else
+	bool start(GLFWwindow* main_window) {
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		context = glfwCreateWindow(1, 1, "assets", NULL, main_window);
+		glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+		if (context == NULL)
+			return false;
+		worker = std::thread(&AssetWorker::run, this);
+		return true;
+	}
+
+	void stop() {
+		if (context == NULL)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		worker.join();
+		for (Result& r : finished) {
+			glDeleteSync(r.fence);
+			glDeleteBuffers(1, &r.mesh.vbo);
+			glDeleteBuffers(1, &r.mesh.ebo);
+		}
+		glfwDestroyWindow(context);
+		context = NULL;
+	}
+
+	void request(int level, SphereBase base) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			requests.push_back({ level, base });
+		}
+		pending++;
+		wake.notify_one();
+	}
+
+	// a mesh whose upload the gpu has finished, without blocking; false if there's none yet
+	bool poll(SphereMesh& mesh, Report& report) {
+		Result r;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (finished.empty())
+				return false;
+			GLenum status = glClientWaitSync(finished.front().fence, 0, 0);
+			if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+				return false;
+			r = std::move(finished.front());
+			finished.pop_front();
+		}
+		glDeleteSync(r.fence);
+		pending--;
+		mesh = r.mesh;
+		mesh.vao = make_sphere_vao(mesh.vbo, mesh.ebo);
+		report = std::move(r.report);
+		return true;
+	}
+
+	// worker thread
+	void run() {
+		glfwMakeContextCurrent(context);
+		for (;;) {
+			Request request;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this] { return quit || !requests.empty(); });
+				if (quit)
+					break;
+				request = requests.front();
+				requests.pop_front();
+			}
+			double start = glfwGetTime();
+			IcosphereMesh sphere = generate_sphere_mesh(request.base, request.level, arena);
+
+			Result r;
+			r.mesh.vao = 0;
+			r.mesh.level = request.level;
+			r.mesh.base = request.base;
+			r.report.area_ratio = sphere.area_ratio();
+			r.mesh.index_count = (GLsizei)sphere.elements.size();
+			r.mesh.vertex_count = (GLsizei)sphere.vertices.size();
+			// no vao on this context, so no element array binding either: both go through the copy target
+			glGenBuffers(1, &r.mesh.vbo);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, r.mesh.vbo);
+			glBufferData(GL_COPY_WRITE_BUFFER, sizeof(Vertex) * sphere.vertices.size(), sphere.vertices.data(), GL_STATIC_DRAW);
+			glGenBuffers(1, &r.mesh.ebo);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, r.mesh.ebo);
+			glBufferData(GL_COPY_WRITE_BUFFER, sizeof(GLuint) * sphere.elements.size(), sphere.elements.data(), GL_STATIC_DRAW);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+			sphere.release();
+			r.report.stages = std::move(sphere.stages);
+			r.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			// the fence has to reach the gpu before another context can see it signal
+			glFlush();
+			r.report.build_ms = (glfwGetTime() - start) * 1000.0;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			finished.push_back(std::move(r));
+		}
+		glfwMakeContextCurrent(NULL);
+	}
+};
+
+// a few worker threads plus the calling one; parallel_for splits [begin, end) into chunks of at least grain
+// whoever waits on a parallel_for runs queued chunks meanwhile, so nested calls from inside a chunk can't deadlock
+struct ThreadPool {
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool quit;
+
+	ThreadPool() : quit(false) {}
+	~ThreadPool() { stop(); }
+
+	void start(unsigned threads) {
+		for (unsigned i = 0; i < threads; i++)
+			workers.push_back(std::thread(&ThreadPool::run, this));
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (std::thread& t : workers)
+			t.join();
+		workers.clear();
+		quit = false;
+	}
+
+	// counting the caller
+	size_t size() const { return workers.size() + 1; }
+
+	void submit(std::function<void()> task) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(std::move(task));
+		}
+		wake.notify_one();
+	}
+
+	bool run_one() {
+		std::function<void()> task;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (tasks.empty())
+				return false;
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+		return true;
+	}
+
+	template <typename F>
+	void parallel_for(size_t begin, size_t end, size_t grain, const F& f) {
+		if (end <= begin)
+			return;
+		size_t chunks = std::min((end - begin + grain - 1) / std::max(grain, (size_t)1), size() * 4);
+		if (chunks <= 1 || workers.empty()) {
+			f(begin, end);
+			return;
+		}
+		size_t step = (end - begin + chunks - 1) / chunks;
+		std::atomic<size_t> remaining(chunks);
+		for (size_t c = 1; c < chunks; c++) {
+			size_t b = std::min(begin + c * step, end), e = std::min(b + step, end);
+			submit([&f, &remaining, b, e] { f(b, e); remaining--; });
+		}
+		f(begin, std::min(begin + step, end));
+		remaining--;
+		while (remaining > 0)
+			if (!run_one())
+				std::this_thread::yield();
+	}
+
+	// worker thread
+	void run() {
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this] { return quit || !tasks.empty(); });
+				if (quit)
+					return;
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+};
+
+ThreadPool thread_pool;
+
+// records a frame's draws on the pool while the gl thread gets on with something else: begin() splits
+// [0, count) into chunks and queues them, wait() helps with them until they're all done. each chunk
+// writes only its own slice of what the caller reserved (RenderQueue::reserve()), so recording is
+// bumping an index and the workers never share anything; the gl thread replays the lot in order.
+// unthreaded, begin() records everything right away
+struct CommandRecorder {
+	typedef std::chrono::high_resolution_clock Clock;
+	std::function<void(size_t, size_t)> record;
+	std::atomic<size_t> remaining;
+	std::atomic<long long> record_ns; // summed over the chunks
+	Clock::time_point started;
+	size_t chunks;
+	// last frame: cpu time spent recording, begin() to the end of wait(), and how much of that the gl thread waited
+	double record_ms, wall_ms, wait_ms;
+
+	CommandRecorder() : remaining(0), record_ns(0), chunks(0), record_ms(0), wall_ms(0), wait_ms(0) {}
+
+	void begin(ThreadPool& pool, size_t count, size_t grain, bool threaded, std::function<void(size_t, size_t)> f) {
+		record = std::move(f);
+		record_ns = 0;
+		started = Clock::now();
+		chunks = threaded && count > 0 ? std::min((count + grain - 1) / grain, pool.size() * 4) : 1;
+		if (chunks <= 1) {
+			record(0, count);
+			record_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - started).count();
+			remaining = 0;
+			return;
+		}
+		size_t step = (count + chunks - 1) / chunks;
+		remaining = chunks;
+		for (size_t c = 0; c < chunks; c++) {
+			size_t b = std::min(c * step, count), e = std::min(b + step, count);
+			pool.submit([this, b, e] {
+				Clock::time_point start = Clock::now();
+				record(b, e);
+				record_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+				remaining--;
+			});
+		}
+	}
+
+	void wait(ThreadPool& pool) {
+		Clock::time_point waiting = Clock::now();
+		while (remaining > 0)
+			if (!pool.run_one())
+				std::this_thread::yield();
+		Clock::time_point done = Clock::now();
+		record_ms = record_ns / 1e6;
+		wall_ms = std::chrono::duration<double, std::milli>(done - started).count();
+		wait_ms = std::chrono::duration<double, std::milli>(done - waiting).count();
+	}
+};
+
+// result of BVH::pick(), object is -1 when the ray hit nothing
+struct PickHit {
+	GLint object;
+	float t;
+	glm::vec3 point;
+};
+
+// 4-wide bounding volume hierarchy over the object spheres (xyz = center, w = radius)
+// nodes sit in one flat array, root first, every child after its parent. each node keeps the boxes of its
+// four children side by side per axis so one sse compare tests all of them. a child slot is an inner node
+// (count == 0, child = node index), a leaf (count > 0, child = first entry in prims) or empty (child < 0)
+// built top down with binned sah, refit bottom up when spheres move, and rebuilt from scratch now and then
+// since refitting keeps the topology and the boxes only get looser
+struct BVH {
+	static const GLuint MAX_LEAF = 4;
+	static const int BINS = 16;
+	static const GLuint PARALLEL_BUILD = 16384; // ranges at least this big are binned and recursed on the pool
+
+	struct Node {
+		float min_x[4], min_y[4], min_z[4];
+		float max_x[4], max_y[4], max_z[4];
+		GLint child[4];
+		GLuint count[4];
+		Node() {} // left uninitialized on purpose, build() sizes the array for the worst case
+	};
+
+	// what the build shuffles around: a copy of the sphere next to its index, so partitioning stays sequential
+	struct PrimRef {
+		glm::vec4 sphere;
+		GLuint index;
+	};
+
+	struct Range {
+		GLuint begin, end;
+		glm::vec3 bmin, bmax; // of the spheres
+		glm::vec3 cmin, cmax; // of their centers, what gets binned
+	};
+
+	std::vector<Node> nodes;
+	std::vector<GLuint> prims; // object indices, in leaf order
+	std::vector<GLint> parent; // per node, -1 for the root
+	std::vector<GLuint> leaf_node; // per object, the node whose slot holds its leaf
+	std::vector<std::vector<GLuint>> levels; // node indices by depth, refit goes through them deepest first
+	std::atomic<GLuint> node_count;
+	std::vector<GLubyte> dirty; // per node, scratch for refit(moved)
+
+	BVH() : node_count(0) {}
+	BVH(const BVH&) = delete;
+
+	void swap(BVH& other) {
+		nodes.swap(other.nodes);
+		prims.swap(other.prims);
+		parent.swap(other.parent);
+		leaf_node.swap(other.leaf_node);
+		levels.swap(other.levels);
+		dirty.swap(other.dirty);
+		GLuint n = node_count;
+		node_count = (GLuint)other.node_count;
+		other.node_count = n;
+	}
+
+	static void grow(glm::vec3& bmin, glm::vec3& bmax, const glm::vec4& s) {
+		bmin = glm::min(bmin, glm::vec3(s) - s.w);
+		bmax = glm::max(bmax, glm::vec3(s) + s.w);
+	}
+
+	static float half_area(const glm::vec3& bmin, const glm::vec3& bmax) {
+		glm::vec3 e = glm::max(bmax - bmin, glm::vec3(0));
+		return e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+
+	static void set_slot(Node& n, int i, const glm::vec3& bmin, const glm::vec3& bmax) {
+		n.min_x[i] = bmin.x; n.min_y[i] = bmin.y; n.min_z[i] = bmin.z;
+		n.max_x[i] = bmax.x; n.max_y[i] = bmax.y; n.max_z[i] = bmax.z;
+	}
+
+	static void clear_slot(Node& n, int i) {
+		set_slot(n, i, glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX));
+		n.child[i] = -1;
+		n.count[i] = 0;
+	}
+
+	// union of a node's slots
+	void node_bounds(GLuint index, glm::vec3& bmin, glm::vec3& bmax) const {
+		const Node& n = nodes[index];
+		bmin = glm::vec3(FLT_MAX);
+		bmax = glm::vec3(-FLT_MAX);
+		for (int i = 0; i < 4; i++) {
+			bmin = glm::min(bmin, glm::vec3(n.min_x[i], n.min_y[i], n.min_z[i]));
+			bmax = glm::max(bmax, glm::vec3(n.max_x[i], n.max_y[i], n.max_z[i]));
+		}
+	}
+
+	void build(const std::vector<glm::vec4>& spheres, ThreadPool* pool) {
+		GLuint count = (GLuint)spheres.size();
+		prims.resize(count);
+		leaf_node.resize(count);
+		// an inner node has at least two children, so there are fewer of them than objects
+		nodes.resize(std::max(count, 1u));
+		parent.resize(nodes.size());
+		node_count = 1;
+		parent[0] = -1;
+
+		std::vector<PrimRef> refs(count);
+		Range root;
+		root.begin = 0;
+		root.end = count;
+		root.bmin = root.cmin = glm::vec3(FLT_MAX);
+		root.bmax = root.cmax = glm::vec3(-FLT_MAX);
+		for (GLuint i = 0; i < count; i++) {
+			refs[i].sphere = spheres[i];
+			refs[i].index = i;
+			grow(root.bmin, root.bmax, spheres[i]);
+			root.cmin = glm::min(root.cmin, glm::vec3(spheres[i]));
+			root.cmax = glm::max(root.cmax, glm::vec3(spheres[i]));
+		}
+		build_node(refs, 0, root, pool);
+		for (GLuint i = 0; i < count; i++)
+			prims[i] = refs[i].index;
+
+		nodes.resize(node_count);
+		parent.resize(node_count);
+		dirty.assign(node_count, 0);
+		levels.clear();
+		std::vector<GLuint> depth(node_count, 0);
+		for (GLuint i = 0; i < node_count; i++) {
+			if (parent[i] >= 0)
+				depth[i] = depth[parent[i]] + 1;
+			if (depth[i] >= levels.size())
+				levels.resize(depth[i] + 1);
+			levels[depth[i]].push_back(i);
+		}
+	}
+
+	// splits r in two with binned sah over the centers, false if it's small enough to be a leaf
+	// (r by value, it's usually one of the outputs)
+	bool split(std::vector<PrimRef>& refs, Range r, Range& left, Range& right, ThreadPool* pool) {
+		GLuint count = r.end - r.begin;
+		if (count <= MAX_LEAF)
+			return false;
+		glm::vec3 extent = r.cmax - r.cmin;
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		float lo = r.cmin[axis], scale = extent[axis] > 0.f ? BINS * 0.9999f / extent[axis] : 0.f;
+
+		struct Bin {
+			GLuint count;
+			glm::vec3 bmin, bmax, cmin, cmax;
+			void reset() { count = 0; bmin = cmin = glm::vec3(FLT_MAX); bmax = cmax = glm::vec3(-FLT_MAX); }
+			void merge(const Bin& o) {
+				count += o.count;
+				bmin = glm::min(bmin, o.bmin); bmax = glm::max(bmax, o.bmax);
+				cmin = glm::min(cmin, o.cmin); cmax = glm::max(cmax, o.cmax);
+			}
+		};
+		Bin bins[BINS];
+		for (Bin& b : bins)
+			b.reset();
+		if (scale > 0.f) {
+			auto bin_range = [&](size_t b, size_t e, Bin* out) {
+				for (size_t i = b; i < e; i++) {
+					const glm::vec4& s = refs[i].sphere;
+					Bin& bin = out[(int)((s[axis] - lo) * scale)];
+					bin.count++;
+					grow(bin.bmin, bin.bmax, s);
+					bin.cmin = glm::min(bin.cmin, glm::vec3(s));
+					bin.cmax = glm::max(bin.cmax, glm::vec3(s));
+				}
+			};
+			if (pool && count >= PARALLEL_BUILD) {
+				std::mutex merge;
+				pool->parallel_for(r.begin, r.end, PARALLEL_BUILD / 4, [&](size_t b, size_t e) {
+					Bin local[BINS];
+					for (Bin& l : local)
+						l.reset();
+					bin_range(b, e, local);
+					std::lock_guard<std::mutex> lock(merge);
+					for (int i = 0; i < BINS; i++)
+						bins[i].merge(local[i]);
+				});
+			}
+			else
+				bin_range(r.begin, r.end, bins);
+
+			// cost of each split plane: area * count on both sides, swept from the right then from the left
+			float right_cost[BINS];
+			Bin acc;
+			acc.reset();
+			for (int i = BINS - 1; i > 0; i--) {
+				acc.merge(bins[i]);
+				right_cost[i] = half_area(acc.bmin, acc.bmax) * acc.count;
+			}
+			acc.reset();
+			int best = -1;
+			float best_cost = FLT_MAX;
+			for (int i = 0; i < BINS - 1; i++) {
+				acc.merge(bins[i]);
+				float cost = half_area(acc.bmin, acc.bmax) * acc.count + right_cost[i + 1];
+				if (acc.count > 0 && acc.count < count && cost < best_cost) {
+					best_cost = cost;
+					best = i;
+				}
+			}
+			if (best >= 0) {
+				Bin l, rr;
+				l.reset();
+				rr.reset();
+				for (int i = 0; i < BINS; i++)
+					(i <= best ? l : rr).merge(bins[i]);
+				std::partition(refs.begin() + r.begin, refs.begin() + r.end, [&](const PrimRef& p) {
+					return (int)((p.sphere[axis] - lo) * scale) <= best;
+				});
+				left.begin = r.begin;
+				left.end = r.begin + l.count;
+				left.bmin = l.bmin; left.bmax = l.bmax; left.cmin = l.cmin; left.cmax = l.cmax;
+				right.begin = left.end;
+				right.end = r.end;
+				right.bmin = rr.bmin; right.bmax = rr.bmax; right.cmin = rr.cmin; right.cmax = rr.cmax;
+				return true;
+			}
+		}
+
+		// every center in one spot (or in one bin): halve by index
+		left.begin = r.begin;
+		left.end = right.begin = r.begin + count / 2;
+		right.end = r.end;
+		for (Range* side : { &left, &right }) {
+			side->bmin = side->cmin = glm::vec3(FLT_MAX);
+			side->bmax = side->cmax = glm::vec3(-FLT_MAX);
+			for (GLuint i = side->begin; i < side->end; i++) {
+				const glm::vec4& s = refs[i].sphere;
+				grow(side->bmin, side->bmax, s);
+				side->cmin = glm::min(side->cmin, glm::vec3(s));
+				side->cmax = glm::max(side->cmax, glm::vec3(s));
+			}
+		}
+		return true;
+	}
+
+	void build_node(std::vector<PrimRef>& refs, GLuint index, const Range& r, ThreadPool* pool) {
+		// split the biggest splittable child until there are four
+		Range children[4];
+		int num_children = 1;
+		children[0] = r;
+		while (num_children < 4) {
+			int pick = -1;
+			float pick_area = -1.f;
+			for (int i = 0; i < num_children; i++) {
+				float area = half_area(children[i].bmin, children[i].bmax);
+				if (children[i].end - children[i].begin > MAX_LEAF && area > pick_area) {
+					pick = i;
+					pick_area = area;
+				}
+			}
+			if (pick < 0 || !split(refs, children[pick], children[pick], children[num_children], pool))
+				break;
+			num_children++;
+		}
+
+		Node& n = nodes[index];
+		int inner[4], num_inner = 0;
+		for (int i = 0; i < 4; i++) {
+			if (i >= num_children || children[i].end == children[i].begin) {
+				clear_slot(n, i);
+				continue;
+			}
+			const Range& c = children[i];
+			set_slot(n, i, c.bmin, c.bmax);
+			if (c.end - c.begin <= MAX_LEAF) {
+				n.child[i] = c.begin;
+				n.count[i] = c.end - c.begin;
+				for (GLuint p = c.begin; p < c.end; p++)
+					leaf_node[refs[p].index] = index;
+			}
+			else {
+				GLuint child = node_count++;
+				parent[child] = index;
+				n.child[i] = child;
+				n.count[i] = 0;
+				inner[num_inner++] = i;
+			}
+		}
+
+		if (pool && r.end - r.begin >= PARALLEL_BUILD) {
+			pool->parallel_for(0, num_inner, 1, [&](size_t b, size_t e) {
+				for (size_t i = b; i < e; i++)
+					build_node(refs, nodes[index].child[inner[i]], children[inner[i]], pool);
+			});
+		}
+		else {
+			for (int i = 0; i < num_inner; i++)
+				build_node(refs, nodes[index].child[inner[i]], children[inner[i]], pool);
+		}
+	}
+
+	// recomputes a node's slots from its children, which have to be up to date already
+	void refit_node(const glm::vec4* spheres, GLuint index) {
+		Node& n = nodes[index];
+		for (int i = 0; i < 4; i++) {
+			if (n.child[i] < 0)
+				continue;
+			glm::vec3 bmin(FLT_MAX), bmax(-FLT_MAX);
+			if (n.count[i] > 0) {
+				for (GLuint p = n.child[i]; p < n.child[i] + n.count[i]; p++)
+					grow(bmin, bmax, spheres[prims[p]]);
+			}
+			else
+				node_bounds(n.child[i], bmin, bmax);
+			set_slot(n, i, bmin, bmax);
+		}
+	}
+
+	// every node, one depth at a time from the bottom
+	void refit(const glm::vec4* spheres, ThreadPool* pool) {
+		for (size_t d = levels.size(); d-- > 0;) {
+			const std::vector<GLuint>& level = levels[d];
+			auto refit_range = [&](size_t b, size_t e) {
+				for (size_t i = b; i < e; i++)
+					refit_node(spheres, level[i]);
+			};
+			if (pool)
+				pool->parallel_for(0, level.size(), 1024, refit_range);
+			else
+				refit_range(0, level.size());
+		}
+	}
+
+	// only the leaves of the moved objects and the paths above them; falls back to refit() when that's most of the tree
+	void refit(const glm::vec4* spheres, const std::vector<GLuint>& moved, ThreadPool* pool) {
+		if (moved.size() * 8 > prims.size()) {
+			refit(spheres, pool);
+			return;
+		}
+		std::vector<GLuint> touched;
+		for (GLuint object : moved) {
+			for (GLint n = leaf_node[object]; n >= 0 && !dirty[n]; n = parent[n]) {
+				dirty[n] = 1;
+				touched.push_back(n);
+			}
+		}
+		// children come after their parents in the array
+		std::sort(touched.begin(), touched.end(), std::greater<GLuint>());
+		for (GLuint n : touched) {
+			refit_node(spheres, n);
+			dirty[n] = 0;
+		}
+	}
+
+	// expected cost of a random ray against the tree, relative to its root box (traversal 1, sphere test 1)
+	float sah_cost() const {
+		if (nodes.empty())
+			return 0.f;
+		glm::vec3 bmin, bmax;
+		node_bounds(0, bmin, bmax);
+		float root_area = std::max(half_area(bmin, bmax), FLT_MIN);
+		double cost = 0.0;
+		for (GLuint index = 0; index < node_count; index++) {
+			const Node& n = nodes[index];
+			for (int i = 0; i < 4; i++) {
+				if (n.child[i] < 0)
+					continue;
+				float area = half_area(glm::vec3(n.min_x[i], n.min_y[i], n.min_z[i]), glm::vec3(n.max_x[i], n.max_y[i], n.max_z[i]));
+				cost += area / root_area * (n.count[i] > 0 ? n.count[i] : 1);
+			}
+		}
+		return (float)cost + 1.f;
+	}
+
+	// objects whose spheres touch all of the planes' inner half spaces (extract_frustum())
+	void frustum_query(const glm::vec4* spheres, const glm::vec4 planes[6], std::vector<GLuint>& out) const {
+		if (nodes.empty())
+			return;
+		std::vector<GLuint> stack(3 * levels.size() + 1);
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0) {
+			const Node& n = nodes[stack[--top]];
+			int inside = 0xf;
+#ifdef BVH_SSE
+			// for each plane only the box corner furthest along its normal matters
+			for (int p = 0; p < 6 && inside; p++) {
+				const glm::vec4& pl = planes[p];
+				__m128 x = _mm_loadu_ps(pl.x > 0.f ? n.max_x : n.min_x);
+				__m128 y = _mm_loadu_ps(pl.y > 0.f ? n.max_y : n.min_y);
+				__m128 z = _mm_loadu_ps(pl.z > 0.f ? n.max_z : n.min_z);
+				__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(pl.x)), _mm_mul_ps(y, _mm_set1_ps(pl.y))),
+					_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(pl.z)), _mm_set1_ps(pl.w)));
+				inside &= _mm_movemask_ps(_mm_cmpge_ps(d, _mm_setzero_ps()));
+			}
+#else
+			for (int i = 0; i < 4; i++) {
+				for (int p = 0; p < 6; p++) {
+					const glm::vec4& pl = planes[p];
+					float d = pl.x * (pl.x > 0.f ? n.max_x[i] : n.min_x[i]) + pl.y * (pl.y > 0.f ? n.max_y[i] : n.min_y[i])
+						+ pl.z * (pl.z > 0.f ? n.max_z[i] : n.min_z[i]) + pl.w;
+					if (d < 0.f) {
+						inside &= ~(1 << i);
+						break;
+					}
+				}
+			}
+#endif
+			for (int i = 0; i < 4; i++) {
+				if (!(inside & (1 << i)) || n.child[i] < 0)
+					continue;
+				if (n.count[i] == 0) {
+					stack[top++] = n.child[i];
+					continue;
+				}
+				for (GLuint e = n.child[i]; e < n.child[i] + n.count[i]; e++) {
+					const glm::vec4& s = spheres[prims[e]];
+					bool visible = true;
+					for (int p = 0; p < 6 && visible; p++)
+						visible = glm::dot(glm::vec3(planes[p]), glm::vec3(s)) + planes[p].w >= -s.w;
+					if (visible)
+						out.push_back(prims[e]);
+				}
+			}
+		}
+	}
+
+	// nearest sphere along origin + t * dir (dir normalized), t in [0, max_t)
+	// from inside a sphere the hit is where the ray leaves it
+	PickHit pick(const glm::vec4* spheres, const glm::vec3& origin, const glm::vec3& dir, float max_t = FLT_MAX) const {
+		PickHit hit;
+		hit.object = -1;
+		hit.t = max_t;
+		if (nodes.empty())
+			return hit;
+		glm::vec3 inv = glm::vec3(1.f) / dir;
+		struct Entry { GLuint node; float t; };
+		std::vector<Entry> stack(3 * levels.size() + 1);
+		int top = 0;
+		stack[top++] = { 0, 0.f };
+#ifdef BVH_SSE
+		__m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+		__m128 ix = _mm_set1_ps(inv.x), iy = _mm_set1_ps(inv.y), iz = _mm_set1_ps(inv.z);
+#endif
+		while (top > 0) {
+			Entry e = stack[--top];
+			if (e.t >= hit.t)
+				continue;
+			const Node& n = nodes[e.node];
+			float t_near[4];
+			int mask = 0;
+#ifdef BVH_SSE
+			// slabs of all four boxes at once
+			__m128 x0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.min_x), ox), ix), x1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.max_x), ox), ix);
+			__m128 y0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.min_y), oy), iy), y1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.max_y), oy), iy);
+			__m128 z0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.min_z), oz), iz), z1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.max_z), oz), iz);
+			__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)), _mm_max_ps(_mm_min_ps(z0, z1), _mm_setzero_ps()));
+			__m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)), _mm_min_ps(_mm_max_ps(z0, z1), _mm_set1_ps(hit.t)));
+			mask = _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+			_mm_storeu_ps(t_near, tmin);
+#else
+			for (int i = 0; i < 4; i++) {
+				glm::vec3 t0 = (glm::vec3(n.min_x[i], n.min_y[i], n.min_z[i]) - origin) * inv;
+				glm::vec3 t1 = (glm::vec3(n.max_x[i], n.max_y[i], n.max_z[i]) - origin) * inv;
+				glm::vec3 lo = glm::min(t0, t1), hi = glm::max(t0, t1);
+				t_near[i] = std::max(std::max(lo.x, lo.y), std::max(lo.z, 0.f));
+				if (t_near[i] <= std::min(std::min(hi.x, hi.y), std::min(hi.z, hit.t)))
+					mask |= 1 << i;
+			}
+#endif
+			// leaves right away, inner nodes go on the stack far to near so the nearest comes off first
+			int order[4], num_inner = 0;
+			for (int i = 0; i < 4; i++) {
+				if (!(mask & (1 << i)) || n.child[i] < 0)
+					continue;
+				if (n.count[i] == 0) {
+					order[num_inner++] = i;
+					continue;
+				}
+				for (GLuint p = n.child[i]; p < n.child[i] + n.count[i]; p++) {
+					float t;
+					if (ray_sphere(spheres[prims[p]], origin, dir, t) && t < hit.t) {
+						hit.t = t;
+						hit.object = prims[p];
+					}
+				}
+			}
+			for (int i = 1; i < num_inner; i++)
+				for (int j = i; j > 0 && t_near[order[j]] > t_near[order[j - 1]]; j--)
+					std::swap(order[j], order[j - 1]);
+			for (int i = 0; i < num_inner; i++)
+				if (t_near[order[i]] < hit.t)
+					stack[top++] = { (GLuint)n.child[order[i]], t_near[order[i]] };
+		}
+		if (hit.object >= 0)
+			hit.point = origin + dir * hit.t;
+		return hit;
+	}
+
+	static bool ray_sphere(const glm::vec4& s, const glm::vec3& origin, const glm::vec3& dir, float& t) {
+		glm::vec3 oc = origin - glm::vec3(s);
+		float b = glm::dot(oc, dir);
+		float c = glm::dot(oc, oc) - s.w * s.w;
+		float disc = b * b - c;
+		if (disc < 0.f)
+			return false;
+		float root = std::sqrt(disc);
+		t = -b - root;
+		if (t < 0.f)
+			t = -b + root;
+		return t >= 0.f;
+	}
+
+	// many rays at once, four to a packet: every node is fetched once per packet and its boxes tested against
+	// all four rays, which pays off when the rays are coherent (a selection rectangle, not random directions)
+	void pick(const glm::vec4* spheres, const glm::vec3* origins, const glm::vec3* dirs, size_t count, PickHit* hits, float max_t = FLT_MAX) const {
+#ifdef BVH_SSE
+		std::vector<GLuint> stack(3 * levels.size() + 1);
+		for (size_t first = 0; first < count; first += 4) {
+			size_t lanes = std::min(count - first, (size_t)4);
+			// rays across the lanes; short packets repeat their last ray
+			float o[3][4], inv[3][4], d[3][4];
+			for (int l = 0; l < 4; l++) {
+				size_t r = first + std::min((size_t)l, lanes - 1);
+				for (int a = 0; a < 3; a++) {
+					o[a][l] = origins[r][a];
+					d[a][l] = dirs[r][a];
+					inv[a][l] = 1.f / dirs[r][a];
+				}
+			}
+			__m128 ox = _mm_loadu_ps(o[0]), oy = _mm_loadu_ps(o[1]), oz = _mm_loadu_ps(o[2]);
+			__m128 dx = _mm_loadu_ps(d[0]), dy = _mm_loadu_ps(d[1]), dz = _mm_loadu_ps(d[2]);
+			__m128 ix = _mm_loadu_ps(inv[0]), iy = _mm_loadu_ps(inv[1]), iz = _mm_loadu_ps(inv[2]);
+			__m128 best = _mm_set1_ps(max_t);
+			__m128 zero = _mm_setzero_ps();
+			GLint object[4] = { -1, -1, -1, -1 };
+
+			int top = 0;
+			if (!nodes.empty())
+				stack[top++] = 0;
+			while (top > 0) {
+				const Node& n = nodes[stack[--top]];
+				for (int i = 0; i < 4; i++) {
+					if (n.child[i] < 0)
+						continue;
+					// this child's box against the four rays
+					__m128 x0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.min_x[i]), ox), ix), x1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.max_x[i]), ox), ix);
+					__m128 y0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.min_y[i]), oy), iy), y1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.max_y[i]), oy), iy);
+					__m128 z0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.min_z[i]), oz), iz), z1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.max_z[i]), oz), iz);
+					__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)), _mm_max_ps(_mm_min_ps(z0, z1), zero));
+					__m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)), _mm_min_ps(_mm_max_ps(z0, z1), best));
+					if (!_mm_movemask_ps(_mm_cmple_ps(tmin, tmax)))
+						continue;
+					if (n.count[i] == 0) {
+						stack[top++] = n.child[i];
+						continue;
+					}
+					// spheres against the four rays, same math as ray_sphere()
+					for (GLuint p = n.child[i]; p < n.child[i] + n.count[i]; p++) {
+						const glm::vec4& s = spheres[prims[p]];
+						__m128 cx = _mm_sub_ps(ox, _mm_set1_ps(s.x)), cy = _mm_sub_ps(oy, _mm_set1_ps(s.y)), cz = _mm_sub_ps(oz, _mm_set1_ps(s.z));
+						__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, dx), _mm_mul_ps(cy, dy)), _mm_mul_ps(cz, dz));
+						__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, cx), _mm_mul_ps(cy, cy)), _mm_mul_ps(cz, cz)), _mm_set1_ps(s.w * s.w));
+						__m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), c);
+						__m128 root = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+						__m128 t_in = _mm_sub_ps(_mm_sub_ps(zero, b), root), t_out = _mm_add_ps(_mm_sub_ps(zero, b), root);
+						__m128 in_front = _mm_cmpge_ps(t_in, zero);
+						__m128 t = _mm_or_ps(_mm_and_ps(in_front, t_in), _mm_andnot_ps(in_front, t_out));
+						__m128 closer = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(disc, zero), _mm_cmpge_ps(t, zero)), _mm_cmplt_ps(t, best));
+						int m = _mm_movemask_ps(closer);
+						if (!m)
+							continue;
+						best = _mm_or_ps(_mm_and_ps(closer, t), _mm_andnot_ps(closer, best));
+						for (int l = 0; l < 4; l++)
+							if (m & (1 << l))
+								object[l] = prims[p];
+					}
+				}
+			}
+
+			float t[4];
+			_mm_storeu_ps(t, best);
+			for (size_t l = 0; l < lanes; l++) {
+				PickHit& hit = hits[first + l];
+				hit.object = object[l];
+				hit.t = t[l];
+				if (hit.object >= 0)
+					hit.point = origins[first + l] + dirs[first + l] * hit.t;
+			}
+		}
+#else
+		for (size_t r = 0; r < count; r++)
+			hits[r] = pick(spheres, origins[r], dirs[r], max_t);
+#endif
+	}
+};
+
+// rebuilds a snapshot of the spheres on its own thread (not the pool, frame work shouldn't wait behind it),
+// the main thread swaps the result in and refits it to wherever the spheres went meanwhile
+struct BVHRebuilder {
+	std::thread worker;
+	std::atomic<bool> done;
+	bool running;
+	std::vector<glm::vec4> snapshot;
+	BVH next;
+	double build_ms;
+
+	BVHRebuilder() : done(false), running(false), build_ms(0.0) {}
+
+	void start(const std::vector<glm::vec4>& spheres) {
+		if (running)
+			return;
+		snapshot = spheres;
+		running = true;
+		worker = std::thread([this] {
+			auto start = std::chrono::high_resolution_clock::now();
+			next.build(snapshot, NULL);
+			build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+			done = true;
+		});
+	}
+
+	bool poll(BVH& bvh, const std::vector<glm::vec4>& spheres) {
+		if (!running || !done)
+			return false;
+		worker.join();
+		running = false;
+		done = false;
+		bvh.swap(next);
+		bvh.refit(spheres.data(), &thread_pool);
+		return true;
+	}
+
+	void stop() {
+		if (running)
+			worker.join();
+		running = false;
+		done = false;
+	}
+};
+
+// half the edge of the smallest cube around the origin that holds every sphere, the box the simulations keep them in
+float bounding_cube(const std::vector<glm::vec4>& spheres) {
+	float bound = 0.f;
+	for (const glm::vec4& s : spheres)
+		bound = std::max(bound, std::max(std::max(std::abs(s.x), std::abs(s.y)), std::abs(s.z)) + s.w);
+	return bound;
+}
+
+// rigid spheres falling inside a box, radius = scale and mass ~ radius^3
+// every substep integrates, counting-sorts the spheres into a spatial hash (cells twice the largest
+// radius, so contacts are always within the 27 cells around a sphere), then resolves contacts Jacobi
+// style: each sphere only writes its own position and velocity, the threads never share a sphere.
+// the arrays stay in cell order between steps, id[] says which object a slot is
+struct SpherePhysics {
+	std::vector<float> px, py, pz, vx, vy, vz, radius, inv_mass;
+	std::vector<float> next_px, next_py, next_pz, next_vx, next_vy, next_vz, next_radius, next_inv_mass;
+	std::vector<GLuint> id, next_id, cell, order;
+	std::vector<GLuint> cell_start; // table_size + 1 offsets into the sorted arrays
+	std::unique_ptr<std::atomic<GLuint>[]> cell_count;
+	GLuint table_mask;
+	float cell_size, bound, restitution, accumulator;
+	glm::vec3 gravity;
+	// last frame's work
+	int substeps;
+	size_t contacts;
+	double integrate_ms, hash_ms, narrow_ms;
+
+	SpherePhysics() : table_mask(0), cell_size(1.f), bound(50.f), restitution(PHYSICS_RESTITUTION), accumulator(0.f),
+		gravity(0.f, -9.81f, 0.f), substeps(0), contacts(0), integrate_ms(0), hash_ms(0), narrow_ms(0) {}
+
+	size_t size() const { return id.size(); }
+
+	// takes over the spheres as they are, at rest, in their bounding_cube()
+	void reset(const std::vector<glm::vec4>& spheres) {
+		size_t n = spheres.size();
+		for (std::vector<float>* v : { &px, &py, &pz, &vx, &vy, &vz, &radius, &inv_mass,
+				&next_px, &next_py, &next_pz, &next_vx, &next_vy, &next_vz, &next_radius, &next_inv_mass })
+			v->assign(n + 3, 0.f); // the narrowphase reads up to 3 past a run
+		id.resize(n);
+		next_id.resize(n);
+		cell.resize(n);
+		order.resize(n);
+		float max_radius = 0.f;
+		bound = bounding_cube(spheres);
+		for (size_t i = 0; i < n; i++) {
+			const glm::vec4& s = spheres[i];
+			px[i] = s.x;
+			py[i] = s.y;
+			pz[i] = s.z;
+			radius[i] = s.w;
+			inv_mass[i] = 1.f / std::max(s.w * s.w * s.w, 1e-6f);
+			id[i] = (GLuint)i;
+			max_radius = std::max(max_radius, s.w);
+		}
+		cell_size = std::max(2.f * max_radius, 1e-3f);
+		GLuint table_size = 1;
+		while (table_size < 2 * n)
+			table_size <<= 1;
+		table_mask = table_size - 1;
+		cell_start.assign(table_size + 1, 0);
+		cell_count.reset(new std::atomic<GLuint>[table_size]);
+		accumulator = 0.f;
+	}
+
+	GLuint hash(int x, int y, int z) const {
+		return ((GLuint)x + (GLuint)y * 19349663u + (GLuint)z * 83492791u) & table_mask;
+	}
+
+	GLuint cell_of(float x, float y, float z) const {
+		float inv = 1.f / cell_size;
+		return hash((int)std::floor(x * inv), (int)std::floor(y * inv), (int)std::floor(z * inv));
+	}
+
+	// fixed substeps of PHYSICS_STEP, at most PHYSICS_MAX_SUBSTEPS a frame so a slow frame doesn't snowball
+	void advance(float dt, ThreadPool& pool) {
+		integrate_ms = hash_ms = narrow_ms = 0;
+		contacts = 0;
+		substeps = 0;
+		accumulator = std::min(accumulator + dt, PHYSICS_STEP * PHYSICS_MAX_SUBSTEPS);
+		while (accumulator >= PHYSICS_STEP) {
+			step(PHYSICS_STEP, pool);
+			accumulator -= PHYSICS_STEP;
+			substeps++;
+		}
+	}
+
+	void step(float dt, ThreadPool& pool) {
+		typedef std::chrono::high_resolution_clock Clock;
+		Clock::time_point start = Clock::now();
+		integrate(dt, pool);
+		Clock::time_point integrated = Clock::now();
+		integrate_ms += std::chrono::duration<double, std::milli>(integrated - start).count();
+		sort(pool);
+		Clock::time_point sorted = Clock::now();
+		hash_ms += std::chrono::duration<double, std::milli>(sorted - integrated).count();
+		contacts += collide(pool);
+		narrow_ms += std::chrono::duration<double, std::milli>(Clock::now() - sorted).count();
+	}
+
+	// semi-implicit euler, walls bounce with the same restitution as the spheres
+	void integrate(float dt, ThreadPool& pool) {
+		pool.parallel_for(0, size(), 4096, [&](size_t b, size_t e) {
+			for (size_t i = b; i < e; i++) {
+				vx[i] += gravity.x * dt;
+				vy[i] += gravity.y * dt;
+				vz[i] += gravity.z * dt;
+				px[i] += vx[i] * dt;
+				py[i] += vy[i] * dt;
+				pz[i] += vz[i] * dt;
+				float limit = bound - radius[i];
+				wall(px[i], vx[i], limit);
+				wall(py[i], vy[i], limit);
+				wall(pz[i], vz[i], limit);
+			}
+		});
+	}
+
+	void wall(float& p, float& v, float limit) const {
+		if (p < -limit) {
+			p = -limit;
+			if (v < 0.f)
+				v = -v * restitution;
+		}
+		else if (p > limit) {
+			p = limit;
+			if (v > 0.f)
+				v = -v * restitution;
+		}
+	}
+
+	// counting sort by hash bucket: count with atomics, prefix sum in blocks, scatter, then gather every array
+	void sort(ThreadPool& pool) {
+		size_t n = size(), table_size = (size_t)table_mask + 1;
+		pool.parallel_for(0, table_size, 16384, [&](size_t b, size_t e) {
+			for (size_t h = b; h < e; h++)
+				cell_count[h].store(0, std::memory_order_relaxed);
+		});
+		pool.parallel_for(0, n, 4096, [&](size_t b, size_t e) {
+			for (size_t i = b; i < e; i++) {
+				cell[i] = cell_of(px[i], py[i], pz[i]);
+				cell_count[cell[i]].fetch_add(1, std::memory_order_relaxed);
+			}
+		});
+		// exclusive scan: block totals in parallel, a short serial scan over the blocks, then the offsets
+		size_t blocks = pool.size() * 4, block = (table_size + blocks - 1) / blocks;
+		std::vector<GLuint> block_sum(blocks + 1, 0);
+		pool.parallel_for(0, blocks, 1, [&](size_t b, size_t e) {
+			for (size_t k = b; k < e; k++) {
+				GLuint sum = 0;
+				for (size_t h = k * block; h < std::min((k + 1) * block, table_size); h++)
+					sum += cell_count[h].load(std::memory_order_relaxed);
+				block_sum[k + 1] = sum;
+			}
+		});
+		for (size_t k = 0; k < blocks; k++)
+			block_sum[k + 1] += block_sum[k];
+		pool.parallel_for(0, blocks, 1, [&](size_t b, size_t e) {
+			for (size_t k = b; k < e; k++) {
+				GLuint offset = block_sum[k];
+				for (size_t h = k * block; h < std::min((k + 1) * block, table_size); h++) {
+					cell_start[h] = offset;
+					offset += cell_count[h].load(std::memory_order_relaxed);
+					cell_count[h].store(0, std::memory_order_relaxed);
+				}
+			}
+		});
+		cell_start[table_size] = (GLuint)n;
+		// spheres within a bucket end up in whatever order the threads got there
+		pool.parallel_for(0, n, 4096, [&](size_t b, size_t e) {
+			for (size_t i = b; i < e; i++)
+				order[cell_start[cell[i]] + cell_count[cell[i]].fetch_add(1, std::memory_order_relaxed)] = (GLuint)i;
+		});
+		pool.parallel_for(0, n, 4096, [&](size_t b, size_t e) {
+			for (size_t s = b; s < e; s++) {
+				GLuint i = order[s];
+				next_px[s] = px[i];
+				next_py[s] = py[i];
+				next_pz[s] = pz[i];
+				next_vx[s] = vx[i];
+				next_vy[s] = vy[i];
+				next_vz[s] = vz[i];
+				next_radius[s] = radius[i];
+				next_inv_mass[s] = inv_mass[i];
+				next_id[s] = id[i];
+			}
+		});
+		swap_next();
+		id.swap(next_id);
+		radius.swap(next_radius);
+		inv_mass.swap(next_inv_mass);
+	}
+
+	void swap_next() {
+		px.swap(next_px);
+		py.swap(next_py);
+		pz.swap(next_pz);
+		vx.swap(next_vx);
+		vy.swap(next_vy);
+		vz.swap(next_vz);
+	}
+
+	// pushes i out of j by its share of the overlap (by inverse mass) and, if they're closing, applies its
+	// half of the impulse. j does the mirror image when its own turn comes
+	void resolve(size_t i, size_t j, float dist2, glm::vec3& dp, glm::vec3& dv) const {
+		float dist = std::sqrt(dist2);
+		if (dist < 1e-6f)
+			return;
+		glm::vec3 n = glm::vec3(px[j] - px[i], py[j] - py[i], pz[j] - pz[i]) / dist;
+		float share = inv_mass[i] / (inv_mass[i] + inv_mass[j]);
+		dp -= n * ((radius[i] + radius[j] - dist) * share * PHYSICS_RELAXATION);
+		float closing = (vx[j] - vx[i]) * n.x + (vy[j] - vy[i]) * n.y + (vz[j] - vz[i]) * n.z;
+		if (closing < 0.f)
+			dv += n * ((1.f + restitution) * closing * share);
+	}
+
+	// narrowphase over the sorted arrays, candidates four at a time; returns the contacts found (each pair twice)
+	size_t collide(ThreadPool& pool) {
+		size_t n = size();
+		std::atomic<size_t> found(0);
+		float inv = 1.f / cell_size;
+		pool.parallel_for(0, n, 2048, [&](size_t b, size_t e) {
+			size_t local = 0;
+			// the hash is linear in x, so each of the 9 rows of neighbour cells is 3 consecutive buckets and
+			// their spheres one run of the sorted arrays. rows that overlap in the table get merged, so no
+			// sphere is tested twice. spheres of one cell are next to each other, the runs carry over
+			GLuint runs[18][2];
+			int num_runs = 0, last_x = INT_MIN, last_y = INT_MIN, last_z = INT_MIN;
+			GLuint table_size = table_mask + 1;
+			for (size_t i = b; i < e; i++) {
+				glm::vec3 dp(0.f), dv(0.f);
+				int cx = (int)std::floor(px[i] * inv), cy = (int)std::floor(py[i] * inv), cz = (int)std::floor(pz[i] * inv);
+				if (cx != last_x || cy != last_y || cz != last_z) {
+					last_x = cx;
+					last_y = cy;
+					last_z = cz;
+					// bucket ranges first, sorted by insertion (rows past the end of the table wrap around)
+					GLuint rows[18][2];
+					int num_rows = 0;
+					for (int z = -1; z <= 1; z++) {
+						for (int y = -1; y <= 1; y++) {
+							GLuint h = hash(cx - 1, cy + y, cz + z);
+							GLuint ranges[2][2] = { { h, std::min(h + 3, table_size) }, { 0, h + 3 > table_size ? h + 3 - table_size : 0 } };
+							for (int r = 0; r < 2; r++) {
+								if (ranges[r][0] == ranges[r][1])
+									continue;
+								int at = num_rows++;
+								for (; at > 0 && rows[at - 1][0] > ranges[r][0]; at--) {
+									rows[at][0] = rows[at - 1][0];
+									rows[at][1] = rows[at - 1][1];
+								}
+								rows[at][0] = ranges[r][0];
+								rows[at][1] = ranges[r][1];
+							}
+						}
+					}
+					num_runs = 0;
+					for (int r = 0; r < num_rows; r++) {
+						if (num_runs > 0 && rows[r][0] <= runs[num_runs - 1][1])
+							runs[num_runs - 1][1] = std::max(runs[num_runs - 1][1], rows[r][1]);
+						else {
+							runs[num_runs][0] = rows[r][0];
+							runs[num_runs++][1] = rows[r][1];
+						}
+					}
+					// to sphere ranges
+					for (int r = 0; r < num_runs; r++) {
+						runs[r][0] = cell_start[runs[r][0]];
+						runs[r][1] = cell_start[runs[r][1]];
+					}
+				}
+				for (int r = 0; r < num_runs; r++) {
+					size_t j = runs[r][0], end = runs[r][1];
+#ifdef BVH_SSE
+					// the arrays are padded, so the last group of a run gets its missing lanes masked off
+					// instead of a scalar tail; most runs are a sphere or two
+					__m128 ix = _mm_set1_ps(px[i]), iy = _mm_set1_ps(py[i]), iz = _mm_set1_ps(pz[i]), ir = _mm_set1_ps(radius[i]);
+					for (; j < end; j += 4) {
+						__m128 dx = _mm_sub_ps(_mm_loadu_ps(&px[j]), ix);
+						__m128 dy = _mm_sub_ps(_mm_loadu_ps(&py[j]), iy);
+						__m128 dz = _mm_sub_ps(_mm_loadu_ps(&pz[j]), iz);
+						__m128 r = _mm_add_ps(_mm_loadu_ps(&radius[j]), ir);
+						__m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+						int mask = _mm_movemask_ps(_mm_cmplt_ps(d2, _mm_mul_ps(r, r)));
+						mask &= end - j >= 4 ? 0xf : (1 << (end - j)) - 1;
+						if (i >= j && i - j < 4)
+							mask &= ~(1 << (i - j));
+						if (!mask)
+							continue;
+						float dist2[4];
+						_mm_storeu_ps(dist2, d2);
+						for (int l = 0; l < 4; l++) {
+							if (mask & (1 << l)) {
+								resolve(i, j + l, dist2[l], dp, dv);
+								local++;
+							}
+						}
+					}
+#else
+					for (; j < end; j++) {
+						if (j == i)
+							continue;
+						float dx = px[j] - px[i], dy = py[j] - py[i], dz = pz[j] - pz[i], r = radius[i] + radius[j];
+						float dist2 = dx * dx + dy * dy + dz * dz;
+						if (dist2 < r * r) {
+							resolve(i, j, dist2, dp, dv);
+							local++;
+						}
+					}
+#endif
+				}
+				next_px[i] = px[i] + dp.x;
+				next_py[i] = py[i] + dp.y;
+				next_pz[i] = pz[i] + dp.z;
+				next_vx[i] = vx[i] + dv.x;
+				next_vy[i] = vy[i] + dv.y;
+				next_vz[i] = vz[i] + dv.z;
+			}
+			found += local;
+		});
+		swap_next();
+		return found;
+	}
+
+	// back into object order: the cpu copy the paths and the bvh read, and the instance buffer if it's mapped
+	void write(glm::vec4* objects, glm::vec4* mapped, ThreadPool& pool) const {
+		pool.parallel_for(0, size(), 4096, [&](size_t b, size_t e) {
+			for (size_t s = b; s < e; s++) {
+				glm::vec4 o(px[s], py[s], pz[s], radius[s]);
+				objects[id[s]] = o;
+				if (mapped)
+					mapped[id[s]] = o;
+			}
+		});
+	}
+};
+
+// self-gravitating spheres, mass ~ radius^3, with a barnes-hut octree rebuilt every step:
+// bodies are sorted by the morton code of their position (parallel lsd radix sort), which makes every
+// octree cell a contiguous range of the sorted arrays. the tree is built a level at a time, each level's
+// nodes in morton order right after the previous level's, so a node's children are next to each other
+// and bodies that are next to each other walk nearly the same nodes. the forces are found a group of
+// nearby bodies at a time: one walk collects what every body in the group feels (opening cells by their
+// distance to the group's box, so each body sees them at least that far), then the bodies sum that list
+// four entries at a time. leapfrog (kick-drift-kick) keeps the energy from drifting off the way euler would
+struct NBody {
+	struct Node {
+		glm::vec4 center_mass; // xyz = center of mass, w = mass
+		float size; // cell edge
+		GLuint first, count; // its bodies, a range of the sorted arrays
+		GLuint child, children; // children are nodes [child, child + children), none for a leaf
+	};
+	std::vector<float> px, py, pz, vx, vy, vz, ax, ay, az, potential, mass, radius;
+	std::vector<float> next_px, next_py, next_pz, next_vx, next_vy, next_vz, next_mass, next_radius;
+	std::vector<GLuint> id, next_id, order, next_order;
+	std::vector<unsigned long long> codes, next_codes;
+	// masses one group pulls with: cells that stay closed and the bodies of leaves that don't, padded to 4
+	struct Interactions {
+		std::vector<float> x, y, z, m;
+		void clear() { x.clear(); y.clear(); z.clear(); m.clear(); }
+		void push(float px, float py, float pz, float pm) { x.push_back(px); y.push_back(py); z.push_back(pz); m.push_back(pm); }
+	};
+	std::vector<Node> nodes;
+	std::vector<GLuint> level_start; // nodes of level l are [level_start[l], level_start[l + 1])
+	std::vector<GLuint> child_offsets;
+	std::vector<GLuint> groups; // nodes the force pass walks the tree for
+	glm::vec3 box_min;
+	float box_size;
+	float theta;
+	bool accelerated; // ax..az are for the current positions
+	double initial_energy, energy;
+	float accumulator;
+	// last frame's work
+	int steps;
+	double sort_ms, build_ms, force_ms;
+
+	NBody() : box_min(0.f), box_size(1.f), theta(NBODY_THETA), accelerated(false), initial_energy(0), energy(0), accumulator(0.f),
+		steps(0), sort_ms(0), build_ms(0), force_ms(0) {}
+
+	size_t size() const { return id.size(); }
+
+	// takes over the spheres as they are, at rest
+	void reset(const std::vector<glm::vec4>& spheres) {
+		size_t n = spheres.size();
+		for (std::vector<float>* v : { &px, &py, &pz, &vx, &vy, &vz, &ax, &ay, &az, &potential, &mass, &radius,
+				&next_px, &next_py, &next_pz, &next_vx, &next_vy, &next_vz, &next_mass, &next_radius })
+			v->assign(n, 0.f);
+		for (std::vector<GLuint>* v : { &id, &next_id, &order, &next_order })
+			v->resize(n);
+		codes.resize(n);
+		next_codes.resize(n);
+		for (size_t i = 0; i < n; i++) {
+			px[i] = spheres[i].x;
+			py[i] = spheres[i].y;
+			pz[i] = spheres[i].z;
+			radius[i] = spheres[i].w;
+			mass[i] = spheres[i].w * spheres[i].w * spheres[i].w;
+			id[i] = (GLuint)i;
+		}
+		accelerated = false;
+		accumulator = 0.f;
+		rebuild(NULL);
+		measure_energy();
+		initial_energy = energy;
+	}
+
+	// fixed steps of NBODY_STEP, at most NBODY_MAX_STEPS a frame
+	void advance(float dt, ThreadPool& pool) {
+		sort_ms = build_ms = force_ms = 0;
+		steps = 0;
+		accumulator = std::min(accumulator + dt, NBODY_STEP * NBODY_MAX_STEPS);
+		for (; accumulator >= NBODY_STEP; accumulator -= NBODY_STEP) {
+			step(NBODY_STEP, pool);
+			steps++;
+		}
+	}
+
+	void step(float dt, ThreadPool& pool) {
+		if (!accelerated)
+			rebuild(&pool);
+		kick(dt * 0.5f, pool);
+		pool.parallel_for(0, size(), 4096, [&](size_t b, size_t e) {
+			for (size_t i = b; i < e; i++) {
+				px[i] += vx[i] * dt;
+				py[i] += vy[i] * dt;
+				pz[i] += vz[i] * dt;
+			}
+		});
+		rebuild(&pool);
+		kick(dt * 0.5f, pool);
+		measure_energy();
+	}
+
+	void kick(float dt, ThreadPool& pool) {
+		pool.parallel_for(0, size(), 4096, [&](size_t b, size_t e) {
+			for (size_t i = b; i < e; i++) {
+				vx[i] += ax[i] * dt;
+				vy[i] += ay[i] * dt;
+				vz[i] += az[i] * dt;
+			}
+		});
+	}
+
+	// on the pool if there is one, here otherwise
+	static void run(ThreadPool* pool, size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& f) {
+		if (pool)
+			pool->parallel_for(begin, end, grain, f);
+		else
+			f(begin, end);
+	}
+
+	// sort, tree and accelerations for the current positions
+	void rebuild(ThreadPool* pool) {
+		typedef std::chrono::high_resolution_clock Clock;
+		Clock::time_point start = Clock::now();
+		sort(pool);
+		Clock::time_point sorted = Clock::now();
+		sort_ms += std::chrono::duration<double, std::milli>(sorted - start).count();
+		build(pool);
+		Clock::time_point built = Clock::now();
+		build_ms += std::chrono::duration<double, std::milli>(built - sorted).count();
+		forces(pool);
+		force_ms += std::chrono::duration<double, std::milli>(Clock::now() - built).count();
+		accelerated = true;
+	}
+
+	// 21 bits per axis spread out so x, y and z interleave, z highest
+	static unsigned long long spread(GLuint v) {
+		unsigned long long x = v & 0x1fffff;
+		x = (x | x << 32) & 0x1f00000000ffffull;
+		x = (x | x << 16) & 0x1f0000ff0000ffull;
+		x = (x | x << 8) & 0x100f00f00f00f00full;
+		x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+		x = (x | x << 2) & 0x1249249249249249ull;
+		return x;
+	}
+
+	void sort(ThreadPool* pool) {
+		size_t n = size();
+		const size_t CHUNKS = 64;
+		size_t chunk = (n + CHUNKS - 1) / CHUNKS;
+		// bounding cube of this step, a box per chunk first
+		std::vector<glm::vec3> chunk_lo(CHUNKS, glm::vec3(FLT_MAX)), chunk_hi(CHUNKS, glm::vec3(-FLT_MAX));
+		run(pool, 0, CHUNKS, 1, [&](size_t b, size_t e) {
+			for (size_t c = b; c < e; c++) {
+				for (size_t i = c * chunk; i < std::min((c + 1) * chunk, n); i++) {
+					chunk_lo[c] = glm::min(chunk_lo[c], glm::vec3(px[i], py[i], pz[i]));
+					chunk_hi[c] = glm::max(chunk_hi[c], glm::vec3(px[i], py[i], pz[i]));
+				}
+			}
+		});
+		glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+		for (size_t c = 0; c < CHUNKS; c++) {
+			lo = glm::min(lo, chunk_lo[c]);
+			hi = glm::max(hi, chunk_hi[c]);
+		}
+		glm::vec3 extent = hi - lo;
+		box_size = std::max(std::max(std::max(extent.x, extent.y), extent.z), 1e-3f) * 1.0001f;
+		box_min = lo;
+		float scale = (1 << NBODY_DEPTH) / box_size;
+		run(pool, 0, n, 4096, [&](size_t b, size_t e) {
+			for (size_t i = b; i < e; i++) {
+				GLuint x = (GLuint)((px[i] - box_min.x) * scale), y = (GLuint)((py[i] - box_min.y) * scale), z = (GLuint)((pz[i] - box_min.z) * scale);
+				codes[i] = spread(x) | spread(y) << 1 | spread(z) << 2;
+				order[i] = (GLuint)i;
+			}
+		});
+		// lsd radix sort, 8 bits a pass. each pass counts per chunk in parallel; chunk c's digit d goes after
+		// all smaller digits and after digit d of the chunks before it, which keeps every pass stable
+		std::vector<GLuint> offsets(CHUNKS * 256);
+		for (int shift = 0; shift < 3 * NBODY_DEPTH; shift += 8) {
+			run(pool, 0, CHUNKS, 1, [&](size_t b, size_t e) {
+				for (size_t c = b; c < e; c++) {
+					GLuint* count = &offsets[c * 256];
+					std::fill(count, count + 256, 0);
+					for (size_t i = c * chunk; i < std::min((c + 1) * chunk, n); i++)
+						count[(codes[i] >> shift) & 0xff]++;
+				}
+			});
+			GLuint sum = 0;
+			for (int d = 0; d < 256; d++) {
+				for (size_t c = 0; c < CHUNKS; c++) {
+					GLuint count = offsets[c * 256 + d];
+					offsets[c * 256 + d] = sum;
+					sum += count;
+				}
+			}
+			run(pool, 0, CHUNKS, 1, [&](size_t b, size_t e) {
+				for (size_t c = b; c < e; c++) {
+					GLuint* offset = &offsets[c * 256];
+					for (size_t i = c * chunk; i < std::min((c + 1) * chunk, n); i++) {
+						GLuint dst = offset[(codes[i] >> shift) & 0xff]++;
+						next_codes[dst] = codes[i];
+						next_order[dst] = order[i];
+					}
+				}
+			});
+			codes.swap(next_codes);
+			order.swap(next_order);
+		}
+		run(pool, 0, n, 4096, [&](size_t b, size_t e) {
+			for (size_t s = b; s < e; s++) {
+				GLuint i = order[s];
+				next_px[s] = px[i];
+				next_py[s] = py[i];
+				next_pz[s] = pz[i];
+				next_vx[s] = vx[i];
+				next_vy[s] = vy[i];
+				next_vz[s] = vz[i];
+				next_mass[s] = mass[i];
+				next_radius[s] = radius[i];
+				next_id[s] = id[i];
+			}
+		});
+		px.swap(next_px);
+		py.swap(next_py);
+		pz.swap(next_pz);
+		vx.swap(next_vx);
+		vy.swap(next_vy);
+		vz.swap(next_vz);
+		mass.swap(next_mass);
+		radius.swap(next_radius);
+		id.swap(next_id);
+	}
+
+	// first sorted body in [begin, end) whose octant digit at shift is at least digit
+	GLuint split(GLuint begin, GLuint end, int shift, GLuint digit) const {
+		return (GLuint)(std::partition_point(codes.begin() + begin, codes.begin() + end,
+			[shift, digit](unsigned long long code) { return ((code >> shift) & 7) < digit; }) - codes.begin());
+	}
+
+	void build(ThreadPool* pool) {
+		nodes.clear();
+		level_start.assign(1, 0);
+		nodes.push_back(Node{ glm::vec4(0.f), box_size, 0, (GLuint)size(), 0, 0 });
+		for (int level = 0; level < NBODY_DEPTH; level++) {
+			GLuint begin = level_start.back(), end = (GLuint)nodes.size();
+			level_start.push_back(end);
+			int shift = 3 * (NBODY_DEPTH - 1 - level);
+			// children per node, then where they go, then the children themselves
+			child_offsets.resize(end - begin + 1);
+			run(pool, begin, end, 256, [&](size_t b, size_t e) {
+				for (size_t i = b; i < e; i++) {
+					const Node& n = nodes[i];
+					GLuint children = 0;
+					if (n.count > NBODY_LEAF_SIZE) {
+						for (GLuint d = 0, at = n.first; d < 8 && at < n.first + n.count; d++) {
+							GLuint next = split(at, n.first + n.count, shift, d + 1);
+							children += next > at;
+							at = next;
+						}
+					}
+					child_offsets[i - begin] = children;
+				}
+			});
+			GLuint sum = end;
+			for (size_t i = 0; i < end - begin; i++) {
+				GLuint children = child_offsets[i];
+				child_offsets[i] = sum;
+				sum += children;
+			}
+			if (sum == end)
+				break;
+			nodes.resize(sum);
+			float size = box_size / (float)(2 << level);
+			run(pool, begin, end, 256, [&](size_t b, size_t e) {
+				for (size_t i = b; i < e; i++) {
+					Node& n = nodes[i];
+					n.child = child_offsets[i - begin];
+					n.children = (i + 1 < end ? child_offsets[i + 1 - begin] : sum) - n.child;
+					GLuint c = n.child;
+					for (GLuint d = 0, at = n.first; d < 8 && n.children > 0 && at < n.first + n.count; d++) {
+						GLuint next = split(at, n.first + n.count, shift, d + 1);
+						if (next > at)
+							nodes[c++] = Node{ glm::vec4(0.f), size, at, next - at, 0, 0 };
+						at = next;
+					}
+				}
+			});
+		}
+		level_start.push_back((GLuint)nodes.size());
+		// masses from the bottom up, a level at a time
+		for (size_t level = level_start.size() - 1; level-- > 0;) {
+			run(pool, level_start[level], level_start[level + 1], 256, [&](size_t b, size_t e) {
+				for (size_t i = b; i < e; i++) {
+					Node& n = nodes[i];
+					glm::vec4 sum(0.f);
+					if (n.children == 0) {
+						for (GLuint j = n.first; j < n.first + n.count; j++)
+							sum += glm::vec4(px[j] * mass[j], py[j] * mass[j], pz[j] * mass[j], mass[j]);
+					}
+					else {
+						for (GLuint c = n.child; c < n.child + n.children; c++)
+							sum += glm::vec4(glm::vec3(nodes[c].center_mass) * nodes[c].center_mass.w, nodes[c].center_mass.w);
+					}
+					n.center_mass = glm::vec4(glm::vec3(sum) / std::max(sum.w, FLT_MIN), sum.w);
+				}
+			});
+		}
+	}
+
+	// groups: the highest nodes with at most NBODY_GROUP_SIZE bodies, and leaves the tree ran out of levels for
+	void forces(ThreadPool* pool) {
+		groups.clear();
+		std::vector<GLuint> stack(1, 0);
+		while (!stack.empty()) {
+			const Node& n = nodes[stack.back()];
+			GLuint index = stack.back();
+			stack.pop_back();
+			if (n.count <= NBODY_GROUP_SIZE || n.children == 0)
+				groups.push_back(index);
+			else
+				for (GLuint c = n.child; c < n.child + n.children; c++)
+					stack.push_back(c);
+		}
+		std::sort(groups.begin(), groups.end());
+		run(pool, 0, groups.size(), 16, [this](size_t b, size_t e) {
+			Interactions list;
+			for (size_t g = b; g < e; g++)
+				accelerate(nodes[groups[g]], list);
+		});
+	}
+
+	// cells that look smaller than theta from anywhere in the group count as one mass at their center, the
+	// rest are opened down to their bodies
+	void accelerate(const Node& group, Interactions& list) {
+		glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+		for (GLuint i = group.first; i < group.first + group.count; i++) {
+			lo = glm::min(lo, glm::vec3(px[i], py[i], pz[i]));
+			hi = glm::max(hi, glm::vec3(px[i], py[i], pz[i]));
+		}
+		const float theta2 = theta * theta;
+		list.clear();
+		GLuint stack[8 * NBODY_DEPTH + 1];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0) {
+			const Node& n = nodes[stack[--top]];
+			glm::vec3 c(n.center_mass);
+			glm::vec3 d = glm::max(glm::max(lo - c, c - hi), glm::vec3(0.f));
+			bool holds_group = n.first <= group.first && group.first < n.first + n.count;
+			if (!holds_group && n.size * n.size < theta2 * glm::dot(d, d))
+				list.push(c.x, c.y, c.z, n.center_mass.w);
+			else if (n.children > 0) {
+				for (GLuint k = n.child; k < n.child + n.children; k++)
+					stack[top++] = k;
+			}
+			else {
+				for (GLuint j = n.first; j < n.first + n.count; j++)
+					list.push(px[j], py[j], pz[j], mass[j]);
+			}
+		}
+		while (list.m.size() % 4 != 0)
+			list.push(0.f, 0.f, 0.f, 0.f);
+
+		// a body's own entry adds nothing to its acceleration but -m / softening to its potential
+		const float eps2 = NBODY_SOFTENING * NBODY_SOFTENING;
+		for (GLuint i = group.first; i < group.first + group.count; i++) {
+			float a[3] = { 0.f, 0.f, 0.f }, phi = 0.f;
+			size_t k = 0;
+#ifdef BVH_SSE
+			__m128 ix = _mm_set1_ps(px[i]), iy = _mm_set1_ps(py[i]), iz = _mm_set1_ps(pz[i]), e2 = _mm_set1_ps(eps2);
+			__m128 sx = _mm_setzero_ps(), sy = _mm_setzero_ps(), sz = _mm_setzero_ps(), sp = _mm_setzero_ps();
+			for (; k < list.m.size(); k += 4) {
+				__m128 dx = _mm_sub_ps(_mm_loadu_ps(&list.x[k]), ix);
+				__m128 dy = _mm_sub_ps(_mm_loadu_ps(&list.y[k]), iy);
+				__m128 dz = _mm_sub_ps(_mm_loadu_ps(&list.z[k]), iz);
+				__m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_add_ps(_mm_mul_ps(dz, dz), e2));
+				// rsqrt plus a newton step, ~1e-7 relative
+				__m128 inv = _mm_rsqrt_ps(d2);
+				inv = _mm_mul_ps(inv, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), d2), _mm_mul_ps(inv, inv))));
+				__m128 mi = _mm_mul_ps(_mm_loadu_ps(&list.m[k]), inv);
+				__m128 f = _mm_mul_ps(mi, _mm_mul_ps(inv, inv));
+				sx = _mm_add_ps(sx, _mm_mul_ps(dx, f));
+				sy = _mm_add_ps(sy, _mm_mul_ps(dy, f));
+				sz = _mm_add_ps(sz, _mm_mul_ps(dz, f));
+				sp = _mm_sub_ps(sp, mi);
+			}
+			float lanes[4][4];
+			_mm_storeu_ps(lanes[0], sx);
+			_mm_storeu_ps(lanes[1], sy);
+			_mm_storeu_ps(lanes[2], sz);
+			_mm_storeu_ps(lanes[3], sp);
+			for (int l = 0; l < 4; l++) {
+				a[0] += lanes[0][l];
+				a[1] += lanes[1][l];
+				a[2] += lanes[2][l];
+				phi += lanes[3][l];
+			}
+#endif
+			for (; k < list.m.size(); k++) {
+				float dx = list.x[k] - px[i], dy = list.y[k] - py[i], dz = list.z[k] - pz[i];
+				float inv = 1.f / std::sqrt(dx * dx + dy * dy + dz * dz + eps2);
+				float mi = list.m[k] * inv, f = mi * inv * inv;
+				a[0] += dx * f;
+				a[1] += dy * f;
+				a[2] += dz * f;
+				phi -= mi;
+			}
+			ax[i] = a[0] * NBODY_G;
+			ay[i] = a[1] * NBODY_G;
+			az[i] = a[2] * NBODY_G;
+			potential[i] = (phi + mass[i] / NBODY_SOFTENING) * NBODY_G;
+		}
+	}
+
+	// kinetic + potential (each pair counted twice in the potentials, hence the half)
+	void measure_energy() {
+		double e = 0.0;
+		for (size_t i = 0; i < size(); i++)
+			e += 0.5 * mass[i] * (vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i] + potential[i]);
+		energy = e;
+	}
+
+	void write(glm::vec4* objects, glm::vec4* mapped, ThreadPool& pool) const {
+		pool.parallel_for(0, size(), 4096, [&](size_t b, size_t e) {
+			for (size_t s = b; s < e; s++) {
+				glm::vec4 o(px[s], py[s], pz[s], radius[s]);
+				objects[id[s]] = o;
+				if (mapped)
+					mapped[id[s]] = o;
+			}
+		});
+	}
+};
+
+// layout fixed by the spec, see glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand {
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
+};
+
+// where one lod lives inside the packed vbo/ebo
+struct MeshLod {
+	GLuint first_index;
+	GLuint index_count;
+	GLint base_vertex;
+};
+
+// uniform locations of a program that links sphere.fsh
+struct SphereProgram {
+	GLuint id;
+	// vsh
+	GLint v_m, v_mnormal, v_v, v_p, v_mvp, v_rot, v_displace, v_displaceTime;
+	// fsh
+	GLint f_lightColor, f_viewPos;
+	// directional
+	GLint f_dirLight_direction, f_dirLight_ambient, f_dirLight_diffuse, f_dirLight_specular;
+	// point light 1
+	GLint f_pointLights0_position, f_pointLights0_ambient, f_pointLights0_diffuse, f_pointLights0_specular;
+	GLint f_pointLights0_constant, f_pointLights0_linear, f_pointLights0_quadratic;
+	// spotlight
+	GLint f_spotLight_position, f_spotLight_direction, f_spotLight_ambient, f_spotLight_diffuse, f_spotLight_specular;
+	GLint f_spotLight_constant, f_spotLight_linear, f_spotLight_quadratic, f_spotLight_cutOff, f_spotLight_outerCutOff;
+
+	SphereProgram() : id(0) {}
+	SphereProgram(GLuint program) : id(program) {
+		v_m = glGetUniformLocation(program, "m");
+		v_mnormal = glGetUniformLocation(program, "mnormal");
+		v_v = glGetUniformLocation(program, "v");
+		v_p = glGetUniformLocation(program, "p");
+		v_mvp = glGetUniformLocation(program, "mvp");
+		v_rot = glGetUniformLocation(program, "rot");
+		v_displace = glGetUniformLocation(program, "displace");
+		v_displaceTime = glGetUniformLocation(program, "displaceTime");
+		f_lightColor = glGetUniformLocation(program, "lightColor");
+		f_viewPos = glGetUniformLocation(program, "viewPos");
+		f_dirLight_direction = glGetUniformLocation(program, "dirLight.direction");
+		f_dirLight_ambient = glGetUniformLocation(program, "dirLight.ambient");
+		f_dirLight_diffuse = glGetUniformLocation(program, "dirLight.diffuse");
+		f_dirLight_specular = glGetUniformLocation(program, "dirLight.specular");
+		f_pointLights0_position = glGetUniformLocation(program, "pointLights[0].position");
+		f_pointLights0_ambient = glGetUniformLocation(program, "pointLights[0].ambient");
+		f_pointLights0_diffuse = glGetUniformLocation(program, "pointLights[0].diffuse");
+		f_pointLights0_specular = glGetUniformLocation(program, "pointLights[0].specular");
+		f_pointLights0_constant = glGetUniformLocation(program, "pointLights[0].constant");
+		f_pointLights0_linear = glGetUniformLocation(program, "pointLights[0].linear");
+		f_pointLights0_quadratic = glGetUniformLocation(program, "pointLights[0].quadratic");
+		f_spotLight_position = glGetUniformLocation(program, "spotLight.position");
+		f_spotLight_direction = glGetUniformLocation(program, "spotLight.direction");
+		f_spotLight_ambient = glGetUniformLocation(program, "spotLight.ambient");
+		f_spotLight_diffuse = glGetUniformLocation(program, "spotLight.diffuse");
+		f_spotLight_specular = glGetUniformLocation(program, "spotLight.specular");
+		f_spotLight_constant = glGetUniformLocation(program, "spotLight.constant");
+		f_spotLight_linear = glGetUniformLocation(program, "spotLight.linear");
+		f_spotLight_quadratic = glGetUniformLocation(program, "spotLight.quadratic");
+		f_spotLight_cutOff = glGetUniformLocation(program, "spotLight.cutOff");
+		f_spotLight_outerCutOff = glGetUniformLocation(program, "spotLight.outerCutOff");
+	}
+
+	// the program has to be in use (through gl_state)
+	void set_lights(const DirectionalLight& world_light, const PointLight& pl, const SpotLight& flashlight, glm::vec3 lightColor) {
+		// directional
+		gl_state.uniform3fv(f_dirLight_direction, world_light.direction);
+		gl_state.uniform3fv(f_dirLight_ambient, world_light.ambient);
+		gl_state.uniform3fv(f_dirLight_diffuse, world_light.diffuse);
+		gl_state.uniform3fv(f_dirLight_specular, world_light.specular);
+		// point light 1
+		gl_state.uniform3fv(f_pointLights0_position, pl.position);
+		gl_state.uniform3fv(f_pointLights0_ambient, pl.ambient);
+		gl_state.uniform3fv(f_pointLights0_diffuse, pl.diffuse);
+		gl_state.uniform3fv(f_pointLights0_specular, pl.specular);
+		gl_state.uniform1f(f_pointLights0_constant, pl.constant);
+		gl_state.uniform1f(f_pointLights0_linear, pl.linear);
+		gl_state.uniform1f(f_pointLights0_quadratic, pl.quadratic);
+		// spotlight
+		gl_state.uniform3fv(f_spotLight_ambient, flashlight.ambient);
+		gl_state.uniform3fv(f_spotLight_diffuse, flashlight.diffuse);
+		gl_state.uniform3fv(f_spotLight_specular, flashlight.specular);
+		gl_state.uniform1f(f_spotLight_constant, flashlight.constant);
+		gl_state.uniform1f(f_spotLight_linear, flashlight.linear);
+		gl_state.uniform1f(f_spotLight_quadratic, flashlight.quadratic);
+		gl_state.uniform1f(f_spotLight_cutOff, flashlight.cutOff);
+		gl_state.uniform1f(f_spotLight_outerCutOff, flashlight.outerCutOff);
+		gl_state.uniform3fv(f_lightColor, lightColor);
+	}
+
+	// the program has to be in use (through gl_state)
+	void set_camera(const glm::mat4& p, const glm::mat4& v, glm::vec3 pos, glm::vec3 front) {
+		gl_state.uniform_matrix4fv(v_p, p);
+		gl_state.uniform_matrix4fv(v_v, v);
+		gl_state.uniform3fv(f_viewPos, pos);
+		// the flashlight is attached to the camera
+		gl_state.uniform3fv(f_spotLight_position, pos);
+		gl_state.uniform3fv(f_spotLight_direction, front);
+	}
+
+	// the program has to be in use (through gl_state); only does anything in programs that include displace.glsl
+	void set_displacement(bool on, float time) {
+		gl_state.uniform1i(v_displace, on);
+		gl_state.uniform1f(v_displaceTime, time);
+	}
+};
+
+// shader source with every #include "file" line replaced by that file, so the sphere shaders can share lighting.glsl
+std::string readShaderSource(const char* path) {
+	std::ifstream file(path);
+	std::stringstream ss;
+	std::string line;
+	while (std::getline(file, line)) {
+		size_t inc = line.find("#include \"");
+		if (inc != std::string::npos && line.find_first_not_of(" \t") == inc) {
+			size_t start = inc + 10;
+			std::string included = line.substr(start, line.find('"', start) - start);
+			ss << readShaderSource(included.c_str()) << "\n";
+		}
+		else {
+			ss << line << "\n";
+		}
+	}
+	return ss.str();
+}
+
+// loadProgram only knows plain vertex + fragment files, anything with includes or other stages goes through here
+GLuint compileShader(GLenum type, const char* path) {
+	std::string src = readShaderSource(path);
+	const char* c_src = src.c_str();
+
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &c_src, NULL);
+	glCompileShader(shader);
+	GLint ok;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+	if (!ok) {
+		char log[1024];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		std::cout << "Failed to compile " << path << "\n" << log << std::endl;
+	}
+	return shader;
+}
+
+// feedback: varyings a transform feedback pass captures, interleaved in this order (or each into the
+// buffer bound at its index, with GL_SEPARATE_ATTRIBS)
+GLuint linkShaders(const std::vector<GLuint>& shaders, const char* name, const std::vector<const char*>& feedback = std::vector<const char*>(),
+	GLenum feedback_mode = GL_INTERLEAVED_ATTRIBS) {
+	GLuint program = glCreateProgram();
+	for (GLuint shader : shaders)
+		glAttachShader(program, shader);
+	if (!feedback.empty())
+		glTransformFeedbackVaryings(program, (GLsizei)feedback.size(), feedback.data(), feedback_mode);
+	glLinkProgram(program);
+	for (GLuint shader : shaders)
+		glDeleteShader(shader);
+	GLint ok;
+	glGetProgramiv(program, GL_LINK_STATUS, &ok);
+	if (!ok) {
+		char log[1024];
+		glGetProgramInfoLog(program, sizeof(log), NULL, log);
+		std::cout << "Failed to link " << name << "\n" << log << std::endl;
+	}
+	return program;
+}
+
+GLuint loadShaderProgram(const char* vsh, const char* fsh) {
+	return linkShaders({ compileShader(GL_VERTEX_SHADER, vsh), compileShader(GL_FRAGMENT_SHADER, fsh) }, vsh);
+}
+
+// vertex shader only, for transform feedback with rasterization off
+GLuint loadFeedbackProgram(const char* vsh, const std::vector<const char*>& varyings, GLenum mode = GL_INTERLEAVED_ATTRIBS) {
+	return linkShaders({ compileShader(GL_VERTEX_SHADER, vsh) }, vsh, varyings, mode);
+}
+
+GLuint loadComputeProgram(const char* csh) {
+	return linkShaders({ compileShader(GL_COMPUTE_SHADER, csh) }, csh);
+}
+
+GLuint loadTessProgram(const char* vsh, const char* tcsh, const char* tesh, const char* fsh) {
+	return linkShaders({
+		compileShader(GL_VERTEX_SHADER, vsh),
+		compileShader(GL_TESS_CONTROL_SHADER, tcsh),
+		compileShader(GL_TESS_EVALUATION_SHADER, tesh),
+		compileShader(GL_FRAGMENT_SHADER, fsh)
+	}, tesh);
+}
+
+// particles.glsl's uniforms, the same for every step of a frame
+struct ParticleParams {
+	float dt;
+	glm::vec3 attractor;
+	float attraction, drag, bound, restitution;
+};
+
+// sphere swarm advanced on the gpu, the cpu isn't in the loop: center + radius and velocity live in two pairs
+// of buffers, a step reads one pair and writes the other, then they swap. particles.csh does the step when
+// there's 4.3, particles.vsh with transform feedback otherwise. the paths draw straight from objects()
+struct GpuParticles {
+	GLuint object_buffers[2], velocity_buffers[2];
+	GLuint vaos[2]; // transform feedback: vaos[i] reads pair i
+	GLuint program;
+	bool compute;
+	GLint u_dt, u_attractor, u_attraction, u_drag, u_bound, u_restitution, u_numParticles;
+	GLsizei count;
+	int current; // the pair holding the latest state
+
+	GpuParticles() : program(0), compute(false), count(0), current(0) {
+		for (int i = 0; i < 2; i++)
+			object_buffers[i] = velocity_buffers[i] = vaos[i] = 0;
+	}
+
+	void init(bool use_compute) {
+		compute = use_compute;
+		if (compute)
+			program = loadComputeProgram("particles.csh");
+		else
+			program = loadFeedbackProgram("particles.vsh", { "tf_object", "tf_velocity" }, GL_SEPARATE_ATTRIBS);
+		u_dt = glGetUniformLocation(program, "dt");
+		u_attractor = glGetUniformLocation(program, "attractor");
+		u_attraction = glGetUniformLocation(program, "attraction");
+		u_drag = glGetUniformLocation(program, "drag");
+		u_bound = glGetUniformLocation(program, "bound");
+		u_restitution = glGetUniformLocation(program, "restitution");
+		u_numParticles = glGetUniformLocation(program, "numParticles");
+		glGenBuffers(2, object_buffers);
+		glGenBuffers(2, velocity_buffers);
+		glGenVertexArrays(2, vaos);
+		for (int i = 0; i < 2; i++) {
+			glBindVertexArray(vaos[i]);
+			glBindBuffer(GL_ARRAY_BUFFER, object_buffers[i]);
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), 0);
+			glBindBuffer(GL_ARRAY_BUFFER, velocity_buffers[i]);
+			glEnableVertexAttribArray(1);
+			glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), 0);
+		}
+		glBindVertexArray(0);
+	}
+
+	void release() {
+		glDeleteProgram(program);
+		glDeleteBuffers(2, object_buffers);
+		glDeleteBuffers(2, velocity_buffers);
+		glDeleteVertexArrays(2, vaos);
+	}
+
+	// starts from the spheres in source (a buffer of n vec4s, copied on the gpu) with these velocities;
+	// false if the buffers didn't fit
+	bool reset(GLuint source, const std::vector<glm::vec4>& velocities) {
+		count = (GLsizei)velocities.size();
+		current = 0;
+		GLsizeiptr bytes = sizeof(glm::vec4) * count;
+		for (int i = 0; i < 2; i++) {
+			glBindBuffer(GL_ARRAY_BUFFER, object_buffers[i]);
+			glBufferData(GL_ARRAY_BUFFER, bytes, NULL, GL_DYNAMIC_COPY);
+			glBindBuffer(GL_ARRAY_BUFFER, velocity_buffers[i]);
+			glBufferData(GL_ARRAY_BUFFER, bytes, i == current ? velocities.data() : NULL, GL_DYNAMIC_COPY);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_COPY_READ_BUFFER, source);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, object_buffers[current]);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, bytes);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		return glGetError() != GL_OUT_OF_MEMORY;
+	}
+
+	GLuint objects() const { return object_buffers[current]; }
+
+	void step(GLStateCache& gl, const ParticleParams& params) {
+		int next = 1 - current;
+		gl.use_program(program);
+		gl.uniform1f(u_dt, params.dt);
+		gl.uniform3fv(u_attractor, params.attractor);
+		gl.uniform1f(u_attraction, params.attraction);
+		gl.uniform1f(u_drag, params.drag);
+		gl.uniform1f(u_bound, params.bound);
+		gl.uniform1f(u_restitution, params.restitution);
+		if (compute) {
+			gl.uniform1ui(u_numParticles, (GLuint)count);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, object_buffers[current]);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, velocity_buffers[current]);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, object_buffers[next]);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, velocity_buffers[next]);
+			glDispatchCompute((GLuint)(count + 255) / 256, 1, 1);
+			// the next step, the paths' reads (ssbo, attribute, buffer texture) and copies out
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT
+				| GL_BUFFER_UPDATE_BARRIER_BIT);
+		}
+		else {
+			gl.bind_vertex_array(vaos[current]);
+			glEnable(GL_RASTERIZER_DISCARD);
+			glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, object_buffers[next]);
+			glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 1, velocity_buffers[next]);
+			glBeginTransformFeedback(GL_POINTS);
+			glDrawArrays(GL_POINTS, 0, count);
+			glEndTransformFeedback();
+			glDisable(GL_RASTERIZER_DISCARD);
+			glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+			glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 1, 0);
+		}
+		gl.current.draws++;
+		current = next;
 	}
-	Icosphere(float _scale, int _recursion_level, glm::vec3 _center) : scale(_scale), recursion_level(_recursion_level), center(_center) {
-		index = 0;
+
+	// particles.glsl on the cpu, what the swarm would cost without the gpu (before the upload)
+	static void step_cpu(std::vector<glm::vec4>& objects, std::vector<glm::vec4>& velocities, const ParticleParams& params, ThreadPool& pool) {
+		pool.parallel_for(0, objects.size(), 4096, [&](size_t b, size_t e) {
+			for (size_t i = b; i < e; i++) {
+				glm::vec3 p = glm::vec3(objects[i]), v = glm::vec3(velocities[i]);
+				glm::vec3 to = params.attractor - p;
+				v += (to * (params.attraction / std::max(glm::length(to), 1.f)) - v * params.drag) * params.dt;
+				p += v * params.dt;
+				float limit = params.bound - objects[i].w;
+				for (int k = 0; k < 3; k++) {
+					if (p[k] < -limit) {
+						p[k] = -limit;
+						if (v[k] < 0.f)
+							v[k] = -v[k] * params.restitution;
+					}
+					else if (p[k] > limit) {
+						p[k] = limit;
+						if (v[k] > 0.f)
+							v[k] = -v[k] * params.restitution;
+					}
+				}
+				objects[i] = glm::vec4(p, objects[i].w);
+				velocities[i] = glm::vec4(v, 0.f);
+			}
+		});
 	}
-	
-	void generate_icosphere() {
-		// adding the vertices
-		{
-			add_vertex(glm::vec3(-X, N, Z));
-			add_vertex(glm::vec3(X, N, Z));
-			add_vertex(glm::vec3(-X, N, -Z));
-			add_vertex(glm::vec3(X, N, -Z));
-
-			add_vertex(glm::vec3(N, Z, X));
-			add_vertex(glm::vec3(N, Z, -X));
-			add_vertex(glm::vec3(N, -Z, X));
-			add_vertex(glm::vec3(N, -Z, -X));
-
-			add_vertex(glm::vec3(Z, X, N));
-			add_vertex(glm::vec3(-Z, X, N));
-			add_vertex(glm::vec3(Z, -X, N));
-			add_vertex(glm::vec3(-Z, -X, N));
-		}
-		std::vector<glm::vec3> temp_elems;
-		// adding the faces
-		{
-			temp_elems.push_back(glm::vec3(0, 4, 1));
-			temp_elems.push_back(glm::vec3(0, 9, 4));
-			temp_elems.push_back(glm::vec3(9, 5, 4));
-			temp_elems.push_back(glm::vec3(4, 5, 8));
-			temp_elems.push_back(glm::vec3(4, 8, 1));
-
-			temp_elems.push_back(glm::vec3(8, 10, 1));
-			temp_elems.push_back(glm::vec3(8, 3, 10));
-			temp_elems.push_back(glm::vec3(5, 3, 8));
-			temp_elems.push_back(glm::vec3(5, 2, 3));
-			temp_elems.push_back(glm::vec3(2, 7, 3));
-
-			temp_elems.push_back(glm::vec3(7, 10, 3));
-			temp_elems.push_back(glm::vec3(7, 6, 10));
-			temp_elems.push_back(glm::vec3(7, 11, 6));
-			temp_elems.push_back(glm::vec3(11, 0, 6));
-			temp_elems.push_back(glm::vec3(0, 1, 6));
-
-			temp_elems.push_back(glm::vec3(6, 1, 10));
-			temp_elems.push_back(glm::vec3(9, 0, 11));
-			temp_elems.push_back(glm::vec3(9, 11, 2));
-			temp_elems.push_back(glm::vec3(9, 2, 5));
-			temp_elems.push_back(glm::vec3(7, 2, 11));
+
+	// a swarm that starts out circling the attractor: each sphere gets a speed across the line to it
+	static void orbit_velocities(const std::vector<glm::vec4>& objects, const glm::vec3& attractor, float attraction, std::vector<glm::vec4>& velocities) {
+		velocities.resize(objects.size());
+		for (size_t i = 0; i < objects.size(); i++) {
+			glm::vec3 to = attractor - glm::vec3(objects[i]);
+			float distance = glm::length(to);
+			glm::vec3 across = glm::cross(to, glm::vec3(0.f, 1.f, 0.f));
+			if (glm::dot(across, across) < 1e-6f)
+				across = glm::vec3(1.f, 0.f, 0.f);
+			// circular speed for the constant pull, a bit of random spread so it doesn't stay a disc
+			float speed = std::sqrt(attraction * std::max(distance, 1.f)) * (0.6f + 0.4f * rand() / (float)RAND_MAX);
+			velocities[i] = glm::vec4(glm::normalize(across) * speed, 0.f);
 		}
+	}
+};
 
-		for (int i = 0; i < recursion_level; i++) {
-			std::vector<glm::vec3> temp_elems2;
-			for (glm::vec3 face : temp_elems) {
-				glm::vec3 v1 = icosphere_vertices[face.x].position;
-				glm::vec3 v2 = icosphere_vertices[face.y].position;
-				glm::vec3 v3 = icosphere_vertices[face.z].position;
-				int a = lookup(v1,v2);
-				int b = lookup(v2,v3);
-				int c = lookup(v3,v1);
-				temp_elems2.push_back(glm::vec3(face.x, a, c));
-				temp_elems2.push_back(glm::vec3(face.y, b, a));
-				temp_elems2.push_back(glm::vec3(face.z, c, b));
-				temp_elems2.push_back(glm::vec3(a, b, c));
-			}
-			temp_elems = temp_elems2;
+// frustum planes (xyz = normal pointing inwards, w = distance) out of p * v
+// ref: Gribb & Hartmann, "Fast Extraction of Viewing Frustum Planes from the World-View-Projection Matrix"
+void extract_frustum(const glm::mat4& pv, glm::vec4 planes[6]) {
+	glm::vec4 row0(pv[0][0], pv[1][0], pv[2][0], pv[3][0]);
+	glm::vec4 row1(pv[0][1], pv[1][1], pv[2][1], pv[3][1]);
+	glm::vec4 row2(pv[0][2], pv[1][2], pv[2][2], pv[3][2]);
+	glm::vec4 row3(pv[0][3], pv[1][3], pv[2][3], pv[3][3]);
+	planes[0] = row3 + row0; // left
+	planes[1] = row3 - row0; // right
+	planes[2] = row3 + row1; // bottom
+	planes[3] = row3 - row1; // top
+	planes[4] = row3 + row2; // near
+	planes[5] = row3 - row2; // far
+	for (int i = 0; i < 6; i++)
+		planes[i] /= glm::length(glm::vec3(planes[i]));
+}
+
+// directions of an nx * ny grid of rays from the eye through [ndc_min, ndc_max] of the screen, row by row
+void camera_rays(const glm::mat4& pv, const glm::vec3& eye, glm::vec2 ndc_min, glm::vec2 ndc_max, int nx, int ny, std::vector<glm::vec3>& dirs) {
+	glm::mat4 inv = glm::inverse(pv);
+	dirs.clear();
+	for (int y = 0; y < ny; y++) {
+		for (int x = 0; x < nx; x++) {
+			glm::vec2 ndc = ndc_min + (ndc_max - ndc_min) * glm::vec2((x + 0.5f) / nx, (y + 0.5f) / ny);
+			glm::vec4 far_point = inv * glm::vec4(ndc.x, ndc.y, 1.f, 1.f);
+			dirs.push_back(glm::normalize(glm::vec3(far_point) / far_point.w - eye));
 		}
-		for (glm::vec3 elems : temp_elems) {
-			icosphere_vertices[elems.x].set_normal(icosphere_vertices[elems.y].position, icosphere_vertices[elems.z].position);
-			icosphere_vertices[elems.y].set_normal(icosphere_vertices[elems.z].position, icosphere_vertices[elems.x].position);
-			icosphere_vertices[elems.z].set_normal(icosphere_vertices[elems.x].position, icosphere_vertices[elems.y].position);
-			icosphere_triangle_elements.push_back(elems.x);
-			icosphere_triangle_elements.push_back(elems.y);
-			icosphere_triangle_elements.push_back(elems.z);
+	}
+}
+
+// --bench-bvh: build, refit and query times over random spheres, no window needed
+void benchmark_bvh(GLuint count) {
+	typedef std::chrono::high_resolution_clock Clock;
+	auto ms_since = [](Clock::time_point start) {
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	};
+	// same density as NUM_RANDOM_OBJS spread over 100^3 with 10k spheres
+	float half = 50.f * std::cbrt(count / 10000.f);
+	std::vector<glm::vec4> spheres(count);
+	for (glm::vec4& s : spheres)
+		s = glm::vec4((rand() / (float)RAND_MAX * 2.f - 1.f) * half, (rand() / (float)RAND_MAX * 2.f - 1.f) * half,
+			(rand() / (float)RAND_MAX * 2.f - 1.f) * half, 0.1f + (rand() % 100) * 0.01f);
+	std::cout << "bvh benchmark, " << count << " spheres, " << thread_pool.size() << " threads" << std::endl;
+
+	BVH bvh;
+	Clock::time_point start = Clock::now();
+	bvh.build(spheres, NULL);
+	double serial_ms = ms_since(start);
+	float built_cost = bvh.sah_cost();
+	start = Clock::now();
+	bvh.build(spheres, &thread_pool);
+	double parallel_ms = ms_since(start);
+	std::cout << "  build: " << serial_ms << " ms serial, " << parallel_ms << " ms parallel; " << bvh.node_count << " nodes ("
+		<< bvh.node_count * sizeof(BVH::Node) / 1048576.0 << " MB), " << bvh.levels.size() << " levels, sah cost " << bvh.sah_cost() << std::endl;
+
+	// everything jitters a bit: full refit
+	for (glm::vec4& s : spheres)
+		s += glm::vec4(rand() / (float)RAND_MAX - 0.5f, rand() / (float)RAND_MAX - 0.5f, rand() / (float)RAND_MAX - 0.5f, 0.f);
+	start = Clock::now();
+	bvh.refit(spheres.data(), NULL);
+	double refit_serial_ms = ms_since(start);
+	start = Clock::now();
+	bvh.refit(spheres.data(), &thread_pool);
+	std::cout << "  full refit: " << refit_serial_ms << " ms serial, " << ms_since(start) << " ms parallel, sah cost "
+		<< built_cost << " -> " << bvh.sah_cost() << std::endl;
+
+	// 1% moves: incremental refit
+	std::vector<GLuint> moved;
+	for (GLuint i = 0; i < count / 100; i++) {
+		GLuint o = (GLuint)(((unsigned long long)rand() * RAND_MAX + rand()) % count);
+		spheres[o] += glm::vec4(1.f, 0.f, 0.f, 0.f);
+		moved.push_back(o);
+	}
+	start = Clock::now();
+	bvh.refit(spheres.data(), moved, &thread_pool);
+	std::cout << "  incremental refit of " << moved.size() << " objects: " << ms_since(start) << " ms" << std::endl;
+
+	glm::mat4 pv = glm::perspective(glm::radians(45.f), 1.f, NEAR_PLANE, FAR_PLANE)
+		* glm::lookAt(glm::vec3(0.f), glm::vec3(0.f, 0.f, -1.f), glm::vec3(0.f, 1.f, 0.f));
+	glm::vec4 planes[6];
+	extract_frustum(pv, planes);
+	std::vector<GLuint> visible;
+	start = Clock::now();
+	bvh.frustum_query(spheres.data(), planes, visible);
+	double query_ms = ms_since(start);
+	GLuint linear = 0;
+	start = Clock::now();
+	for (const glm::vec4& s : spheres) {
+		bool inside = true;
+		for (int p = 0; p < 6 && inside; p++)
+			inside = glm::dot(glm::vec3(planes[p]), glm::vec3(s)) + planes[p].w >= -s.w;
+		linear += inside;
+	}
+	std::cout << "  frustum query: " << visible.size() << " visible in " << query_ms << " ms (linear scan " << linear
+		<< " in " << ms_since(start) << " ms)" << std::endl;
+
+	// crosshair picks from random spots in random directions, the first few checked against every sphere
+	const int PICKS = 10000, CHECKED = 20;
+	std::vector<glm::vec3> origins(PICKS), dirs(PICKS);
+	for (int i = 0; i < PICKS; i++) {
+		origins[i] = glm::vec3(rand() / (float)RAND_MAX * 2.f - 1.f, rand() / (float)RAND_MAX * 2.f - 1.f, rand() / (float)RAND_MAX * 2.f - 1.f) * half;
+		dirs[i] = glm::normalize(glm::vec3(rand() / (float)RAND_MAX - 0.5f, rand() / (float)RAND_MAX - 0.5f, rand() / (float)RAND_MAX - 0.5f) + 1e-4f);
+	}
+	std::vector<PickHit> hits(PICKS);
+	start = Clock::now();
+	for (int i = 0; i < PICKS; i++)
+		hits[i] = bvh.pick(spheres.data(), origins[i], dirs[i]);
+	double pick_us = ms_since(start) * 1000.0 / PICKS;
+	int hit_count = 0, mismatches = 0;
+	for (int i = 0; i < PICKS; i++)
+		hit_count += hits[i].object >= 0;
+	for (int i = 0; i < CHECKED; i++) {
+		GLint nearest = -1;
+		float nearest_t = FLT_MAX, t;
+		for (GLuint o = 0; o < count; o++) {
+			if (BVH::ray_sphere(spheres[o], origins[i], dirs[i], t) && t < nearest_t) {
+				nearest_t = t;
+				nearest = o;
+			}
 		}
+		mismatches += nearest != hits[i].object;
 	}
+	std::cout << "  pick: " << pick_us << " us/ray, " << hit_count << "/" << PICKS << " hit, " << mismatches << "/" << CHECKED
+		<< " differ from a linear scan" << std::endl;
+
+	// a 64x64 selection rectangle, one ray at a time and in packets of four
+	std::vector<glm::vec3> rect_dirs;
+	camera_rays(pv, glm::vec3(0.f), glm::vec2(-0.25f), glm::vec2(0.25f), 64, 64, rect_dirs);
+	std::vector<glm::vec3> rect_origins(rect_dirs.size(), glm::vec3(0.f));
+	std::vector<PickHit> single(rect_dirs.size()), packet(rect_dirs.size());
+	start = Clock::now();
+	for (size_t i = 0; i < rect_dirs.size(); i++)
+		single[i] = bvh.pick(spheres.data(), rect_origins[i], rect_dirs[i]);
+	double single_ms = ms_since(start);
+	start = Clock::now();
+	bvh.pick(spheres.data(), rect_origins.data(), rect_dirs.data(), rect_dirs.size(), packet.data());
+	double packet_ms = ms_since(start);
+	mismatches = 0;
+	for (size_t i = 0; i < rect_dirs.size(); i++)
+		mismatches += single[i].object != packet[i].object;
+	std::cout << "  selection rectangle, " << rect_dirs.size() << " rays: " << single_ms << " ms one by one, " << packet_ms
+		<< " ms in packets (" << mismatches << " differ)" << std::endl;
+}
 
-	int add_vertex(glm::vec3 p) {
-		Vertex to_insert;
-		to_insert.position = glm::normalize(p);
-		icosphere_vertices.push_back(to_insert);
-		icosphere_vertices_lookup_table.insert({ glm::normalize(p), index });
-		return index++;
+// --bench-physics: the same random spheres as --bench-bvh dropped for a second, time per substep
+void benchmark_physics(GLuint count) {
+	float half = 50.f * std::cbrt(count / 10000.f);
+	std::vector<glm::vec4> spheres(count);
+	for (glm::vec4& s : spheres)
+		s = glm::vec4((rand() / (float)RAND_MAX * 2.f - 1.f) * half, (rand() / (float)RAND_MAX * 2.f - 1.f) * half,
+			(rand() / (float)RAND_MAX * 2.f - 1.f) * half, 0.1f + (rand() % 100) * 0.01f);
+	std::cout << "physics benchmark, " << count << " spheres, " << thread_pool.size() << " threads" << std::endl;
+
+	SpherePhysics physics;
+	physics.reset(spheres);
+	const int STEPS = (int)(1.f / PHYSICS_STEP);
+	for (int second = 0; second < 2; second++) {
+		double integrate_ms = 0, hash_ms = 0, narrow_ms = 0;
+		size_t contacts = 0;
+		for (int i = 0; i < STEPS; i++) {
+			physics.advance(PHYSICS_STEP, thread_pool);
+			integrate_ms += physics.integrate_ms;
+			hash_ms += physics.hash_ms;
+			narrow_ms += physics.narrow_ms;
+			contacts += physics.contacts;
+		}
+		std::cout << "  second " << second + 1 << ": " << (integrate_ms + hash_ms + narrow_ms) / STEPS << " ms/substep (integrate "
+			<< integrate_ms / STEPS << ", hash " << hash_ms / STEPS << ", narrowphase " << narrow_ms / STEPS << "), "
+			<< contacts / 2 / STEPS << " contacts/substep" << std::endl;
 	}
+	std::cout << "  spheres in a " << 2.f * physics.bound << " box, table " << physics.table_mask + 1 << " buckets, cells "
+		<< physics.cell_size << " wide" << std::endl;
+}
 
-	int lookup(glm::vec3 p1, glm::vec3 p2) {
-		// O(1), using unordered_map (hash table) - bigger space tho
-		long long i1 = icosphere_vertices_lookup_table[p1];
-		long long i2 = icosphere_vertices_lookup_table[p2];
-		long long l = (i1 < i2 ? i1 : i2);
-		long long r = (i1 < i2 ? i2 : i1);
-		long long key = (l << 32) + r;
+// --bench-nbody: the same random spheres as --bench-bvh collapsing for a second, time per step, then the
+// force error against a direct sum over every body for a few opening angles
+void benchmark_nbody(GLuint count) {
+	float half = 50.f * std::cbrt(count / 10000.f);
+	std::vector<glm::vec4> spheres(count);
+	for (glm::vec4& s : spheres)
+		s = glm::vec4((rand() / (float)RAND_MAX * 2.f - 1.f) * half, (rand() / (float)RAND_MAX * 2.f - 1.f) * half,
+			(rand() / (float)RAND_MAX * 2.f - 1.f) * half, 0.1f + (rand() % 100) * 0.01f);
+	std::cout << "n-body benchmark, " << count << " bodies, " << thread_pool.size() << " threads" << std::endl;
 
-		if (cache.find(key) != cache.end()) {
-			return cache[key];
+	NBody nbody;
+	nbody.reset(spheres);
+	const int STEPS = (int)(1.f / NBODY_STEP);
+	for (int second = 0; second < 2; second++) {
+		double sort_ms = 0, build_ms = 0, force_ms = 0;
+		for (int i = 0; i < STEPS; i++) {
+			nbody.advance(NBODY_STEP, thread_pool);
+			sort_ms += nbody.sort_ms;
+			build_ms += nbody.build_ms;
+			force_ms += nbody.force_ms;
 		}
+		std::cout << "  second " << second + 1 << ": " << (sort_ms + build_ms + force_ms) / STEPS << " ms/step (sort " << sort_ms / STEPS
+			<< ", tree " << build_ms / STEPS << ", forces " << force_ms / STEPS << "), " << nbody.nodes.size() << " nodes in "
+			<< nbody.level_start.size() - 1 << " levels, energy drift " << 100.0 * (nbody.energy - nbody.initial_energy) / std::abs(nbody.initial_energy) << "%" << std::endl;
+	}
 
-		glm::vec3 mid = glm::vec3((p1.x + p2.x) / 2.0f, (p1.y + p2.y) / 2.0f, (p1.z + p2.z) / 2.0f);
-		int i = add_vertex(mid);
-		cache.insert({ key,i });
-		return i;
-		//
+	const size_t SAMPLES = 256;
+	std::vector<glm::vec3> exact(SAMPLES);
+	thread_pool.parallel_for(0, SAMPLES, 1, [&](size_t b, size_t e) {
+		for (size_t k = b; k < e; k++) {
+			size_t i = k * nbody.size() / SAMPLES;
+			glm::dvec3 a(0.0);
+			for (size_t j = 0; j < nbody.size(); j++) {
+				if (j == i)
+					continue;
+				glm::dvec3 d(nbody.px[j] - nbody.px[i], nbody.py[j] - nbody.py[i], nbody.pz[j] - nbody.pz[i]);
+				double inv = 1.0 / std::sqrt(glm::dot(d, d) + NBODY_SOFTENING * NBODY_SOFTENING);
+				a += d * (nbody.mass[j] * inv * inv * inv);
+			}
+			exact[k] = glm::vec3(a * (double)NBODY_G);
+		}
+	});
+	for (float theta : { 0.3f, 0.5f, 0.8f }) {
+		nbody.theta = theta;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		nbody.forces(&thread_pool);
+		double force_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		double error = 0.0;
+		for (size_t k = 0; k < SAMPLES; k++) {
+			size_t i = k * nbody.size() / SAMPLES;
+			error += glm::length(glm::vec3(nbody.ax[i], nbody.ay[i], nbody.az[i]) - exact[k]) / std::max(glm::length(exact[k]), 1e-12f);
+		}
+		std::cout << "  theta " << theta << ": forces " << force_ms << " ms, mean relative error " << 100.0 * error / SAMPLES << "%" << std::endl;
 	}
+}
 
-};
+// --bench-particles: the swarm stepped on the cpu (plus the upload the paths would need to see it) against
+// the gpu, with transform feedback and, with 4.3, compute; from 100k spheres up by 10x. needs the window's context
+void benchmark_particles(GLuint max_count) {
+	typedef std::chrono::high_resolution_clock Clock;
+	auto ms_since = [](Clock::time_point start) {
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	};
+	const int STEPS = 20;
+	std::cout << "particle benchmark, " << thread_pool.size() << " cpu threads, " << STEPS << " steps" << std::endl;
+	GpuParticles particles[2];
+	particles[0].init(false);
+	if (GLAD_GL_VERSION_4_3)
+		particles[1].init(true);
+	GpuTimer timer;
+	timer.init();
+	for (GLuint count = 100000; count <= max_count; count *= 10) {
+		// same density as --bench-bvh
+		float half = 50.f * std::cbrt(count / 10000.f);
+		std::vector<glm::vec4> spheres(count);
+		for (glm::vec4& s : spheres)
+			s = glm::vec4((rand() / (float)RAND_MAX * 2.f - 1.f) * half, (rand() / (float)RAND_MAX * 2.f - 1.f) * half,
+				(rand() / (float)RAND_MAX * 2.f - 1.f) * half, 0.1f + (rand() % 100) * 0.01f);
+		std::vector<glm::vec4> velocities;
+		GpuParticles::orbit_velocities(spheres, glm::vec3(0.f), PARTICLE_ATTRACTION, velocities);
+		ParticleParams params = { PHYSICS_STEP, glm::vec3(0.f), PARTICLE_ATTRACTION, PARTICLE_DRAG, bounding_cube(spheres), PHYSICS_RESTITUTION };
+		GLuint buffer;
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec4) * count, spheres.data(), GL_STREAM_DRAW);
+		if (glGetError() == GL_OUT_OF_MEMORY) {
+			std::cout << "  " << count << " spheres: out of memory" << std::endl;
+			glDeleteBuffers(1, &buffer);
+			break;
+		}
+
+		// cpu: step, then the new positions into the buffer the paths read
+		std::vector<glm::vec4> cpu_objects = spheres, cpu_velocities = velocities;
+		GpuParticles::step_cpu(cpu_objects, cpu_velocities, params, thread_pool);
+		double step_ms = 0, upload_ms = 0;
+		for (int i = 0; i < STEPS; i++) {
+			Clock::time_point start = Clock::now();
+			GpuParticles::step_cpu(cpu_objects, cpu_velocities, params, thread_pool);
+			step_ms += ms_since(start);
+			start = Clock::now();
+			glm::vec4* mapped = (glm::vec4*)glMapBufferRange(GL_ARRAY_BUFFER, 0, sizeof(glm::vec4) * count, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+			memcpy(mapped, cpu_objects.data(), sizeof(glm::vec4) * count);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+			upload_ms += ms_since(start);
+		}
+		Clock::time_point start = Clock::now();
+		glFinish();
+		upload_ms += ms_since(start);
+		std::cout << "  " << count << " spheres: cpu " << step_ms / STEPS << " ms/step + " << upload_ms / STEPS << " ms upload" << std::endl;
+
+		// gpu: starts from the same spheres, the first step isn't timed (neither was the cpu's)
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec4) * count, spheres.data(), GL_STREAM_DRAW);
+		for (int mode = 0; mode < 2; mode++) {
+			GpuParticles& gpu = particles[mode];
+			if (gpu.program == 0)
+				continue;
+			if (!gpu.reset(buffer, velocities)) {
+				std::cout << "    " << (gpu.compute ? "compute" : "transform feedback") << ": out of memory" << std::endl;
+				continue;
+			}
+			gpu.step(gl_state, params);
+			glFinish();
+			double submit_ms = 0, gpu_ms = 0, ms;
+			int timed = 0;
+			start = Clock::now();
+			for (int i = 0; i < STEPS; i++) {
+				Clock::time_point submit = Clock::now();
+				timer.begin();
+				gpu.step(gl_state, params);
+				timer.end();
+				submit_ms += ms_since(submit);
+				glFinish();
+				if (timer.poll(ms)) {
+					gpu_ms += ms;
+					timed++;
+				}
+			}
+			double wall_ms = ms_since(start);
+			// both did the same steps, they should only differ by rounding
+			std::vector<glm::vec4> result(count);
+			glBindBuffer(GL_COPY_READ_BUFFER, gpu.objects());
+			glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(glm::vec4) * count, result.data());
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+			float difference = 0.f;
+			for (GLuint i = 0; i < count; i++)
+				difference = std::max(difference, glm::length(glm::vec3(result[i]) - glm::vec3(cpu_objects[i])));
+			std::cout << "    " << (gpu.compute ? "compute" : "transform feedback") << ": " << gpu_ms / std::max(timed, 1) << " ms/step on the gpu ("
+				<< submit_ms / STEPS << " ms to submit, " << wall_ms / STEPS << " ms wall), largest difference from the cpu " << difference << std::endl;
+			// frees this size's buffers before the next one allocates
+			gpu.reset(buffer, std::vector<glm::vec4>());
+		}
+		glDeleteBuffers(1, &buffer);
+	}
+	timer.release();
+	for (GpuParticles& gpu : particles)
+		if (gpu.program != 0)
+			gpu.release();
+}
 
 const GLfloat lbs = 0.5f;
 
+// indexed cube, 8 corners
 glm::vec3 LightBox[] = {
 	glm::vec3(-lbs, -lbs, -lbs),
 	glm::vec3( lbs, -lbs, -lbs),
 	glm::vec3( lbs,  lbs, -lbs),
-	glm::vec3( lbs,  lbs, -lbs),
-	glm::vec3(-lbs,  lbs, -lbs),
-	glm::vec3(-lbs, -lbs, -lbs),
-
-	glm::vec3(-lbs, -lbs,  lbs),
-	glm::vec3(lbs, -lbs,  lbs),
-	glm::vec3(lbs,  lbs,  lbs),
-	glm::vec3(lbs,  lbs,  lbs),
-	glm::vec3(-lbs,  lbs,  lbs),
-	glm::vec3(-lbs, -lbs,  lbs),
-
-	glm::vec3(-lbs,  lbs,  lbs),
 	glm::vec3(-lbs,  lbs, -lbs),
-	glm::vec3(-lbs, -lbs, -lbs),
-	glm::vec3(-lbs, -lbs, -lbs),
 	glm::vec3(-lbs, -lbs,  lbs),
-	glm::vec3(-lbs,  lbs,  lbs),
-
-	glm::vec3(lbs,  lbs,  lbs),
-	glm::vec3(lbs,  lbs, -lbs),
-	glm::vec3(lbs, -lbs, -lbs),
-	glm::vec3(lbs, -lbs, -lbs),
-	glm::vec3(lbs, -lbs,  lbs),
-	glm::vec3(lbs,  lbs,  lbs),
+	glm::vec3( lbs, -lbs,  lbs),
+	glm::vec3( lbs,  lbs,  lbs),
+	glm::vec3(-lbs,  lbs,  lbs)
+};
 
-	glm::vec3(-lbs, -lbs, -lbs),
-	glm::vec3(lbs, -lbs, -lbs),
-	glm::vec3(lbs, -lbs,  lbs),
-	glm::vec3(lbs, -lbs,  lbs),
-	glm::vec3(-lbs, -lbs,  lbs),
-	glm::vec3(-lbs, -lbs, -lbs),
+GLuint LightBoxElements[] = {
+	0, 1, 2, 2, 3, 0, // back
+	4, 5, 6, 6, 7, 4, // front
+	7, 3, 0, 0, 4, 7, // left
+	6, 2, 1, 1, 5, 6, // right
+	0, 1, 5, 5, 4, 0, // bottom
+	3, 2, 6, 6, 7, 3  // top
+};
 
-	glm::vec3(-lbs,  lbs, -lbs),
-	glm::vec3(lbs,  lbs, -lbs),
-	glm::vec3(lbs,  lbs,  lbs),
-	glm::vec3(lbs,  lbs,  lbs),
-	glm::vec3(-lbs,  lbs,  lbs),
-	glm::vec3(-lbs,  lbs, -lbs)
+// per-instance data of the lamp gizmos, matches the attributes of lamp.vsh
+struct LampInstance {
+	glm::vec3 position;
+	float scale;
+	glm::vec4 color;
 };
 
 // globals
@@ -253,24 +5538,122 @@ float lastX = (float) SCR_WIDTH / 2.0;
 float lastY = (float) SCR_HEIGHT / 2.0;
 float fov = 45.0f;
 
-int main() {
+// which pipeline draws the spheres, picked with the number keys
+enum RenderPath {
+	PATH_CLASSIC,		// 1: one draw per object (3.3)
+	PATH_GPU_DRIVEN,	// 2: compute culling + multi-draw indirect (4.3)
+	PATH_TESSELLATION,	// 3: base icosahedron + hardware tessellation (4.0)
+	PATH_PROCEDURAL,	// 4: no mesh at all, vertices rebuilt from gl_VertexID (3.3)
+	PATH_IMPOSTOR,		// 5: ray-cast quads for far spheres, procedural mesh for near ones (3.3)
+	PATH_STREAMING,		// 6: impostors for whatever tiles of a (possibly huge) scene file are resident (3.3)
+	NUM_PATHS
+};
+const char* PATH_NAMES[NUM_PATHS] = { "classic", "gpu-driven", "tessellation", "procedural", "impostor", "streaming" };
+RenderPath render_path = PATH_CLASSIC;
+bool depth_prepass = USE_DEPTH_PREPASS;
+bool sort_front_to_back = SORT_FRONT_TO_BACK;
+bool path_available[NUM_PATHS] = { true, false, false, true, true, true };
+int procedural_level = 4;
+int mesh_level = 4; // what the classic path should be drawing, the mesh catches up once the worker is done
+SphereBase mesh_base = BASE_ICOSAHEDRON; // polyhedron the classic path's mesh is subdivided from (G cycles)
+bool lighting_lod = USE_LIGHTING_LOD;
+float lighting_lod_pixels = VERTEX_LIGHTING_PIXELS;
+bool dynamic_resolution = USE_DYNAMIC_RESOLUTION;
+bool upscale_sharpen = UPSCALE_SHARPNESS > 0.f;
+bool bvh_culling = USE_BVH_CULLING;
+bool select_requested = false; // K: pick everything in the middle of the screen once
+bool hiz_culling = USE_HIZ_CULLING;
+bool displacement = USE_DISPLACEMENT;
+bool displace_cache_on = USE_DISPLACE_CACHE;
+bool command_threads = USE_COMMAND_THREADS;
+bool gl_counters_on = USE_GL_COUNTERS;
+bool displace_paused = false;
+bool physics_on = USE_PHYSICS;
+bool physics_elastic = false;
+bool gpu_particles = USE_GPU_PARTICLES;
+bool nbody_on = USE_NBODY;
+float nbody_theta = NBODY_THETA;
+// framebuffer size of the window, the render target follows it
+int window_width = SCR_WIDTH;
+int window_height = SCR_HEIGHT;
+
+// usage: CS177FinalProject [--scene file.sph]
+//        CS177FinalProject --make-scene file.sph <tiles per axis> <spheres per tile>
+//        CS177FinalProject --bench-bvh [spheres]
+//        CS177FinalProject --bench-physics [spheres]
+//        CS177FinalProject --bench-particles [max spheres]
+//        CS177FinalProject --bench-nbody [spheres]
+//        CS177FinalProject --capture trace.bin [frames] [--scene file.sph]
+//        CS177FinalProject --replay trace.bin [loops]
+//        CS177FinalProject --check-gl-hooks
+int main(int argc, char** argv) {
+	thread_pool.start(std::max(std::thread::hardware_concurrency(), 1u) - 1);
+	const char* scene_path = NULL;
+	GLuint bench_particles = 0;
+	const char* capture_path = NULL;
+	const char* replay_path = NULL;
+	int capture_frames = 100, replay_loops = 10;
+	bool check_hooks = false;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--bench-bvh") == 0) {
+			benchmark_bvh(i + 1 < argc ? (GLuint)atoi(argv[i + 1]) : 1000000u);
+			return 0;
+		}
+		if (strcmp(argv[i], "--bench-particles") == 0)
+			bench_particles = i + 1 < argc ? (GLuint)atoi(argv[i + 1]) : 10000000u;
+		if (strcmp(argv[i], "--bench-physics") == 0) {
+			benchmark_physics(i + 1 < argc ? (GLuint)atoi(argv[i + 1]) : 1000000u);
+			return 0;
+		}
+		if (strcmp(argv[i], "--bench-nbody") == 0) {
+			benchmark_nbody(i + 1 < argc ? (GLuint)atoi(argv[i + 1]) : 1000000u);
+			return 0;
+		}
+		if (strcmp(argv[i], "--make-scene") == 0 && i + 3 < argc) {
+			int tiles = atoi(argv[i + 2]), spheres = atoi(argv[i + 3]);
+			std::cout << "writing " << (long long)tiles * tiles * tiles * std::min(spheres, (int)TILE_CAPACITY) << " spheres to " << argv[i + 1] << std::endl;
+			return generate_scene_file(argv[i + 1], tiles, spheres) ? 0 : -1;
+		}
+		if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+			scene_path = argv[++i];
+		if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+			capture_path = argv[++i];
+			if (i + 1 < argc && atoi(argv[i + 1]) > 0)
+				capture_frames = atoi(argv[++i]);
+		}
+		if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			replay_path = argv[++i];
+			if (i + 1 < argc && atoi(argv[i + 1]) > 0)
+				replay_loops = atoi(argv[++i]);
+		}
+		if (strcmp(argv[i], "--check-gl-hooks") == 0)
+			check_hooks = true;
+	}
+
 	// glfw: initialize and configure
 	// ------------------------------
 	srand(time(NULL));
 	glfwInit();
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	// ask for 4.3 first (compute + multi-draw indirect), fall back to plain 3.3
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
 	// glfw window creation
 	// --------------------
-	GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "CS177 Final Project", NULL, NULL);
+	GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, WINDOW_TITLE, NULL, NULL);
+	if (window == NULL) {
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, WINDOW_TITLE, NULL, NULL);
+	}
 	if (window == NULL) {
 		std::cout << "Failed to create GLFW window" << std::endl;
 		glfwTerminate();
 		return -1;
 	}
 	glfwMakeContextCurrent(window);
+	glfwGetFramebufferSize(window, &window_width, &window_height);
 	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 	glfwSetCursorPosCallback(window, mouse_callback);
 	glfwSetScrollCallback(window, scroll_callback);
@@ -284,6 +5667,18 @@ int main() {
 		std::cout << "Failed to initialize GLAD" << std::endl;
 		return -1;
 	}
+	if (replay_path != NULL) {
+		replay_trace(window, replay_path, replay_loops);
+		glfwTerminate();
+		return 0;
+	}
+	if (check_hooks) {
+		bool ok = check_gl_hooks();
+		glfwTerminate();
+		return ok ? 0 : -1;
+	}
+	if (capture_path != NULL)
+		gl_trace.start(capture_path, capture_frames, TRACE_HOOKS);
 
 	// gl stuff
 	{
@@ -293,43 +5688,78 @@ int main() {
 		glfwSwapInterval(1);
 	}
 
-	GLuint program = loadProgram("sphere.vsh", "sphere.fsh");
+	if (bench_particles > 0) {
+		benchmark_particles(bench_particles);
+		glfwTerminate();
+		return 0;
+	}
+
+	GLuint program = loadShaderProgram("sphere.vsh", "sphere.fsh");
 	GLuint lightbox_shaders = loadProgram("lamp.vsh", "lamp.fsh");
 
-	Icosphere temp(0.1f,4,glm::vec3(0,0,0));
-	temp.generate_icosphere();
-	auto vs = temp.icosphere_vertices;
-	auto va = temp.icosphere_triangle_elements;
+	IcosphereMesh sphere_mesh = Icosphere(0.1f, 4, glm::vec3(0, 0, 0)).generate();
+	float sphere_area_ratio = sphere_mesh.area_ratio();
 
 	// linking vertex attributes
-	GLuint vao, vbo, ebo;
+	// the first mesh is built right here, later ones (N / M, G) come from the asset worker
+	SphereMesh mesh;
 	{
-		glGenVertexArrays(1, &vao);
-		glGenBuffers(1, &vbo);
-		
-		glBindVertexArray(vao);
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * vs.size(), vs.data(), GL_STATIC_DRAW);
-		glGenBuffers(1, &ebo);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * va.size(), va.data(), GL_STATIC_DRAW);
-		glEnableVertexAttribArray(0);
-		glEnableVertexAttribArray(1);
-		glEnableVertexAttribArray(2);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 0);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
-		glVertexAttribPointer(2, 4, GL_FLOAT, GL_TRUE, sizeof(Vertex), (void*)offsetof(Vertex, color));
+		glGenBuffers(1, &mesh.vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * sphere_mesh.vertices.size(), sphere_mesh.vertices.data(), GL_STATIC_DRAW);
+		glGenBuffers(1, &mesh.ebo);
+		glBindBuffer(GL_ARRAY_BUFFER, mesh.ebo);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(GLuint) * sphere_mesh.elements.size(), sphere_mesh.elements.data(), GL_STATIC_DRAW);
+		mesh.vao = make_sphere_vao(mesh.vbo, mesh.ebo);
+		mesh.index_count = (GLsizei)sphere_mesh.elements.size();
+		mesh.vertex_count = (GLsizei)sphere_mesh.vertices.size();
+		mesh.level = sphere_mesh.level;
+		mesh.base = BASE_ICOSAHEDRON;
+		sphere_mesh.release();
+		std::cout << "mesh level " << mesh.level << " (" << SPHERE_BASE_NAMES[mesh.base] << "), " << mesh.index_count / 3
+			<< " triangles, largest / smallest area " << sphere_area_ratio << std::endl;
+		print_subdivision_stages(std::cout, SPHERE_BASE_NAMES[mesh.base], mesh.level, sphere_mesh.stages);
 	}
+	mesh_level = mesh.level;
+	int requested_mesh_level = mesh.level;
+	SphereBase requested_mesh_base = mesh.base;
+	AssetWorker assets;
+	if (!assets.start(window))
+		std::cout << "no shared context for the asset worker, mesh level stays at " << mesh.level << std::endl;
 
-	GLuint vao2, vbo2;
+	// lamp gizmos: one instanced draw for all of them, no matter how many
+	// instance 0 is the point light and gets rewritten every frame, the others don't move
+	std::vector<LampInstance> lamps(1 + NUM_EXTRA_LAMPS);
+	lamps[0].scale = 0.5f;
+	for (int i = 1; i < (int)lamps.size(); i++) {
+		lamps[i].position = glm::vec3(rand() % 2001 - 1000, rand() % 2001 - 1000, rand() % 2001 - 1000) * 0.05f;
+		lamps[i].scale = 0.05f + (rand() % 100) * 0.002f;
+		lamps[i].color = glm::vec4(0.25f + (rand() % 76) * 0.01f, 0.25f + (rand() % 76) * 0.01f, 0.25f + (rand() % 76) * 0.01f, 1.f);
+	}
+
+	GLuint vao2, vbo2, ebo2, lamp_buffer;
 	{
 		glGenVertexArrays(1, &vao2);
 		glGenBuffers(1, &vbo2);
+		glGenBuffers(1, &ebo2);
+		glGenBuffers(1, &lamp_buffer);
 		glBindVertexArray(vao2);
 		glBindBuffer(GL_ARRAY_BUFFER, vbo2);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * 36, LightBox, GL_STATIC_DRAW);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(LightBox), LightBox, GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo2);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(LightBoxElements), LightBoxElements, GL_STATIC_DRAW);
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), 0);
+
+		glBindBuffer(GL_ARRAY_BUFFER, lamp_buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(LampInstance) * lamps.size(), lamps.data(), GL_DYNAMIC_DRAW);
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(LampInstance), 0);
+		glVertexAttribDivisor(1, 1);
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(LampInstance), (void*)offsetof(LampInstance, color));
+		glVertexAttribDivisor(2, 1);
+		glBindVertexArray(0);
 	}
 
 	DirectionalLight world_light;
@@ -364,41 +5794,9 @@ int main() {
 		flashlight.outerCutOff = glm::cos(glm::radians(15.0f));
 	}
 	
-	// vsh
-	auto v_m = glGetUniformLocation(program, "m");
-	auto v_mnormal = glGetUniformLocation(program, "mnormal");
-	auto v_v = glGetUniformLocation(program, "v");
-	auto v_p = glGetUniformLocation(program, "p");
-	auto v_mvp = glGetUniformLocation(program, "mvp");
-	// fsh
-	auto f_lightColor = glGetUniformLocation(program, "lightColor");
-	auto f_viewPos = glGetUniformLocation(program, "viewPos");
-	// directional
-	auto f_dirLight_direction = glGetUniformLocation(program, "dirLight.direction");
-	auto f_dirLight_ambient = glGetUniformLocation(program, "dirLight.ambient");
-	auto f_dirLight_diffuse = glGetUniformLocation(program, "dirLight.diffuse");
-	auto f_dirLight_specular = glGetUniformLocation(program, "dirLight.specular");
-	// point light 1
-	auto f_pointLights0_position = glGetUniformLocation(program, "pointLights[0].position");
-	auto f_pointLights0_ambient = glGetUniformLocation(program, "pointLights[0].ambient");
-	auto f_pointLights0_diffuse = glGetUniformLocation(program, "pointLights[0].diffuse");
-	auto f_pointLights0_specular = glGetUniformLocation(program, "pointLights[0].specular");
-	auto f_pointLights0_constant = glGetUniformLocation(program, "pointLights[0].constant");
-	auto f_pointLights0_linear = glGetUniformLocation(program, "pointLights[0].linear");
-	auto f_pointLights0_quadratic = glGetUniformLocation(program, "pointLights[0].quadratic");
-	// spotlight
-	auto f_spotLight_position = glGetUniformLocation(program, "spotLight.position");
-	auto f_spotLight_direction = glGetUniformLocation(program, "spotLight.direction");
-	auto f_spotLight_ambient = glGetUniformLocation(program, "spotLight.ambient");
-	auto f_spotLight_diffuse = glGetUniformLocation(program, "spotLight.diffuse");
-	auto f_spotLight_specular = glGetUniformLocation(program, "spotLight.specular");
-	auto f_spotLight_constant = glGetUniformLocation(program, "spotLight.constant");
-	auto f_spotLight_linear = glGetUniformLocation(program, "spotLight.linear");
-	auto f_spotLight_quadratic = glGetUniformLocation(program, "spotLight.quadratic");
-	auto f_spotLight_cutOff = glGetUniformLocation(program, "spotLight.cutOff");
-	auto f_spotLight_outerCutOff = glGetUniformLocation(program, "spotLight.outerCutOff");
+	SphereProgram sphere(program);
 	// lamp
-	auto vlbs_mvp = glGetUniformLocation(lightbox_shaders, "mvp");
+	auto vlbs_vp = glGetUniformLocation(lightbox_shaders, "vp");
 
 	GLfloat obj_scales[NUM_OBJS] = {
 		1.0f, 0.5f, 2.0f, 0.35f, 0.69f,
@@ -418,31 +5816,565 @@ int main() {
 		glm::vec3(5,-5,0)
 	};
 
+	// every sphere in the scene, xyz = center, w = radius (the icosphere is a unit sphere, so radius = scale)
+	std::vector<glm::vec4> objects;
+	for (int i = 0; i < NUM_OBJS; i++) {
+		objects.push_back(glm::vec4(obj_loc[i], obj_scales[i]));
+	}
+	for (int i = 0; i < NUM_RANDOM_OBJS; i++) {
+		glm::vec3 c = glm::vec3(rand() % 2001 - 1000, rand() % 2001 - 1000, rand() % 2001 - 1000) * 0.05f;
+		objects.push_back(glm::vec4(c, 0.1f + (rand() % 100) * 0.01f));
+	}
+	// displace.glsl parameters per object: amplitude, frequency, speed, kind (a few are left still)
+	std::vector<glm::vec4> displacements;
+	for (size_t i = 0; i < objects.size(); i++) {
+		float kind = (float)(rand() % 5 == 0 ? 0 : 1 + rand() % 2);
+		displacements.push_back(glm::vec4(0.05f + (rand() % 100) * 0.0015f, 4.f + (rand() % 100) * 0.08f, 0.5f + (rand() % 100) * 0.025f, kind));
+	}
+
+	// spatial index over the same spheres; whatever moves objects lists them in moved_objects for the refit
+	BVH bvh;
+	bvh.build(objects, &thread_pool);
+	BVHRebuilder bvh_rebuilder;
+	std::vector<GLuint> moved_objects;
+	std::vector<GLuint> visible_objects;
+	bool bvh_refitted = false;
+	double bvh_built_at = 0.0;
+	// takes over the objects the first time F is pressed; F again pauses it
+	SpherePhysics physics;
+	// starts over from wherever the spheres are, at rest, every time Y turns it on
+	NBody nbody;
+	bool nbody_running = false;
+
+	// same data on the gpu, used as an ssbo (gpu-driven) or as a per-instance attribute (tessellation)
+	GLuint object_buffer;
+	glGenBuffers(1, &object_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, object_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec4) * objects.size(), objects.data(), GL_STATIC_DRAW);
+	GLuint displace_buffer;
+	glGenBuffers(1, &displace_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, displace_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec4) * displacements.size(), displacements.data(), GL_STATIC_DRAW);
+
+	// gpu particle swarm (J): while it runs the spheres are in its buffers and the paths read those
+	// (instance_buffer). objects gets copies back a few frames late through particle_readback, on every path: the
+	// classic path draws from it, and the crosshair pick and selection (K) query the bvh over it on all of them
+	GpuParticles particles;
+	particles.init(GLAD_GL_VERSION_4_3 != 0);
+	bool particles_running = false;
+	float particle_accumulator = 0.f, particle_bound = 0.f;
+	GLuint instance_buffer = object_buffer, attached_instance_buffer = object_buffer;
+	AsyncReadback particle_readback;
+	particle_readback.init();
+	GpuTimer particle_timer;
+	particle_timer.init();
+
+	// gpu-driven path
+	// objects live in an ssbo, cull.csh does frustum + lod selection and fills one indirect command per lod,
+	// then a single glMultiDrawElementsIndirect draws everything. needs 4.3, otherwise we stay on the loop below
+	bool gpu_capable = USE_GPU_DRIVEN && GLAD_GL_VERSION_4_3;
+	path_available[PATH_GPU_DRIVEN] = gpu_capable;
+	GLuint cull_program = 0, gpu_program = 0;
+	GLuint cull_max_groups = 1; // the dispatch caps at this, cull.csh loops over whatever's past it
+	GLuint vao_gpu = 0, vbo_lods = 0, ebo_lods = 0, visible_buffer = 0, indirect_buffer = 0, indirect_reset_buffer = 0;
+	SphereProgram sphere_gpu;
+	GLint c_numObjects = -1, c_frustum = -1, c_viewPos = -1, c_pixelScale = -1, c_lodPixels = -1;
+	GLint c_hiZ = -1, c_hiZPyramid = -1, c_hiZViewProj = -1, c_hiZViewport = -1, c_hiZLevels = -1, c_nearPlane = -1;
+	// what cull.csh's occlusion test dropped, read back a few frames late
+	GLuint occlusion_buffer = 0;
+	AsyncReadback occlusion_readback;
+	if (gpu_capable) {
+		cull_program = loadComputeProgram("cull.csh");
+		GLint max_groups = 0;
+		glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 0, &max_groups);
+		cull_max_groups = (GLuint)std::max(max_groups, 1);
+		gpu_program = loadShaderProgram("sphere_gpu.vsh", "sphere.fsh");
+		sphere_gpu = SphereProgram(gpu_program);
+		c_numObjects = glGetUniformLocation(cull_program, "numObjects");
+		c_frustum = glGetUniformLocation(cull_program, "frustum");
+		c_viewPos = glGetUniformLocation(cull_program, "viewPos");
+		c_pixelScale = glGetUniformLocation(cull_program, "pixelScale");
+		c_lodPixels = glGetUniformLocation(cull_program, "lodPixels");
+		c_hiZ = glGetUniformLocation(cull_program, "hiZ");
+		c_hiZPyramid = glGetUniformLocation(cull_program, "hiZPyramid");
+		c_hiZViewProj = glGetUniformLocation(cull_program, "hiZViewProj");
+		c_hiZViewport = glGetUniformLocation(cull_program, "hiZViewport");
+		c_hiZLevels = glGetUniformLocation(cull_program, "hiZLevels");
+		c_nearPlane = glGetUniformLocation(cull_program, "nearPlane");
+		glGenBuffers(1, &occlusion_buffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, occlusion_buffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * 2, NULL, GL_DYNAMIC_COPY);
+		occlusion_readback.init();
+
+		// pack every lod into one vbo/ebo so a single vao covers all of them
+		std::vector<Vertex> lod_vertices;
+		std::vector<GLuint> lod_elements;
+		MeshLod lods[NUM_LODS];
+		SubdivisionArena lod_arena;
+		for (int i = 0; i < NUM_LODS; i++) {
+			IcosphereMesh ico = Icosphere(1.f, LOD_LEVELS[i], glm::vec3(0, 0, 0)).generate(lod_arena);
+			lods[i].first_index = (GLuint)lod_elements.size();
+			lods[i].index_count = (GLuint)ico.elements.size();
+			lods[i].base_vertex = (GLint)lod_vertices.size();
+			lod_vertices.insert(lod_vertices.end(), ico.vertices.begin(), ico.vertices.end());
+			lod_elements.insert(lod_elements.end(), ico.elements.begin(), ico.elements.end());
+		}
+		lod_arena.release(); // the lods are built once, nothing reuses it
+
+		// each lod gets room for every object in the visible list, starting at baseInstance
+		DrawElementsIndirectCommand reset[NUM_LODS];
+		for (int i = 0; i < NUM_LODS; i++) {
+			reset[i].count = lods[i].index_count;
+			reset[i].instanceCount = 0;
+			reset[i].firstIndex = lods[i].first_index;
+			reset[i].baseVertex = lods[i].base_vertex;
+			reset[i].baseInstance = (GLuint)(i * objects.size());
+		}
+
+		glGenVertexArrays(1, &vao_gpu);
+		glGenBuffers(1, &vbo_lods);
+		glGenBuffers(1, &ebo_lods);
+		glGenBuffers(1, &visible_buffer);
+		glGenBuffers(1, &indirect_buffer);
+		glGenBuffers(1, &indirect_reset_buffer);
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, visible_buffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * objects.size() * NUM_LODS, NULL, GL_DYNAMIC_COPY);
+		glBindBuffer(GL_COPY_READ_BUFFER, indirect_reset_buffer);
+		glBufferData(GL_COPY_READ_BUFFER, sizeof(reset), reset, GL_STATIC_DRAW);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(reset), reset, GL_DYNAMIC_COPY);
+
+		glBindVertexArray(vao_gpu);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo_lods);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * lod_vertices.size(), lod_vertices.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo_lods);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * lod_elements.size(), lod_elements.data(), GL_STATIC_DRAW);
+		glEnableVertexAttribArray(0);
+		glEnableVertexAttribArray(1);
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 0);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+		glVertexAttribPointer(2, 4, GL_FLOAT, GL_TRUE, sizeof(Vertex), (void*)offsetof(Vertex, color));
+		// per-instance object index, offset by each command's baseInstance
+		glBindBuffer(GL_ARRAY_BUFFER, visible_buffer);
+		glEnableVertexAttribArray(3);
+		glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(GLuint), 0);
+		glVertexAttribDivisor(3, 1);
+		glBindVertexArray(0);
+	}
+
+	// tessellation path
+	// only the 20 faces of the base icosahedron get uploaded, sphere.tcsh picks the detail per edge from its size on screen
+	bool tess_capable = GLAD_GL_VERSION_4_0;
+	path_available[PATH_TESSELLATION] = tess_capable;
+	GLuint tess_program = 0;
+	GLuint vao_tess = 0, vbo_tess = 0, ebo_tess = 0;
+	SphereProgram sphere_tess;
+	GLint t_pixelScale = -1, t_tessPixels = -1;
+	GLsizei tess_index_count = 0;
+	if (tess_capable) {
+		tess_program = loadTessProgram("sphere_tess.vsh", "sphere.tcsh", "sphere.tesh", "sphere.fsh");
+		sphere_tess = SphereProgram(tess_program);
+		t_pixelScale = glGetUniformLocation(tess_program, "pixelScale");
+		t_tessPixels = glGetUniformLocation(tess_program, "tessPixels");
+
+		IcosphereMesh base = Icosphere(1.f, 0, glm::vec3(0, 0, 0)).generate();
+		tess_index_count = (GLsizei)base.elements.size();
+
+		glGenVertexArrays(1, &vao_tess);
+		glGenBuffers(1, &vbo_tess);
+		glGenBuffers(1, &ebo_tess);
+		glBindVertexArray(vao_tess);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo_tess);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * base.vertices.size(), base.vertices.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo_tess);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * tess_index_count, base.elements.data(), GL_STATIC_DRAW);
+		glEnableVertexAttribArray(0);
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 0);
+		glVertexAttribPointer(2, 4, GL_FLOAT, GL_TRUE, sizeof(Vertex), (void*)offsetof(Vertex, color));
+		glBindBuffer(GL_ARRAY_BUFFER, object_buffer);
+		glEnableVertexAttribArray(3);
+		glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), 0);
+		glVertexAttribDivisor(3, 1);
+		glBindVertexArray(0);
+		glPatchParameteri(GL_PATCH_VERTICES, 3);
+	}
+
+	// buffer-free path
+	// the objects are read through a buffer texture so the vao can stay empty
+	GLuint procedural_program = loadShaderProgram("sphere_procedural.vsh", "sphere.fsh");
+	SphereProgram sphere_procedural(procedural_program);
+	GLint pr_level = glGetUniformLocation(procedural_program, "level");
+	GLint pr_objects = glGetUniformLocation(procedural_program, "objects");
+	GLint pr_maxDistance = glGetUniformLocation(procedural_program, "maxDistance");
+	GLuint vao_empty, object_texture;
+	glGenVertexArrays(1, &vao_empty);
+	glGenTextures(1, &object_texture);
+	glBindTexture(GL_TEXTURE_BUFFER, object_texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, object_buffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+	// impostor path
+	// far spheres are one quad each, ray-cast in impostor.fsh with exact depth, so they mix with the
+	// near ones that still go through the procedural mesh
+	GLuint impostor_program = loadShaderProgram("impostor.vsh", "impostor.fsh");
+	SphereProgram sphere_impostor(impostor_program);
+	GLint im_minDistance = glGetUniformLocation(impostor_program, "minDistance");
+	GLint im_objects = glGetUniformLocation(impostor_program, "objects");
+
+	// depth pre-pass + front-to-back order for the classic path
+	GLuint depth_program = loadShaderProgram("depth.vsh", "depth.fsh");
+	GLint d_mvp = glGetUniformLocation(depth_program, "mvp");
+	GLint d_displace = glGetUniformLocation(depth_program, "displace");
+	GLint d_displaceTime = glGetUniformLocation(depth_program, "displaceTime");
+	// displaced meshes captured once per object, drawn by every pass after that
+	GLuint capture_program = loadFeedbackProgram("displace_capture.vsh", { "tf_pos", "tf_normal", "tf_color" });
+	GLint dc_displace = glGetUniformLocation(capture_program, "displace");
+	GLint dc_displaceTime = glGetUniformLocation(capture_program, "displaceTime");
+	DisplacementCache displace_cache;
+	displace_cache.reset(mesh, objects.size(), DISPLACE_CACHE_MB << 20);
+	// the animation clock, stands still while paused
+	float displace_time = 0.f;
+	RenderQueue queue;
+	// the classic path's draws are recorded on the pool; meanwhile the gl thread swaps the previous frame,
+	// which waits until then so the driver's work on it overlaps this frame's recording
+	CommandRecorder recorder;
+	std::vector<GLuint> draw_objects;
+	std::vector<int> draw_slots; // displacement cache slot per drawn object, -1 for none
+	bool swap_pending = false;
+	// samples passed in the depth pass and in the shading pass, read back a frame late so we never stall on them
+	// 0: depth pass, 1: per-pixel lit, 2: per-vertex lit
+	GLuint overdraw_queries[3];
+	glGenQueries(3, overdraw_queries);
+	bool overdraw_issued[3] = { false, false, false };
+	bool overdraw_pending = false;
+
+	// lighting lod: sphere_gouraud runs the same lighting.glsl in the vertex shader, for spheres too small
+	// on screen for per-pixel lighting to matter. once a second the frame is rendered again fully per pixel
+	// into reference_target to measure what that costs in image quality
+	GLuint gouraud_program = loadShaderProgram("sphere_gouraud.vsh", "sphere_gouraud.fsh");
+	SphereProgram sphere_gouraud(gouraud_program);
+	RenderTarget reference_target;
+	std::vector<unsigned char> lod_pixels, reference_pixels;
+
+	// streaming path: a scene file mapped from disk, or else the objects above as an in-memory scene
+	// of the same format, tiles streamed into a fixed gpu budget either way
+	MappedFile scene_file;
+	std::string scene_blob;
+	SceneSource scene;
+	if (scene_path != NULL) {
+		if (!scene_file.open(scene_path) || !scene.open(scene_file.data, scene_file.size)) {
+			std::cout << "can't read scene " << scene_path << ", streaming the built-in one" << std::endl;
+			scene_file.close();
+		}
+	}
+	if (scene.data == NULL) {
+		std::ostringstream blob;
+		write_scene(blob, objects, std::vector<GLuint>(objects.size(), 0xff0080ffu)); // Vertex() orange, rgba8
+		scene_blob = blob.str();
+		scene.open((const unsigned char*)scene_blob.data(), scene_blob.size());
+	}
+	SceneStreamer streamer;
+	streamer.start(scene, STREAM_BUDGET_MB << 20);
+	GLint im_firstObject = glGetUniformLocation(impostor_program, "firstObject");
+	GLint im_colors = glGetUniformLocation(impostor_program, "colors");
+	GLint im_useColors = glGetUniformLocation(impostor_program, "useColors");
+
+	render_path = scene_path != NULL ? PATH_STREAMING : gpu_capable ? PATH_GPU_DRIVEN : PATH_CLASSIC;
+
+	// dynamic resolution: the scene goes into target at scaler.scale of the window size, then gets
+	// upscaled to the window (bilinear, or bilinear + a clamped sharpen)
+	RenderTarget target;
+	GpuTimer gpu_timer;
+	gpu_timer.init();
+	ResolutionScaler scaler(FRAME_BUDGET_MS);
+	GLuint upscale_program = loadProgram("upscale.vsh", "upscale.fsh");
+	GLint u_uvScale = glGetUniformLocation(upscale_program, "uvScale");
+	GLint u_uvMax = glGetUniformLocation(upscale_program, "uvMax");
+	GLint u_sharpness = glGetUniformLocation(upscale_program, "sharpness");
+	GLint u_image = glGetUniformLocation(upscale_program, "image");
+
+	// hi-z occlusion: each frame's depth reduced into a pyramid that the next frame tests spheres against,
+	// in cull.csh on the gpu-driven path, on a cpu copy of its coarse levels on the classic path
+	HiZPyramid hiz;
+	HiZCopy hiz_copy;
+	hiz_copy.init();
+	GLuint hiz_program = loadProgram("upscale.vsh", "hiz.fsh");
+	GLint h_source = glGetUniformLocation(hiz_program, "source");
+
+	// setup above bound things behind the cache's back
+	gl_state.invalidate();
+
+	// frame stats, printed once a second
+	double stats_start = glfwGetTime();
+	double stats_cpu = 0;
+	double stats_worst_cpu = 0;
+	int stats_frames = 0;
+	double stats_depth_samples = 0;
+	double stats_shaded_samples = 0;
+	double stats_vertex_lit_samples = 0;
+	int stats_vertex_lit_objects = 0;
+	// image difference against per-pixel lighting, from the last measured frame
+	double lod_mean_error = 0, lod_psnr = 0;
+	int lod_max_error = 0;
+	bool lod_measured = false;
+	int stats_overdraw_frames = 0;
+	double stats_gpu = 0;
+	int stats_gpu_frames = 0;
+	double stats_bvh_query = 0;
+	double stats_pick = 0;
+	double stats_occluded_objects = 0;
+	double stats_occluded_pixels = 0;
+	int stats_occlusion_frames = 0;
+	std::vector<glm::vec3> select_origins, select_dirs;
+	std::vector<PickHit> select_hits;
+	double stats_visible_objects = 0;
+	int stats_bvh_frames = 0;
+	double stats_displace_hits = 0, stats_displace_captures = 0, stats_displace_misses = 0;
+	int stats_displace_frames = 0;
+	double stats_physics_integrate = 0, stats_physics_hash = 0, stats_physics_narrow = 0, stats_physics_upload = 0, stats_physics_contacts = 0;
+	int stats_physics_substeps = 0, stats_physics_frames = 0;
+	double stats_nbody_sort = 0, stats_nbody_build = 0, stats_nbody_force = 0, stats_nbody_upload = 0;
+	int stats_nbody_steps = 0, stats_nbody_frames = 0;
+	double stats_particle_gpu = 0;
+	int stats_particle_gpu_frames = 0, stats_particle_steps = 0, stats_particle_frames = 0, stats_particle_readbacks = 0;
+	double stats_record = 0, stats_record_wall = 0, stats_record_wait = 0, stats_replay = 0, stats_swap = 0;
+	int stats_record_frames = 0;
+
 	// render loop
 	// -----------
 	while (!glfwWindowShouldClose(window)) {
 
 		float currentFrame = glfwGetTime();
 		deltaTime = currentFrame - lastFrame;
+		double frame_swap = 0.0;
+		auto present = [&]() {
+			if (!swap_pending)
+				return;
+			double swap_start = glfwGetTime();
+			glfwSwapBuffers(window);
+			frame_swap += glfwGetTime() - swap_start;
+			stats_swap += glfwGetTime() - swap_start;
+			swap_pending = false;
+		};
 		lastFrame = currentFrame;
 
 		// input
 		// -----
 		processInput(window);
+		if (!displace_paused)
+			displace_time += deltaTime;
+		if (gl_counters_on != gl_counters.enabled) {
+			gl_counters.enable(gl_counters_on, COUNT_HOOKS);
+			if (!gl_counters_on)
+				glfwSetWindowTitle(window, WINDOW_TITLE);
+		}
+
+		// a different mesh level or base asked for: build it on the worker, keep drawing the current one until it's there
+		if (assets.context != NULL && (mesh_level != requested_mesh_level || mesh_base != requested_mesh_base)) {
+			assets.request(mesh_level, mesh_base);
+			requested_mesh_level = mesh_level;
+			requested_mesh_base = mesh_base;
+		}
+		SphereMesh built;
+		AssetWorker::Report report;
+		while (assets.poll(built, report)) {
+			glDeleteVertexArrays(1, &mesh.vao);
+			glDeleteBuffers(1, &mesh.vbo);
+			glDeleteBuffers(1, &mesh.ebo);
+			mesh = built;
+			displace_cache.reset(mesh, objects.size(), DISPLACE_CACHE_MB << 20);
+			// make_sphere_vao() bound things, and the new vao may have the old one's name
+			gl_state.invalidate();
+			std::cout << "mesh level " << mesh.level << " (" << SPHERE_BASE_NAMES[mesh.base] << ") in, " << mesh.index_count / 3
+				<< " triangles, largest / smallest area " << report.area_ratio << ", built in " << report.build_ms << " ms on the asset worker" << std::endl;
+			print_subdivision_stages(std::cout, SPHERE_BASE_NAMES[mesh.base], mesh.level, report.stages);
+		}
+
+		// cpu simulations: the new positions go to objects and straight into the instance buffer every path reads
+		auto publish = [&](const auto& simulation) {
+			glBindBuffer(GL_ARRAY_BUFFER, object_buffer);
+			glm::vec4* mapped = (glm::vec4*)glMapBufferRange(GL_ARRAY_BUFFER, 0, sizeof(glm::vec4) * objects.size(),
+				GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+			simulation.write(objects.data(), mapped, thread_pool);
+			if (mapped == NULL || !glUnmapBuffer(GL_ARRAY_BUFFER))
+				glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(glm::vec4) * objects.size(), objects.data());
+			// everything may have moved, refit() takes the whole tree for that
+			moved_objects.resize(objects.size());
+			for (size_t i = 0; i < objects.size(); i++)
+				moved_objects[i] = (GLuint)i;
+		};
+		if (physics_on) {
+			if (physics.size() != objects.size())
+				physics.reset(objects);
+			physics.restitution = physics_elastic ? 1.f : PHYSICS_RESTITUTION;
+			physics.advance(deltaTime, thread_pool);
+			if (physics.substeps > 0) {
+				double upload_start = glfwGetTime();
+				publish(physics);
+				stats_physics_upload += glfwGetTime() - upload_start;
+			}
+			stats_physics_integrate += physics.integrate_ms;
+			stats_physics_hash += physics.hash_ms;
+			stats_physics_narrow += physics.narrow_ms;
+			stats_physics_contacts += physics.contacts / 2;
+			stats_physics_substeps += physics.substeps;
+			stats_physics_frames++;
+		}
+		if (nbody_on != nbody_running) {
+			if (nbody_on)
+				nbody.reset(objects);
+			// the other simulations continue from where the bodies ended up
+			else if (physics.size() > 0)
+				physics.reset(objects);
+			nbody_running = nbody_on;
+		}
+		if (nbody_running) {
+			nbody.theta = nbody_theta;
+			nbody.advance(deltaTime, thread_pool);
+			if (nbody.steps > 0) {
+				double upload_start = glfwGetTime();
+				publish(nbody);
+				stats_nbody_upload += glfwGetTime() - upload_start;
+			}
+			stats_nbody_sort += nbody.sort_ms;
+			stats_nbody_build += nbody.build_ms;
+			stats_nbody_force += nbody.force_ms;
+			stats_nbody_steps += nbody.steps;
+			stats_nbody_frames++;
+		}
+
+		// gpu particles: start from wherever the spheres are, and hand them back to the cpu when stopped
+		if (gpu_particles != particles_running) {
+			GLsizeiptr bytes = sizeof(glm::vec4) * objects.size();
+			if (gpu_particles) {
+				std::vector<glm::vec4> velocities;
+				GpuParticles::orbit_velocities(objects, pl[0].position, PARTICLE_ATTRACTION, velocities);
+				particles_running = particles.reset(object_buffer, velocities);
+				if (!particles_running) {
+					std::cout << "not enough gpu memory for " << objects.size() << " particles" << std::endl;
+					gpu_particles = false;
+				}
+				particle_bound = bounding_cube(objects);
+				particle_accumulator = 0.f;
+			}
+			else {
+				// waits for the gpu, but only this once
+				glBindBuffer(GL_COPY_READ_BUFFER, particles.objects());
+				glBindBuffer(GL_COPY_WRITE_BUFFER, object_buffer);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, bytes);
+				glGetBufferSubData(GL_COPY_READ_BUFFER, 0, bytes, objects.data());
+				glBindBuffer(GL_COPY_READ_BUFFER, 0);
+				glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+				moved_objects.resize(objects.size());
+				for (size_t i = 0; i < objects.size(); i++)
+					moved_objects[i] = (GLuint)i;
+				// the cpu simulation continues from here, at rest
+				if (physics.size() > 0)
+					physics.reset(objects);
+				particles_running = false;
+			}
+		}
+		if (particles_running) {
+			ParticleParams params = { PHYSICS_STEP, pl[0].position, PARTICLE_ATTRACTION, PARTICLE_DRAG, particle_bound,
+				physics_elastic ? 1.f : PHYSICS_RESTITUTION };
+			particle_accumulator = std::min(particle_accumulator + deltaTime, PHYSICS_STEP * PHYSICS_MAX_SUBSTEPS);
+			particle_timer.begin();
+			for (; particle_accumulator >= PHYSICS_STEP; particle_accumulator -= PHYSICS_STEP) {
+				particles.step(gl_state, params);
+				stats_particle_steps++;
+			}
+			particle_timer.end();
+			double particle_ms;
+			if (particle_timer.poll(particle_ms)) {
+				stats_particle_gpu += particle_ms;
+				stats_particle_gpu_frames++;
+			}
+			stats_particle_frames++;
+			// the cpu copy the classic path draws from and the bvh is refitted around, so picks hit the spheres where they're
+			// drawn (a few frames late) whatever the path
+			GLsizeiptr bytes = sizeof(glm::vec4) * objects.size();
+			int slot = particle_readback.acquire(bytes);
+			if (slot >= 0) {
+				glBindBuffer(GL_COPY_READ_BUFFER, particles.objects());
+				glBindBuffer(GL_COPY_WRITE_BUFFER, particle_readback.buffers[slot]);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, bytes);
+				glBindBuffer(GL_COPY_READ_BUFFER, 0);
+				glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+				particle_readback.submit(slot);
+			}
+			slot = particle_readback.poll();
+			if (slot >= 0) {
+				particle_readback.read(slot, objects.data(), bytes);
+				moved_objects.resize(objects.size());
+				for (size_t i = 0; i < objects.size(); i++)
+					moved_objects[i] = (GLuint)i;
+				stats_particle_readbacks++;
+			}
+		}
+		// the tessellation vao and the procedural / impostor buffer texture follow whichever buffer holds the spheres
+		instance_buffer = particles_running ? particles.objects() : object_buffer;
+		if (instance_buffer != attached_instance_buffer) {
+			if (vao_tess != 0) {
+				gl_state.bind_vertex_array(vao_tess);
+				glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+				glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), 0);
+			}
+			glBindTexture(GL_TEXTURE_BUFFER, object_texture);
+			glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, instance_buffer);
+			glBindTexture(GL_TEXTURE_BUFFER, 0);
+			attached_instance_buffer = instance_buffer;
+		}
+
+		// keep the bvh around the spheres: refit what moved, and swap in a fresh build every so often
+		if (!moved_objects.empty()) {
+			bvh.refit(objects.data(), moved_objects, &thread_pool);
+			moved_objects.clear();
+			bvh_refitted = true;
+		}
+		if (bvh_rebuilder.poll(bvh, objects))
+			std::cout << "bvh rebuilt in " << bvh_rebuilder.build_ms << " ms in the background" << std::endl;
+		if (bvh_refitted && currentFrame - bvh_built_at >= BVH_REBUILD_SECONDS) {
+			bvh_rebuilder.start(objects);
+			bvh_refitted = false;
+			bvh_built_at = currentFrame;
+		}
 
 		// render
 		// ------
+		double gpu_ms = 0;
+		if (gpu_timer.poll(gpu_ms)) {
+			stats_gpu += gpu_ms;
+			stats_gpu_frames++;
+			if (dynamic_resolution)
+				scaler.update(gpu_ms);
+		}
+		int occlusion_slot;
+		while (gpu_capable && (occlusion_slot = occlusion_readback.poll()) >= 0) {
+			GLuint counts[2];
+			occlusion_readback.read(occlusion_slot, counts, sizeof(counts));
+			stats_occluded_objects += counts[0];
+			stats_occluded_pixels += counts[1];
+			if (render_path == PATH_GPU_DRIVEN)
+				stats_occlusion_frames++;
+		}
+		float render_scale = dynamic_resolution ? scaler.scale : 1.f;
+		target.resize(window_width, window_height);
+		int render_width = std::max((int)(target.width * render_scale + 0.5f), 1);
+		int render_height = std::max((int)(target.height * render_scale + 0.5f), 1);
+		glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+		glViewport(0, 0, render_width, render_height);
+		gpu_timer.begin();
+
 		glClearColor(0.f, 0.f, 0.f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 		// matrices first
-		glm::mat4 m, v, p, mvp;
-		glm::mat4 mn;
-		m = glm::mat4(1);
-		mn = glm::mat4(1);
+		glm::mat4 v, p;
 		v = glm::mat4(1);
 		p = glm::mat4(1);
-		mvp = glm::mat4(1);
 		// ref: http://glslsandbox.com/e#53359.0 // cool reflective balls
 		// ref: http://glslsandbox.com/e#52629.0 // cool sphere blob thing
 		// ref: http://glslsandbox.com/e#51856.0 // sobrero nice to look at **
@@ -451,100 +6383,668 @@ int main() {
 		// ref: http://glslsandbox.com/e#51487.0 // slow ripple down
 		// ref: http://www.songho.ca/opengl/gl_sphere.html // very cool sphere generation thing
 
-		p = glm::perspective(glm::radians(fov), (GLfloat)SCR_WIDTH / SCR_HEIGHT, .1f, 100.f);
+		p = glm::perspective(glm::radians(fov), (GLfloat)target.width / target.height, NEAR_PLANE, FAR_PLANE);
 		v = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
 
-		glUseProgram(program);
-		glBindVertexArray(vao);
+		// whatever is under the crosshair, on the cpu so nothing waits on the gpu
+		double pick_start = glfwGetTime();
+		PickHit picked = bvh.pick(objects.data(), cameraPos, cameraFront, FAR_PLANE);
+		stats_pick += glfwGetTime() - pick_start;
+		if (select_requested) {
+			// the middle half of the screen, a ray every SELECT_RAY_SPACING window pixels
+			int nx = std::max(window_width / 2 / SELECT_RAY_SPACING, 1), ny = std::max(window_height / 2 / SELECT_RAY_SPACING, 1);
+			camera_rays(p * v, cameraPos, glm::vec2(-0.5f), glm::vec2(0.5f), nx, ny, select_dirs);
+			select_origins.assign(select_dirs.size(), cameraPos);
+			select_hits.resize(select_dirs.size());
+			double select_start = glfwGetTime();
+			bvh.pick(objects.data(), select_origins.data(), select_dirs.data(), select_dirs.size(), select_hits.data(), FAR_PLANE);
+			double select_ms = (glfwGetTime() - select_start) * 1000.0;
+			std::vector<GLint> selected;
+			for (const PickHit& hit : select_hits)
+				if (hit.object >= 0)
+					selected.push_back(hit.object);
+			std::sort(selected.begin(), selected.end());
+			selected.erase(std::unique(selected.begin(), selected.end()), selected.end());
+			std::cout << "selected " << selected.size() << " objects with " << select_dirs.size() << " rays in " << select_ms << " ms:";
+			for (size_t i = 0; i < selected.size() && i < 16; i++)
+				std::cout << " " << selected[i];
+			std::cout << (selected.size() > 16 ? " ..." : "") << std::endl;
+			select_requested = false;
+		}
 
-		// setting the crapton of uniforms
-		{
-			// directional
-			glUniform3fv(f_dirLight_direction, 1, glm::value_ptr(world_light.direction));
-			glUniform3fv(f_dirLight_ambient, 1, glm::value_ptr(world_light.ambient));
-			glUniform3fv(f_dirLight_diffuse, 1, glm::value_ptr(world_light.diffuse));
-			glUniform3fv(f_dirLight_specular, 1, glm::value_ptr(world_light.specular));
-			// point light 1
-			glUniform3fv(f_pointLights0_ambient, 1, glm::value_ptr(pl[0].ambient));
-			glUniform3fv(f_pointLights0_diffuse, 1, glm::value_ptr(pl[0].diffuse));
-			glUniform3fv(f_pointLights0_specular, 1, glm::value_ptr(pl[0].specular));
-			glUniform1f(f_pointLights0_constant, pl[0].constant);
-			glUniform1f(f_pointLights0_linear, pl[0].linear);
-			glUniform1f(f_pointLights0_quadratic, pl[0].quadratic);
-			// spotlight
-			glUniform3fv(f_spotLight_ambient, 1, glm::value_ptr(flashlight.ambient));
-			glUniform3fv(f_spotLight_diffuse, 1, glm::value_ptr(flashlight.diffuse));
-			glUniform3fv(f_spotLight_specular, 1, glm::value_ptr(flashlight.specular));
-			glUniform1f(f_spotLight_constant, flashlight.constant);
-			glUniform1f(f_spotLight_linear, flashlight.linear);
-			glUniform1f(f_spotLight_quadratic, flashlight.quadratic);
-			glUniform1f(f_spotLight_cutOff, flashlight.cutOff);
-			glUniform1f(f_spotLight_outerCutOff, flashlight.outerCutOff);
-
-		}
-		
 		// update LightBoxPosition
 		pl[0].position.x = 2.0f + cos(glfwGetTime()) * 2.0f;
 		pl[0].position.y = 2.0f + sin(glfwGetTime()) * 2.0f;
 		pl[0].position.z = -2.0f + cos(glfwGetTime()) * 2.0f;
-
-		glUniform3fv(f_pointLights0_position, 1, glm::value_ptr(pl[0].position));
 		glm::vec3 lightColor = glm::vec3(1.f, 1.f, 1.f);
-		glUniform3fv(f_lightColor, 1, glm::value_ptr(lightColor));
-		
-		// Projection matrix
-		glUniformMatrix4fv(v_p, 1, GL_FALSE, glm::value_ptr(p));
-
-		// View matrix		
-		glUniformMatrix4fv(v_v, 1, GL_FALSE, glm::value_ptr(v));
-		glUniform3fv(f_viewPos, 1, glm::value_ptr(cameraPos));
-		glUniform3fv(f_spotLight_position, 1, glm::value_ptr(cameraPos));
-		glUniform3fv(f_spotLight_direction, 1, glm::value_ptr(cameraFront));
-
-		// Model matrix
-		for (int objs = 0; objs < NUM_OBJS; objs++) {
-			m = glm::mat4(1);
-			mn = glm::mat4(1);
-
-			m = glm::translate(m, obj_loc[objs]);
-			m = glm::rotate(m, glm::radians((GLfloat)glfwGetTime() * 10.f), glm::vec3(1, 1, 0));
-			m = glm::scale(m, glm::vec3(obj_scales[objs]));
-			mn = glm::mat4(glm::transpose(glm::inverse(m)));
-
-			glUniformMatrix4fv(v_m, 1, GL_FALSE, glm::value_ptr(m));
-			glUniformMatrix4fv(v_mnormal, 1, GL_FALSE, glm::value_ptr(mn));
-
-			glm::mat4 mvp = p * v * m;
-			glUniformMatrix4fv(v_mvp, 1, GL_FALSE, glm::value_ptr(mvp));
-			for (int i = 0; i < va.size(); i += 3) {
-				GLuint currentOffset = i * sizeof(GLuint);
-				glDrawElements(GL_TRIANGLES, 3, GL_UNSIGNED_INT, (void*)currentOffset);
-			}
-		}
-		
-		glUseProgram(lightbox_shaders);
-		m = glm::mat4(1);
-		m = glm::translate(m, pl[0].position);
-		m = glm::scale(m, glm::vec3(0.5f, 0.5f, 0.5f));
-		mvp = p * v * m;
-		glUniformMatrix4fv(vlbs_mvp, 1, GL_FALSE, glm::value_ptr(mvp));
-		glBindVertexArray(vao2);
-		glDrawArrays(GL_TRIANGLES, 0, 36);
+
+		glm::mat4 rot = glm::rotate(glm::mat4(1), glm::radians((GLfloat)glfwGetTime() * 10.f), glm::vec3(1, 1, 0));
+
+		queue.clear();
+
+		if (render_path == PATH_GPU_DRIVEN) {
+			// cull + lod select on the gpu, the cpu cost here doesn't depend on the object count
+			glm::vec4 frustum[6];
+			extract_frustum(p * v, frustum);
+
+			// instanceCount back to 0 for every lod
+			glBindBuffer(GL_COPY_READ_BUFFER, indirect_reset_buffer);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, indirect_buffer);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sizeof(DrawElementsIndirectCommand) * NUM_LODS);
+
+			gl_state.use_program(cull_program);
+			gl_state.uniform1ui(c_numObjects, (GLuint)objects.size());
+			gl_state.uniform4fv(c_frustum, 6, frustum);
+			gl_state.uniform3fv(c_viewPos, cameraPos);
+			gl_state.uniform1f(c_pixelScale, p[1][1] * render_height * 0.5f);
+			gl_state.uniform1fv(c_lodPixels, NUM_LODS - 1, LOD_PIXELS);
+			bool test_hiz = hiz_culling && hiz.valid;
+			gl_state.uniform1i(c_hiZ, test_hiz);
+			if (test_hiz) {
+				glActiveTexture(GL_TEXTURE0);
+				glBindTexture(GL_TEXTURE_2D, hiz.texture);
+				gl_state.uniform1i(c_hiZPyramid, 0);
+				gl_state.uniform_matrix4fv(c_hiZViewProj, hiz.pv);
+				gl_state.uniform2fv(c_hiZViewport, hiz.viewport);
+				gl_state.uniform1i(c_hiZLevels, (GLint)hiz.sizes.size());
+				gl_state.uniform1f(c_nearPlane, NEAR_PLANE);
+				GLuint zero[2] = { 0, 0 };
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, occlusion_buffer);
+				glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zero), zero);
+			}
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instance_buffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, indirect_buffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, visible_buffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, occlusion_buffer);
+			glDispatchCompute(std::min((GLuint)((objects.size() + 63) / 64), cull_max_groups), 1, 1);
+			glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+			int slot = test_hiz ? occlusion_readback.acquire(sizeof(GLuint) * 2) : -1;
+			if (slot >= 0) {
+				glBindBuffer(GL_COPY_READ_BUFFER, occlusion_buffer);
+				glBindBuffer(GL_COPY_WRITE_BUFFER, occlusion_readback.buffers[slot]);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sizeof(GLuint) * 2);
+				occlusion_readback.submit(slot);
+			}
+
+			gl_state.use_program(gpu_program);
+			sphere_gpu.set_lights(world_light, pl[0], flashlight, lightColor);
+			sphere_gpu.set_camera(p, v, cameraPos, cameraFront);
+			gl_state.uniform_matrix4fv(sphere_gpu.v_rot, rot);
+			sphere_gpu.set_displacement(displacement, displace_time);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, displace_buffer);
+			gl_state.bind_vertex_array(vao_gpu);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+			glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0, NUM_LODS, 0);
+			gl_state.current.draws++;
+		}
+		else if (render_path == PATH_TESSELLATION) {
+			gl_state.use_program(tess_program);
+			sphere_tess.set_lights(world_light, pl[0], flashlight, lightColor);
+			sphere_tess.set_camera(p, v, cameraPos, cameraFront);
+			gl_state.uniform_matrix4fv(sphere_tess.v_rot, rot);
+			gl_state.uniform1f(t_pixelScale, p[1][1] * render_height * 0.5f);
+			gl_state.uniform1f(t_tessPixels, TESS_PIXELS);
+			gl_state.bind_vertex_array(vao_tess);
+			glDrawElementsInstanced(GL_PATCHES, tess_index_count, GL_UNSIGNED_INT, 0, (GLsizei)objects.size());
+			gl_state.current.draws++;
+		}
+		else if (render_path == PATH_PROCEDURAL || render_path == PATH_IMPOSTOR) {
+			bool impostors = render_path == PATH_IMPOSTOR;
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_BUFFER, object_texture);
+			gl_state.bind_vertex_array(vao_empty);
+
+			gl_state.use_program(procedural_program);
+			sphere_procedural.set_lights(world_light, pl[0], flashlight, lightColor);
+			sphere_procedural.set_camera(p, v, cameraPos, cameraFront);
+			gl_state.uniform_matrix4fv(sphere_procedural.v_rot, rot);
+			gl_state.uniform1i(pr_level, procedural_level);
+			gl_state.uniform1i(pr_objects, 0);
+			gl_state.uniform1f(pr_maxDistance, impostors ? IMPOSTOR_DISTANCE : FLT_MAX);
+			// 20 faces, 4^level triangles each
+			glDrawArraysInstanced(GL_TRIANGLES, 0, 20 * 3 * (1 << (2 * procedural_level)), (GLsizei)objects.size());
+			gl_state.current.draws++;
+
+			if (impostors) {
+				gl_state.use_program(impostor_program);
+				sphere_impostor.set_lights(world_light, pl[0], flashlight, lightColor);
+				sphere_impostor.set_camera(p, v, cameraPos, cameraFront);
+				gl_state.uniform1f(im_minDistance, IMPOSTOR_DISTANCE);
+				gl_state.uniform1i(im_objects, 0);
+				gl_state.uniform1i(im_colors, 1);
+				gl_state.uniform1i(im_firstObject, 0);
+				gl_state.uniform1i(im_useColors, 0);
+				glDrawArraysInstanced(GL_TRIANGLES, 0, 6, (GLsizei)objects.size());
+				gl_state.current.draws++;
+			}
+		}
+		else if (render_path == PATH_STREAMING) {
+			glm::vec4 frustum[6];
+			extract_frustum(p * v, frustum);
+			streamer.update(frustum, cameraPos, p[1][1] * render_height * 0.5f);
+
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_BUFFER, streamer.object_texture);
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_BUFFER, streamer.color_texture);
+			glActiveTexture(GL_TEXTURE0);
+			gl_state.bind_vertex_array(vao_empty);
+			gl_state.use_program(impostor_program);
+			sphere_impostor.set_lights(world_light, pl[0], flashlight, lightColor);
+			sphere_impostor.set_camera(p, v, cameraPos, cameraFront);
+			gl_state.uniform1f(im_minDistance, 0.f);
+			gl_state.uniform1i(im_objects, 0);
+			gl_state.uniform1i(im_colors, 1);
+			gl_state.uniform1i(im_useColors, 1);
+			// one instanced draw per resident tile, each a slice of the pool
+			for (GLuint slot : streamer.visible_slots) {
+				gl_state.uniform1i(im_firstObject, (GLint)(slot * TILE_CAPACITY));
+				glDrawArraysInstanced(GL_TRIANGLES, 0, 6, streamer.scene.tiles[streamer.slot_tile[slot]].count);
+				gl_state.current.draws++;
+			}
+		}
+		else {
+			// last frame's overdraw numbers, only if the gpu is already done with them
+			if (overdraw_pending) {
+				GLuint available = 1;
+				for (int q = 0; q < 3; q++) {
+					GLuint a = 1;
+					if (overdraw_issued[q])
+						glGetQueryObjectuiv(overdraw_queries[q], GL_QUERY_RESULT_AVAILABLE, &a);
+					available = available && a;
+				}
+				if (available) {
+					GLuint samples[3] = { 0, 0, 0 };
+					for (int q = 0; q < 3; q++) {
+						if (overdraw_issued[q])
+							glGetQueryObjectuiv(overdraw_queries[q], GL_QUERY_RESULT, &samples[q]);
+						overdraw_issued[q] = false;
+					}
+					stats_depth_samples += samples[0];
+					stats_shaded_samples += samples[1] + samples[2];
+					stats_vertex_lit_samples += samples[2];
+					stats_overdraw_frames++;
+					overdraw_pending = false;
+				}
+			}
+
+			// per-draw uniforms ride along with the draw, everything else is set once per program here
+			gl_state.use_program(program);
+			sphere.set_lights(world_light, pl[0], flashlight, lightColor);
+			sphere.set_camera(p, v, cameraPos, cameraFront);
+			sphere.set_displacement(displacement, displace_time);
+			if (lighting_lod) {
+				gl_state.use_program(gouraud_program);
+				sphere_gouraud.set_lights(world_light, pl[0], flashlight, lightColor);
+				sphere_gouraud.set_camera(p, v, cameraPos, cameraFront);
+				sphere_gouraud.set_displacement(displacement, displace_time);
+			}
+			if (depth_prepass) {
+				gl_state.use_program(depth_program);
+				gl_state.uniform1i(d_displace, displacement);
+				gl_state.uniform1f(d_displaceTime, displace_time);
+			}
+			float pixel_scale = p[1][1] * render_height * 0.5f;
+
+			// newest cpu copy of the hi-z pyramid, if one came back since
+			hiz_copy.poll();
+			if (hiz_culling)
+				stats_occlusion_frames++;
+
+			displace_cache.begin_frame();
+			visible_objects.clear();
+			if (bvh_culling) {
+				glm::vec4 frustum[6];
+				extract_frustum(p * v, frustum);
+				double query_start = glfwGetTime();
+				bvh.frustum_query(objects.data(), frustum, visible_objects);
+				stats_bvh_query += glfwGetTime() - query_start;
+				stats_bvh_frames++;
+				stats_visible_objects += visible_objects.size();
+			}
+			else {
+				for (GLuint objs = 0; objs < objects.size(); objs++)
+					visible_objects.push_back(objs);
+			}
+
+			// occlusion and the displacement cache keep state, so they run here; what's left per object is
+			// math, recorded by the workers into the queue's slots while this thread presents the last frame
+			draw_objects.clear();
+			draw_slots.clear();
+			for (GLuint objs : visible_objects) {
+				if (hiz_culling && hiz_copy.occluded(objects[objs])) {
+					float distance = glm::length(glm::vec3(objects[objs]) - cameraPos);
+					float radius = objects[objs].w * pixel_scale / std::max(distance, NEAR_PLANE);
+					stats_occluded_objects++;
+					stats_occluded_pixels += std::min(3.14159f * radius * radius, (float)render_width * render_height);
+					continue;
+				}
+				draw_objects.push_back(objs);
+				draw_slots.push_back(displacement && displace_cache_on ? displace_cache.fetch(objs, displacements[objs], displace_time) : -1);
+			}
+			size_t draws_per_object = depth_prepass ? 2 : 1;
+			size_t first_draw = queue.reserve(draw_objects.size() * draws_per_object);
+			std::atomic<int> vertex_lit_objects(0);
+			glm::mat4 pv = p * v;
+			recorder.begin(thread_pool, draw_objects.size(), COMMAND_GRAIN, command_threads, [&](size_t b, size_t e) {
+				int vertex_lit_count = 0;
+				for (size_t k = b; k < e; k++) {
+					GLuint objs = draw_objects[k];
+					size_t slot = first_draw + k * draws_per_object;
+					float distance = glm::length(glm::vec3(objects[objs]) - cameraPos);
+
+					// front to back by view depth of the nearest point, quantized to 24 bits over the depth range
+					GLuint depth = 0;
+					if (sort_front_to_back) {
+						float d = glm::dot(glm::vec3(objects[objs]) - cameraPos, cameraFront) - objects[objs].w;
+						depth = (GLuint)(glm::clamp((d - NEAR_PLANE) / (FAR_PLANE - NEAR_PLANE), 0.f, 1.f) * 16777215.f);
+					}
+
+					glm::mat4 m = glm::translate(glm::mat4(1), glm::vec3(objects[objs])) * rot;
+					m = glm::scale(m, glm::vec3(objects[objs].w));
+					glm::mat4 mvp = pv * m;
+
+					DrawItem item;
+					item.vao = mesh.vao;
+					item.mode = GL_TRIANGLES;
+					item.count = mesh.index_count;
+					item.indexed = true;
+					item.instance_count = 1;
+					item.displaced = displacement;
+					item.displacement = displacements[objs];
+					item.base_vertex = 0;
+					if (draw_slots[k] >= 0) {
+						item.vao = displace_cache.vao;
+						item.base_vertex = draw_slots[k] * displace_cache.vertex_count;
+						// displaced already, kind 0 passes it through
+						item.displacement = glm::vec4(0.f);
+					}
+					if (depth_prepass) {
+						item.program = depth_program;
+						item.num_matrices = 1;
+						item.matrix_locs[0] = d_mvp;
+						item.matrices[0] = mvp;
+						queue.keys[slot] = RenderQueue::make_key(PASS_DEPTH, item.program, item.vao, depth);
+						queue.items[slot++] = item;
+					}
+
+					// projected radius in pixels against the lighting lod threshold
+					bool vertex_lit = lighting_lod && objects[objs].w * pixel_scale < lighting_lod_pixels * distance;
+					const SphereProgram& shading = vertex_lit ? sphere_gouraud : sphere;
+					if (vertex_lit)
+						vertex_lit_count++;
+
+					item.program = shading.id;
+					item.num_matrices = 3;
+					item.matrix_locs[0] = shading.v_m;
+					item.matrices[0] = m;
+					item.matrix_locs[1] = shading.v_mnormal;
+					item.matrices[1] = glm::mat4(glm::transpose(glm::inverse(m)));
+					item.matrix_locs[2] = shading.v_mvp;
+					item.matrices[2] = mvp;
+					queue.keys[slot] = RenderQueue::make_key(vertex_lit ? PASS_VERTEX_LIT : PASS_OPAQUE, item.program, item.vao, depth);
+					queue.items[slot] = item;
+				}
+				vertex_lit_objects += vertex_lit_count;
+			});
+			present();
+			// captures before the queue draws from them
+			displace_cache.flush(gl_state, capture_program, dc_displace, dc_displaceTime, displace_time);
+			recorder.wait(thread_pool);
+			stats_vertex_lit_objects += vertex_lit_objects;
+			stats_record += recorder.record_ms;
+			stats_record_wall += recorder.wall_ms;
+			stats_record_wait += recorder.wait_ms;
+			stats_record_frames++;
+			if (displacement && displace_cache_on) {
+				stats_displace_hits += displace_cache.hits;
+				stats_displace_captures += displace_cache.captures;
+				stats_displace_misses += displace_cache.misses;
+				stats_displace_frames++;
+			}
+			overdraw_pending = true;
+		}
+
+		{
+			// only the point light's lamp moves, that's the one instance we upload
+			lamps[0].position = pl[0].position;
+			lamps[0].color = glm::vec4(lightColor * pl[0].diffuse, 1.f);
+			glBindBuffer(GL_ARRAY_BUFFER, lamp_buffer);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(LampInstance), &lamps[0]);
+
+			DrawItem item;
+			item.program = lightbox_shaders;
+			item.vao = vao2;
+			item.mode = GL_TRIANGLES;
+			item.count = 36;
+			item.indexed = true;
+			item.instance_count = (GLsizei)lamps.size();
+			item.displaced = false;
+			item.base_vertex = 0;
+			item.num_matrices = 1;
+			item.matrix_locs[0] = vlbs_vp;
+			item.matrices[0] = p * v;
+			queue.submit(RenderQueue::make_key(PASS_LAMPS, item.program, item.vao, 0), item);
+		}
+
+		// pass changes are where the fixed-function state and the overdraw queries switch
+		bool classic = render_path == PATH_CLASSIC;
+		bool count_samples = classic;
+		auto on_pass = [&](int from, int to) {
+			bool from_shading = from == PASS_OPAQUE || from == PASS_VERTEX_LIT;
+			bool to_shading = to == PASS_OPAQUE || to == PASS_VERTEX_LIT;
+			if (from == PASS_DEPTH) {
+				if (count_samples)
+					glEndQuery(GL_SAMPLES_PASSED);
+				glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+				glDepthFunc(GL_EQUAL);
+				glDepthMask(GL_FALSE);
+			}
+			else if (from_shading && count_samples)
+				glEndQuery(GL_SAMPLES_PASSED);
+			if (from_shading && !to_shading && depth_prepass) {
+				glDepthFunc(GL_LESS);
+				glDepthMask(GL_TRUE);
+			}
+
+			if (to == PASS_DEPTH)
+				// lay down depth only, then shading touches each visible pixel once
+				glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+			if ((to == PASS_DEPTH || to_shading) && count_samples) {
+				int q = to == PASS_DEPTH ? 0 : to == PASS_OPAQUE ? 1 : 2;
+				glBeginQuery(GL_SAMPLES_PASSED, overdraw_queries[q]);
+				overdraw_issued[q] = true;
+			}
+		};
+		// whatever path ran, the last frame is out by now
+		present();
+		double replay_start = glfwGetTime();
+		queue.execute(gl_state, on_pass);
+		if (classic)
+			stats_replay += glfwGetTime() - replay_start;
+
+		// this frame's depth, reduced for the next frame's occlusion tests
+		bool hiz_path = render_path == PATH_CLASSIC || render_path == PATH_GPU_DRIVEN;
+		if (hiz_culling && hiz_path) {
+			hiz.build(target, p * v, glm::vec2((float)render_width, (float)render_height), hiz_program, h_source, vao_empty);
+			if (render_path == PATH_CLASSIC)
+				hiz_copy.request(hiz, HIZ_READBACK_TEXELS);
+			glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+			glViewport(0, 0, render_width, render_height);
+		}
+		else {
+			// stale once it's off, start over when it's back on
+			hiz.valid = false;
+			hiz_copy.valid = false;
+		}
+		gpu_timer.end();
+
+		// once a second, what per-vertex lighting costs in image quality: same queue again with every
+		// vertex-lit draw switched back to per-pixel lighting, into a second target, and both read back
+		// (that's a stall, which is why it's not every frame)
+		if (classic && lighting_lod && currentFrame - stats_start >= 1.0) {
+			reference_target.resize(target.width, target.height);
+			glBindFramebuffer(GL_FRAMEBUFFER, reference_target.fbo);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			for (DrawItem& item : queue.items) {
+				if (item.program != gouraud_program)
+					continue;
+				item.program = program;
+				item.matrix_locs[0] = sphere.v_m;
+				item.matrix_locs[1] = sphere.v_mnormal;
+				item.matrix_locs[2] = sphere.v_mvp;
+			}
+			count_samples = false;
+			queue.execute(gl_state, on_pass);
+
+			size_t bytes = (size_t)render_width * render_height * 4;
+			lod_pixels.resize(bytes);
+			reference_pixels.resize(bytes);
+			glPixelStorei(GL_PACK_ALIGNMENT, 1);
+			glReadPixels(0, 0, render_width, render_height, GL_RGBA, GL_UNSIGNED_BYTE, reference_pixels.data());
+			glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+			glReadPixels(0, 0, render_width, render_height, GL_RGBA, GL_UNSIGNED_BYTE, lod_pixels.data());
+
+			// rgb only, over every rendered pixel
+			double sum = 0, sum_sq = 0;
+			lod_max_error = 0;
+			for (size_t i = 0; i < bytes; i++) {
+				if (i % 4 == 3)
+					continue;
+				int e = abs((int)lod_pixels[i] - (int)reference_pixels[i]);
+				sum += e;
+				sum_sq += e * e;
+				lod_max_error = std::max(lod_max_error, e);
+			}
+			double channels = (double)render_width * render_height * 3;
+			lod_mean_error = sum / channels;
+			lod_psnr = sum_sq > 0 ? 10.0 * log10(255.0 * 255.0 / (sum_sq / channels)) : INFINITY;
+			lod_measured = true;
+		}
+
+		// upscale to the window; uvMax keeps bilinear taps off the texels outside the rendered part
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, window_width, window_height);
+		glDisable(GL_DEPTH_TEST);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, target.color);
+		gl_state.use_program(upscale_program);
+		gl_state.uniform1i(u_image, 0);
+		gl_state.uniform2fv(u_uvScale, glm::vec2((float)render_width / target.width, (float)render_height / target.height));
+		gl_state.uniform2fv(u_uvMax, glm::vec2((render_width - 0.5f) / target.width, (render_height - 0.5f) / target.height));
+		gl_state.uniform1f(u_sharpness, upscale_sharpen ? UPSCALE_SHARPNESS : 0.f);
+		gl_state.bind_vertex_array(vao_empty);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		gl_state.current.draws++;
+		glEnable(GL_DEPTH_TEST);
+		gl_state.end_frame();
+		// the frame's last call; with command threads its swap waits for the next frame's recording
+		gl_trace.end_frame();
+		gl_counters.end_frame();
+
+		// cpu side only, swap is where the driver waits on the gpu
+		double frame_cpu = glfwGetTime() - currentFrame - frame_swap;
+		stats_cpu += frame_cpu;
+		stats_worst_cpu = std::max(stats_worst_cpu, frame_cpu);
+		stats_frames++;
+		if (currentFrame - stats_start >= 1.0) {
+			std::cout << PATH_NAMES[render_path] << ", " << objects.size() << " objects: "
+				<< stats_frames << " fps, cpu " << stats_cpu * 1000.0 / stats_frames << " ms/frame (worst " << stats_worst_cpu * 1000.0 << ")";
+			if (stats_gpu_frames > 0)
+				std::cout << ", gpu " << stats_gpu / stats_gpu_frames << " ms/frame";
+			std::cout << ", render scale " << render_scale << " (" << render_width << "x" << render_height
+				<< (upscale_sharpen ? ", sharpened" : ", bilinear") << (dynamic_resolution ? ")" : ", fixed)") << std::endl;
+			if (stats_overdraw_frames > 0) {
+				// shaded fragments per screen pixel; with the pre-pass on, the depth pass count is what
+				// shading would have cost without it, so depth / shaded is the overdraw the pre-pass removed
+				double shaded = stats_shaded_samples / stats_overdraw_frames;
+				std::cout << "  shaded " << (long long)shaded << " fragments/frame (" << shaded / (render_width * render_height) << " per pixel)"
+					<< ", " << (sort_front_to_back ? "front-to-back" : "unsorted");
+				if (depth_prepass && shaded > 0)
+					std::cout << ", pre-pass removed " << stats_depth_samples / stats_overdraw_frames / shaded << "x overdraw";
+				std::cout << std::endl;
+				if (lighting_lod) {
+					// fragments that skipped per-pixel lighting, next to how much the image moved for it
+					std::cout << "  lighting lod < " << lighting_lod_pixels << " px: " << stats_vertex_lit_objects / stats_frames
+						<< " objects/frame lit per vertex, " << 100.0 * stats_vertex_lit_samples / std::max(stats_shaded_samples, 1.0)
+						<< "% of shaded fragments";
+					if (lod_measured)
+						std::cout << "; vs per-pixel: mean error " << lod_mean_error << "/255, max " << lod_max_error << ", psnr " << lod_psnr << " dB";
+					std::cout << std::endl;
+				}
+			}
+			if (render_path == PATH_STREAMING) {
+				std::cout << "  streaming " << streamer.scene.header->sphere_count << " spheres in " << streamer.scene.header->tile_count << " tiles: "
+					<< streamer.resident_tiles() << "/" << streamer.num_slots << " slots resident (" << streamer.resident_spheres() << " spheres), "
+					<< streamer.visible_slots.size() << " drawn, " << streamer.in_flight << " loading; last second "
+					<< streamer.loads << " loads (" << streamer.uploaded_bytes / 1048576.0 << " MB), " << streamer.evictions << " evictions, "
+					<< streamer.dropped << " dropped over budget" << std::endl;
+				streamer.reset_stats();
+			}
+			if (stats_occlusion_frames > 0) {
+				std::cout << "  hi-z: " << stats_occluded_objects / stats_occlusion_frames << " objects/frame occluded, ~"
+					<< (long long)(stats_occluded_pixels / stats_occlusion_frames) << " fragments/frame not rasterized" << std::endl;
+			}
+			std::cout << "  crosshair pick: ";
+			if (picked.object >= 0)
+				std::cout << "object " << picked.object << " at (" << picked.point.x << ", " << picked.point.y << ", " << picked.point.z << "), " << picked.t << " away";
+			else
+				std::cout << "nothing";
+			std::cout << ", " << stats_pick * 1e6 / stats_frames << " us/frame" << std::endl;
+			if (stats_displace_frames > 0) {
+				std::cout << "  displacement cache: " << stats_displace_captures / stats_displace_frames << " captured, "
+					<< stats_displace_hits / stats_displace_frames << " reused, " << stats_displace_misses / stats_displace_frames
+					<< " displaced per pass (no slot) per frame, " << displace_cache.slots.size() << " slots"
+					<< (displace_paused ? ", animation paused" : "") << std::endl;
+			}
+			if (stats_record_frames > 0) {
+				std::cout << "  draw commands: record " << stats_record / stats_record_frames << " ms cpu in " << recorder.chunks
+					<< (command_threads ? " chunks on the pool" : " chunk unthreaded") << ", done " << stats_record_wall / stats_record_frames
+					<< " ms after it started (gl thread waited " << stats_record_wait / stats_record_frames << "); replay "
+					<< stats_replay * 1000.0 / stats_record_frames << " ms, swap " << stats_swap * 1000.0 / stats_frames << " ms/frame" << std::endl;
+			}
+			if (stats_physics_frames > 0) {
+				int steps = std::max(stats_physics_substeps, 1);
+				std::cout << "  physics: " << (double)stats_physics_substeps / stats_physics_frames << " substeps/frame, integrate "
+					<< stats_physics_integrate / steps << " + hash " << stats_physics_hash / steps << " + narrowphase "
+					<< stats_physics_narrow / steps << " ms/substep, " << (long long)(stats_physics_contacts / steps) << " contacts/substep, upload "
+					<< stats_physics_upload * 1000.0 / stats_physics_frames << " ms/frame, " << (physics_elastic ? "elastic" : "inelastic") << std::endl;
+			}
+			if (stats_nbody_frames > 0) {
+				int steps = std::max(stats_nbody_steps, 1);
+				std::cout << "  n-body: " << nbody.size() << " bodies, " << (double)stats_nbody_steps / stats_nbody_frames << " steps/frame, sort "
+					<< stats_nbody_sort / steps << " + tree " << stats_nbody_build / steps << " + forces " << stats_nbody_force / steps
+					<< " ms/step, " << nbody.nodes.size() << " nodes, theta " << nbody.theta << ", energy drift "
+					<< 100.0 * (nbody.energy - nbody.initial_energy) / std::abs(nbody.initial_energy) << "%, upload "
+					<< stats_nbody_upload * 1000.0 / stats_nbody_frames << " ms/frame" << std::endl;
+			}
+			if (stats_particle_frames > 0) {
+				std::cout << "  gpu particles (" << (particles.compute ? "compute" : "transform feedback") << "): " << particles.count << " spheres, "
+					<< (double)stats_particle_steps / stats_particle_frames << " steps/frame, "
+					<< stats_particle_gpu / std::max(stats_particle_gpu_frames, 1) << " ms/frame on the gpu, "
+					<< stats_particle_readbacks << " copies back to the cpu" << std::endl;
+			}
+			if (stats_bvh_frames > 0) {
+				std::cout << "  bvh culling: " << stats_visible_objects / stats_bvh_frames << "/" << objects.size() << " objects in the frustum, query "
+					<< stats_bvh_query * 1e6 / stats_bvh_frames << " us/frame, " << bvh.node_count << " nodes, sah cost " << bvh.sah_cost() << std::endl;
+			}
+			const GLStateCache::Stats& gs = gl_state.last_frame;
+			std::cout << "  state changes last frame (issued/elided): programs " << gs.programs.issued << "/" << gs.programs.elided
+				<< ", vaos " << gs.vaos.issued << "/" << gs.vaos.elided
+				<< ", uniforms " << gs.uniforms.issued << "/" << gs.uniforms.elided
+				<< ", attributes " << gs.attribs.issued << "/" << gs.attribs.elided
+				<< ", " << gs.draws << " draws" << std::endl;
+			if (gl_counters.enabled) {
+				std::cout << "  gl calls last frame: ";
+				print_gl_counts(std::cout, gl_counters.last_frame);
+				std::cout << std::endl;
+				// the short version where it's in sight
+				const GLCallCounts& gc = gl_counters.last_frame;
+				std::ostringstream title;
+				title << WINDOW_TITLE << " - " << gc.total() << " gl calls, " << gc.draws() << " draws, " << gc.triangles << " triangles, "
+					<< gc.programs() << " programs, " << gc.binds() << " binds, " << gc.uniforms() << " uniforms, "
+					<< gc.upload_bytes / 1024 << " KB uploaded";
+				glfwSetWindowTitle(window, title.str().c_str());
+			}
+			stats_start = currentFrame;
+			stats_cpu = 0;
+			stats_worst_cpu = 0;
+			stats_frames = 0;
+			stats_depth_samples = 0;
+			stats_shaded_samples = 0;
+			stats_vertex_lit_samples = 0;
+			stats_vertex_lit_objects = 0;
+			lod_measured = false;
+			stats_overdraw_frames = 0;
+			stats_gpu = 0;
+			stats_gpu_frames = 0;
+			stats_bvh_query = 0;
+			stats_pick = 0;
+			stats_occluded_objects = 0;
+			stats_occluded_pixels = 0;
+			stats_occlusion_frames = 0;
+			stats_visible_objects = 0;
+			stats_bvh_frames = 0;
+			stats_displace_hits = stats_displace_captures = stats_displace_misses = 0;
+			stats_displace_frames = 0;
+			stats_physics_integrate = stats_physics_hash = stats_physics_narrow = stats_physics_upload = stats_physics_contacts = 0;
+			stats_physics_substeps = stats_physics_frames = 0;
+			stats_nbody_sort = stats_nbody_build = stats_nbody_force = stats_nbody_upload = 0;
+			stats_nbody_steps = stats_nbody_frames = 0;
+			stats_particle_gpu = 0;
+			stats_particle_gpu_frames = stats_particle_steps = stats_particle_frames = stats_particle_readbacks = 0;
+			stats_record = stats_record_wall = stats_record_wait = stats_replay = stats_swap = 0;
+			stats_record_frames = 0;
+		}
 
 		// glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
 		// -------------------------------------------------------------------------------
-		glfwSwapBuffers(window);
+		// only the classic path records on the pool, so only it has something to overlap a deferred swap with;
+		// everything else swaps now instead of taking a frame of latency
+		swap_pending = true;
+		if (render_path != PATH_CLASSIC || !command_threads)
+			present();
 		glfwPollEvents();
 	}
+	// the last frame's swap may still be waiting on a next frame that isn't coming
+	if (swap_pending)
+		glfwSwapBuffers(window);
+	gl_trace.stop();
 
 	// clean-up
 	glDeleteProgram(program);
-	glDeleteVertexArrays(1, &vao);
-	glDeleteBuffers(1, &vbo);
-	glDeleteBuffers(1, &ebo);
+	assets.stop();
+	bvh_rebuilder.stop();
+	thread_pool.stop();
+	glDeleteVertexArrays(1, &mesh.vao);
+	glDeleteBuffers(1, &mesh.vbo);
+	glDeleteBuffers(1, &mesh.ebo);
 	glDeleteProgram(lightbox_shaders);
 	glDeleteVertexArrays(1, &vao2);
 	glDeleteBuffers(1, &vbo2);
+	glDeleteBuffers(1, &ebo2);
+	glDeleteBuffers(1, &lamp_buffer);
+	glDeleteBuffers(1, &object_buffer);
+	glDeleteBuffers(1, &displace_buffer);
+	particles.release();
+	particle_readback.release();
+	particle_timer.release();
+	glDeleteProgram(procedural_program);
+	glDeleteVertexArrays(1, &vao_empty);
+	glDeleteTextures(1, &object_texture);
+	glDeleteProgram(impostor_program);
+	glDeleteProgram(depth_program);
+	glDeleteProgram(capture_program);
+	displace_cache.release();
+	glDeleteQueries(3, overdraw_queries);
+	glDeleteProgram(gouraud_program);
+	reference_target.release();
+	streamer.stop();
+	scene_file.close();
+	glDeleteProgram(upscale_program);
+	glDeleteProgram(hiz_program);
+	hiz.release();
+	hiz_copy.release();
+	target.release();
+	gpu_timer.release();
+	if (gpu_capable) {
+		glDeleteProgram(cull_program);
+		glDeleteProgram(gpu_program);
+		glDeleteVertexArrays(1, &vao_gpu);
+		glDeleteBuffers(1, &vbo_lods);
+		glDeleteBuffers(1, &ebo_lods);
+		glDeleteBuffers(1, &visible_buffer);
+		glDeleteBuffers(1, &indirect_buffer);
+		glDeleteBuffers(1, &indirect_reset_buffer);
+		glDeleteBuffers(1, &occlusion_buffer);
+		occlusion_readback.release();
+	}
+	if (tess_capable) {
+		glDeleteProgram(tess_program);
+		glDeleteVertexArrays(1, &vao_tess);
+		glDeleteBuffers(1, &vbo_tess);
+		glDeleteBuffers(1, &ebo_tess);
+	}
 
 	// glfw: terminate, clearing all previously allocated GLFW resources.
 	// ------------------------------------------------------------------
@@ -567,6 +7067,81 @@ void processInput(GLFWwindow *window) {
 		cameraPos -= glm::normalize(glm::cross(cameraFront, cameraUp)) * cameraSpeed;
 	if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
 		cameraPos += glm::normalize(glm::cross(cameraFront, cameraUp)) * cameraSpeed;
+	// switching pipelines
+	for (int i = 0; i < NUM_PATHS; i++) {
+		if (glfwGetKey(window, GLFW_KEY_1 + i) == GLFW_PRESS && path_available[i])
+			render_path = (RenderPath)i;
+	}
+	if (key_pressed(window, GLFW_KEY_P))
+		depth_prepass = !depth_prepass;
+	if (key_pressed(window, GLFW_KEY_O))
+		sort_front_to_back = !sort_front_to_back;
+	if (key_pressed(window, GLFW_KEY_L))
+		lighting_lod = !lighting_lod;
+	if (key_pressed(window, GLFW_KEY_MINUS))
+		lighting_lod_pixels *= 0.5f;
+	if (key_pressed(window, GLFW_KEY_EQUAL))
+		lighting_lod_pixels *= 2.f;
+	if (key_pressed(window, GLFW_KEY_R))
+		dynamic_resolution = !dynamic_resolution;
+	if (key_pressed(window, GLFW_KEY_U))
+		upscale_sharpen = !upscale_sharpen;
+	if (key_pressed(window, GLFW_KEY_B))
+		bvh_culling = !bvh_culling;
+	if (key_pressed(window, GLFW_KEY_K))
+		select_requested = true;
+	if (key_pressed(window, GLFW_KEY_H))
+		hiz_culling = !hiz_culling;
+	if (key_pressed(window, GLFW_KEY_V))
+		displacement = !displacement;
+	if (key_pressed(window, GLFW_KEY_C))
+		displace_cache_on = !displace_cache_on;
+	if (key_pressed(window, GLFW_KEY_X))
+		command_threads = !command_threads;
+	if (key_pressed(window, GLFW_KEY_I))
+		gl_counters_on = !gl_counters_on;
+	if (key_pressed(window, GLFW_KEY_T))
+		displace_paused = !displace_paused;
+	if (key_pressed(window, GLFW_KEY_F)) {
+		physics_on = !physics_on;
+		gpu_particles = gpu_particles && !physics_on;
+		nbody_on = nbody_on && !physics_on;
+	}
+	if (key_pressed(window, GLFW_KEY_J)) {
+		gpu_particles = !gpu_particles;
+		physics_on = physics_on && !gpu_particles;
+		nbody_on = nbody_on && !gpu_particles;
+	}
+	if (key_pressed(window, GLFW_KEY_Y)) {
+		nbody_on = !nbody_on;
+		physics_on = physics_on && !nbody_on;
+		gpu_particles = gpu_particles && !nbody_on;
+	}
+	if (key_pressed(window, GLFW_KEY_COMMA))
+		nbody_theta = std::max(nbody_theta - 0.1f, 0.1f);
+	if (key_pressed(window, GLFW_KEY_PERIOD))
+		nbody_theta = std::min(nbody_theta + 0.1f, 1.5f);
+	if (key_pressed(window, GLFW_KEY_E))
+		physics_elastic = !physics_elastic;
+	if (key_pressed(window, GLFW_KEY_N) && mesh_level > 0)
+		mesh_level--;
+	if (key_pressed(window, GLFW_KEY_M) && mesh_level < MAX_MESH_LEVEL)
+		mesh_level++;
+	if (key_pressed(window, GLFW_KEY_G))
+		mesh_base = (SphereBase)((mesh_base + 1) % NUM_SPHERE_BASES);
+	if (key_pressed(window, GLFW_KEY_LEFT_BRACKET) && procedural_level > 0)
+		procedural_level--;
+	if (key_pressed(window, GLFW_KEY_RIGHT_BRACKET) && procedural_level < MAX_PROCEDURAL_LEVEL)
+		procedural_level++;
+}
+
+// true only on the frame the key goes down, for toggles
+bool key_pressed(GLFWwindow* window, int key) {
+	static std::map<int, bool> was_down;
+	bool down = glfwGetKey(window, key) == GLFW_PRESS;
+	bool pressed = down && !was_down[key];
+	was_down[key] = down;
+	return pressed;
 }
 
 // https://learnopengl.com/Getting-started/Camera
@@ -619,7 +7194,8 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 // glfw: whenever the window size changed (by OS or user resize) this callback function executes
 // ---------------------------------------------------------------------------------------------
 void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
-	// make sure the viewport matches the new window dimensions; note that width and 
+	// the render target and the viewport follow these every frame; note that width and
 	// height will be significantly larger than specified on retina displays.
-	glViewport(0, 0, width, height);
+	window_width = width;
+	window_height = height;
 }
\ No newline at end of file
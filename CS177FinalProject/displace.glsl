@@ -0,0 +1,43 @@
+// procedural surface animation: moves unit sphere mesh vertices along the normal, for every vertex shader
+// that draws those meshes. they all have to run the same code, or the depth pre-pass and the GL_EQUAL
+// shading pass stop agreeing
+// params (per instance): x = amplitude, as a fraction of the radius, y = frequency, z = speed, w = kind
+// kind 0 = none, 1 = ripples running down from the pole, 2 = a blob of travelling waves
+// ref: http://glslsandbox.com/e#51718.0, http://glslsandbox.com/e#52629.0
+// the surface only ever goes inward, so the object's sphere still bounds it for every kind of culling
+
+uniform bool displace;
+uniform float displaceTime;
+
+float displace_height(vec3 n, vec4 params) {
+	float t = params.z * displaceTime;
+	float wave;
+	if (params.w < 1.5)
+		wave = sin(params.y * acos(clamp(n.y, -1.0, 1.0)) - t);
+	else
+		wave = sin(params.y * n.x + t) * sin(params.y * n.y + 1.3 * t) * sin(params.y * n.z + 0.7 * t);
+	// [-1, 1] -> [-amplitude, 0]
+	return params.x * (wave - 1.0) * 0.5;
+}
+
+// p on the unit sphere
+vec3 displace_position(vec3 p, vec4 params) {
+	if (!displace || params.w < 0.5)
+		return p;
+	vec3 n = normalize(p);
+	return n * (1.0 + displace_height(n, params));
+}
+
+// the normal comes from two neighbours a small step away along the surface, and keeps the side the
+// mesh's normal was on
+vec3 displace_normal(vec3 p, vec3 normal, vec4 params) {
+	if (!displace || params.w < 0.5)
+		return normal;
+	const float eps = 0.01;
+	vec3 n = normalize(p);
+	vec3 t = normalize(cross(n, abs(n.y) < 0.99 ? vec3(0, 1, 0) : vec3(1, 0, 0)));
+	vec3 b = cross(n, t);
+	vec3 q = displace_position(n, params);
+	vec3 d = normalize(cross(displace_position(normalize(n + t * eps), params) - q, displace_position(normalize(n + b * eps), params) - q));
+	return dot(d, normal) < 0.0 ? -d : d;
+}
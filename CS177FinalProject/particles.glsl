@@ -0,0 +1,34 @@
+// one step of the gpu particle swarm, shared by particles.vsh (transform feedback) and particles.csh
+// (compute) so both paths move the spheres the same way. GpuParticles::step_cpu() in Main.cpp is the
+// same thing on the cpu, for the benchmark
+// every sphere is pulled toward the attractor (a spring up close, constant further out), slowed by drag
+// and bounced off the walls of the box, there are no sphere-sphere collisions
+
+uniform float dt;
+uniform vec3 attractor;
+uniform float attraction;
+uniform float drag;
+uniform float bound; // half the box edge
+uniform float restitution;
+
+// object: xyz = center, w = radius (left as it is)
+void particle_step(inout vec4 object, inout vec3 velocity) {
+	vec3 to = attractor - object.xyz;
+	velocity += (to * (attraction / max(length(to), 1.0)) - velocity * drag) * dt;
+	vec3 p = object.xyz + velocity * dt;
+	float limit = bound - object.w;
+	// walls: back inside, and the velocity into the wall flipped and scaled (SpherePhysics::wall())
+	for (int k = 0; k < 3; k++) {
+		if (p[k] < -limit) {
+			p[k] = -limit;
+			if (velocity[k] < 0.0)
+				velocity[k] = -velocity[k] * restitution;
+		}
+		else if (p[k] > limit) {
+			p[k] = limit;
+			if (velocity[k] > 0.0)
+				velocity[k] = -velocity[k] * restitution;
+		}
+	}
+	object.xyz = p;
+}